@@ -0,0 +1,309 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bmapfile.h"
+#include "zeroblock.h"
+#include <QCryptographicHash>
+#include <QXmlStreamReader>
+#include <QDebug>
+#include <algorithm>
+
+BmapFile::BmapFile()
+    : _valid(false), _unmappedIsZero(false), _imageSize(0), _mappedSize(0)
+{
+}
+
+void BmapFile::clear()
+{
+    _valid = _unmappedIsZero = false;
+    _error.clear();
+    _imageSize = _mappedSize = 0;
+    _ranges.clear();
+}
+
+bool BmapFile::parse(const QByteArray &xml)
+{
+    QXmlStreamReader reader(xml);
+    quint64 blockSize = 0, blocksCount = 0, mappedBlocksCount = 0, prevEnd = 0;
+    QByteArray checksumType, fileChecksum;
+    bool ok;
+
+    clear();
+
+    if (!reader.readNextStartElement() || reader.name() != QLatin1String("bmap"))
+    {
+        _error = "Not a block map file";
+        return false;
+    }
+    QString version = reader.attributes().value("version").toString();
+    if (!version.startsWith("2."))
+    {
+        _error = "Unsupported block map version: "+version;
+        return false;
+    }
+
+    while (reader.readNextStartElement())
+    {
+        if (reader.name() == QLatin1String("ImageSize"))
+        {
+            _imageSize = reader.readElementText().trimmed().toULongLong();
+        }
+        else if (reader.name() == QLatin1String("BlockSize"))
+        {
+            blockSize = reader.readElementText().trimmed().toULongLong();
+        }
+        else if (reader.name() == QLatin1String("BlocksCount"))
+        {
+            blocksCount = reader.readElementText().trimmed().toULongLong();
+        }
+        else if (reader.name() == QLatin1String("MappedBlocksCount"))
+        {
+            mappedBlocksCount = reader.readElementText().trimmed().toULongLong();
+        }
+        else if (reader.name() == QLatin1String("ChecksumType"))
+        {
+            checksumType = reader.readElementText().trimmed().toLatin1();
+        }
+        else if (reader.name() == QLatin1String("UnmappedIsZero"))
+        {
+            _unmappedIsZero = reader.readElementText().trimmed() == "true";
+        }
+        else if (reader.name() == QLatin1String("BmapFileChecksum"))
+        {
+            fileChecksum = reader.readElementText().trimmed().toLatin1();
+        }
+        else if (reader.name() == QLatin1String("BlockMap"))
+        {
+            if (!blockSize)
+            {
+                _error = "BlockSize missing or specified after BlockMap";
+                return false;
+            }
+
+            while (reader.readNextStartElement())
+            {
+                if (reader.name() != QLatin1String("Range"))
+                {
+                    reader.skipCurrentElement();
+                    continue;
+                }
+
+                Range r;
+                quint64 first, last;
+                r.sha256 = reader.attributes().value("chksum").toLatin1().toLower();
+                QString blocks = reader.readElementText().trimmed();
+                int dash = blocks.indexOf('-');
+
+                first = blocks.left(dash).trimmed().toULongLong(&ok);
+                if (ok)
+                    last = (dash == -1) ? first : blocks.mid(dash+1).trimmed().toULongLong(&ok);
+                if (!ok || last < first || first*blockSize < prevEnd || r.sha256.isEmpty())
+                {
+                    _error = "Invalid range in block map: "+blocks;
+                    return false;
+                }
+
+                r.offset = first*blockSize;
+                r.length = (last+1)*blockSize - r.offset;
+                prevEnd = r.offset+r.length;
+                _ranges.append(r);
+            }
+        }
+        else
+        {
+            reader.skipCurrentElement();
+        }
+    }
+
+    if (reader.hasError())
+    {
+        _error = reader.errorString();
+        return false;
+    }
+    if (checksumType != "sha256")
+    {
+        _error = "Unsupported block map checksum type: "+checksumType;
+        return false;
+    }
+    if (!_imageSize || !blockSize || blocksCount != (_imageSize+blockSize-1)/blockSize)
+    {
+        _error = "Inconsistent image size in block map";
+        return false;
+    }
+    if (!fileChecksum.isEmpty() && !_checkFileChecksum(xml, fileChecksum))
+    {
+        _error = "Block map file checksum mismatch";
+        return false;
+    }
+
+    /* The last block of the image may be partial */
+    if (!_ranges.isEmpty() && prevEnd > _imageSize)
+    {
+        Range &last = _ranges.last();
+        if (last.offset >= _imageSize)
+        {
+            _error = "Block map range past end of image";
+            return false;
+        }
+        last.length = _imageSize-last.offset;
+    }
+
+    for (const auto &r : std::as_const(_ranges))
+        _mappedSize += r.length;
+
+    if ((_mappedSize+blockSize-1)/blockSize != mappedBlocksCount)
+    {
+        _error = "Inconsistent mapped block count in block map";
+        return false;
+    }
+
+    _valid = true;
+    return true;
+}
+
+/* The file checksum is calculated with the checksum itself replaced by zeroes */
+bool BmapFile::_checkFileChecksum(const QByteArray &xml, const QByteArray &checksum)
+{
+    QByteArray copy = xml;
+    int pos = copy.indexOf(checksum);
+    if (pos == -1)
+        return false;
+    copy.replace(pos, checksum.size(), QByteArray(checksum.size(), '0'));
+
+    return QCryptographicHash::hash(copy, QCryptographicHash::Sha256).toHex() == checksum.toLower();
+}
+
+bool BmapFile::isValid() const
+{
+    return _valid;
+}
+
+bool BmapFile::unmappedIsZero() const
+{
+    return _unmappedIsZero;
+}
+
+QString BmapFile::errorString() const
+{
+    return _error;
+}
+
+quint64 BmapFile::imageSize() const
+{
+    return _imageSize;
+}
+
+quint64 BmapFile::mappedSize() const
+{
+    return _mappedSize;
+}
+
+const QList<BmapFile::Range> &BmapFile::ranges() const
+{
+    return _ranges;
+}
+
+BmapGenerator::BmapGenerator(quint32 blockSize)
+    : _blockSize(blockSize), _imageSize(0), _mappedBlocks(0), _rangeFirst(0)
+{
+}
+
+BmapGenerator::~BmapGenerator()
+{
+}
+
+void BmapGenerator::addData(const char *buf, size_t len)
+{
+    if (!_partial.isEmpty())
+    {
+        size_t fill = qMin(len, (size_t) (_blockSize-_partial.size()));
+        _partial.append(buf, fill);
+        buf += fill;
+        len -= fill;
+        if ((quint32) _partial.size() < _blockSize)
+            return;
+        _addBlock(_partial.constData(), _blockSize);
+        _partial.clear();
+    }
+
+    while (len >= _blockSize)
+    {
+        _addBlock(buf, _blockSize);
+        buf += _blockSize;
+        len -= _blockSize;
+    }
+
+    if (len)
+        _partial.append(buf, len);
+}
+
+void BmapGenerator::_addBlock(const char *buf, size_t len)
+{
+    bool zero;
+    quint64 block = _imageSize/_blockSize;
+
+    if ((quintptr) buf % 16 || len % 64)
+        zero = std::all_of(buf, buf+len, [](char c) { return c == 0; });
+    else
+        zero = isZeroBlock(buf, len);
+
+    if (zero)
+    {
+        _endRange();
+    }
+    else
+    {
+        if (!_rangeHash)
+        {
+            _rangeHash = std::make_unique<AcceleratedCryptographicHash>(QCryptographicHash::Sha256);
+            _rangeFirst = block;
+        }
+        _rangeHash->addData(buf, len);
+        _mappedBlocks++;
+    }
+
+    _imageSize += len;
+}
+
+void BmapGenerator::_endRange()
+{
+    if (!_rangeHash)
+        return;
+
+    quint64 last = (_imageSize-1)/_blockSize;
+    QByteArray blocks = QByteArray::number(_rangeFirst);
+    if (last != _rangeFirst)
+        blocks += "-"+QByteArray::number(last);
+
+    _xmlRanges += "        <Range chksum=\""+_rangeHash->result().toHex()+"\">"+blocks+"</Range>\n";
+    _rangeHash.reset();
+}
+
+QByteArray BmapGenerator::toXml()
+{
+    if (!_partial.isEmpty())
+    {
+        _addBlock(_partial.constData(), _partial.size());
+        _partial.clear();
+    }
+    _endRange();
+
+    QByteArray placeholder(64, '0');
+    QByteArray xml = "<?xml version=\"1.0\" ?>\n"
+                     "<bmap version=\"2.0\">\n"
+                     "    <ImageSize> "+QByteArray::number(_imageSize)+" </ImageSize>\n"
+                     "    <BlockSize> "+QByteArray::number(_blockSize)+" </BlockSize>\n"
+                     "    <BlocksCount> "+QByteArray::number((_imageSize+_blockSize-1)/_blockSize)+" </BlocksCount>\n"
+                     "    <MappedBlocksCount> "+QByteArray::number(_mappedBlocks)+" </MappedBlocksCount>\n"
+                     "    <ChecksumType> sha256 </ChecksumType>\n"
+                     "    <UnmappedIsZero> true </UnmappedIsZero>\n"
+                     "    <BmapFileChecksum> "+placeholder+" </BmapFileChecksum>\n"
+                     "    <BlockMap>\n"
+                     +_xmlRanges+
+                     "    </BlockMap>\n"
+                     "</bmap>\n";
+
+    return xml.replace(placeholder, QCryptographicHash::hash(xml, QCryptographicHash::Sha256).toHex());
+}
@@ -0,0 +1,108 @@
+#ifndef BMAPFILE_H
+#define BMAPFILE_H
+
+/*
+ * Parser for bmaptool style .bmap block map files
+ *
+ * A block map lists which blocks of a disk image actually contain data,
+ * together with a checksum of each range of mapped blocks.
+ * Only format version 2.x with SHA-256 checksums is supported.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <memory>
+#include "acceleratedcryptographichash.h"
+
+class BmapFile
+{
+public:
+    struct Range
+    {
+        quint64 offset, length;
+        QByteArray sha256;
+    };
+
+    BmapFile();
+
+    /*
+     * Parse block map XML
+     * Returns false if the data is not a valid or supported block map
+     */
+    bool parse(const QByteArray &xml);
+
+    /*
+     * Forget any previously parsed block map
+     */
+    void clear();
+
+    bool isValid() const;
+    QString errorString() const;
+
+    /*
+     * True if the block map was generated by BmapGenerator from the image contents.
+     * Unmapped ranges then contain zeroes, and must not be left with arbitrary data.
+     */
+    bool unmappedIsZero() const;
+
+    /*
+     * Size of the uncompressed image in bytes
+     */
+    quint64 imageSize() const;
+
+    /*
+     * Total number of bytes in mapped ranges
+     */
+    quint64 mappedSize() const;
+
+    /*
+     * Mapped ranges in ascending order, in bytes.
+     * The last range does not extend past the end of the image.
+     */
+    const QList<Range> &ranges() const;
+
+protected:
+    bool _valid, _unmappedIsZero;
+    QString _error;
+    quint64 _imageSize, _mappedSize;
+    QList<Range> _ranges;
+
+    bool _checkFileChecksum(const QByteArray &xml, const QByteArray &checksum);
+};
+
+/*
+ * Generates a block map while an image is streamed through it,
+ * mapping every block that is not all zeroes
+ */
+class BmapGenerator
+{
+public:
+    explicit BmapGenerator(quint32 blockSize);
+    ~BmapGenerator();
+
+    /*
+     * Add the next part of the image. Must be called in order.
+     */
+    void addData(const char *buf, size_t len);
+
+    /*
+     * Finish the block map, and return it as XML
+     */
+    QByteArray toXml();
+
+protected:
+    quint32 _blockSize;
+    quint64 _imageSize, _mappedBlocks;
+    QByteArray _partial, _xmlRanges;
+    quint64 _rangeFirst;
+    std::unique_ptr<AcceleratedCryptographicHash> _rangeHash;
+
+    void _addBlock(const char *buf, size_t len);
+    void _endRange();
+};
+
+#endif // BMAPFILE_H
@@ -0,0 +1,349 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bzip2decoder.h"
+#include <string.h>
+#include <array>
+#include <QtEndian>
+#include <QDebug>
+
+#define BZIP2_BLOCK_MAGIC   0x314159265359ULL
+#define BZIP2_EOS_MAGIC     0x177245385090ULL
+#define BZIP2_MAGIC_MASK    0xFFFFFFFFFFFFULL
+
+/* Block magic, block CRC, randomised flag, origPtr */
+#define BZIP2_BLOCK_HEADER_BITS (48+32+1+24)
+/* End of stream magic, combined CRC */
+#define BZIP2_EOS_BITS          (48+32)
+
+/* For each value of the byte following the first one of a magic: bit k (block) or 8+k (end of stream) set if it matches the magic at bit offset k */
+static const std::array<quint16, 256> magicTable = [] {
+    std::array<quint16, 256> t = {};
+    for (int k = 0; k < 8; k++)
+    {
+        t[(BZIP2_BLOCK_MAGIC >> (32+k)) & 0xFF] |= 1 << k;
+        t[(BZIP2_EOS_MAGIC >> (32+k)) & 0xFF] |= 0x100 << k;
+    }
+    return t;
+}();
+
+/* Read n <= 57 bits starting at bit pos, most significant bit first. Bits past len bytes read as 0 */
+static inline quint64 readBits(const uint8_t *data, size_t len, size_t pos, int n)
+{
+    quint64 v = 0;
+    size_t i = pos/8;
+
+    for (int j = 0; j < 8; j++, i++)
+        v = (v << 8) | (i < len ? data[i] : 0);
+
+    return (v << (pos % 8)) >> (64-n);
+}
+
+/* Append nbits of src starting at bit pos to dst, which must be byte aligned */
+static void appendBits(QByteArray &dst, const uint8_t *src, size_t pos, size_t nbits)
+{
+    const uint8_t *p = src+pos/8;
+    int shift = pos % 8;
+    size_t nbytes = (nbits+7)/8;
+    size_t start = dst.size();
+
+    dst.resize(start+nbytes);
+    uint8_t *d = (uint8_t *) dst.data()+start;
+
+    if (shift)
+    {
+        /* Reads at most one byte past the last bit, which is still within the block's data */
+        for (size_t i = 0; i < nbytes; i++)
+            d[i] = (p[i] << shift) | (p[i+1] >> (8-shift));
+    }
+    else
+    {
+        memcpy(d, p, nbytes);
+    }
+
+    if (nbits % 8)
+        d[nbytes-1] &= 0xFF << (8 - nbits % 8);
+}
+
+/* OR n <= 32 bits of v into dst starting at bit pos, growing dst as needed */
+static void putBits(QByteArray &dst, size_t pos, quint64 v, int n)
+{
+    size_t needed = (pos+n+7)/8;
+    if ((size_t) dst.size() < needed)
+        dst.append(QByteArray(needed-dst.size(), 0));
+
+    uint8_t *d = (uint8_t *) dst.data();
+    for (int i = 0; i < n; i++, pos++)
+    {
+        if (v & (1ULL << (n-1-i)))
+            d[pos/8] |= 0x80 >> (pos % 8);
+    }
+}
+
+Bzip2Decoder::Bzip2Decoder(uint32_t threads, size_t maxFrameSize)
+    : ParallelFrameDecoder(threads, maxFrameSize), _state(StreamHeader), _bitOffset(0), _scanned(0), _level('9'),
+      _combinedCRC(0), _bzInitialized(false)
+{
+    memset(&_bz, 0, sizeof(_bz));
+}
+
+Bzip2Decoder::~Bzip2Decoder()
+{
+    _waitForWorkers();
+    if (_bzInitialized)
+        BZ2_bzDecompressEnd(&_bz);
+}
+
+bool Bzip2Decoder::isBzip2(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    if (len < 12 || memcmp(p, "BZh", 3) != 0 || p[3] < '1' || p[3] > '9')
+        return false;
+
+    quint64 magic = readBits(p+4, len-4, 0, 48);
+    return magic == BZIP2_BLOCK_MAGIC || magic == BZIP2_EOS_MAGIC;
+}
+
+ParallelFrameDecoder::FrameStatus Bzip2Decoder::_findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    if (_state == TrailingGarbage)
+    {
+        frameLen = len;
+        return FrameSkip;
+    }
+
+    if (_state == StreamHeader)
+    {
+        if (len < 4)
+            return FrameIncomplete;
+
+        if (memcmp(p, "BZh", 3) != 0 || p[3] < '1' || p[3] > '9')
+        {
+            /* Like bzip2, ignore anything after the last stream that is not another stream */
+            qDebug() << "Ignoring trailing garbage after bzip2 data";
+            _state = TrailingGarbage;
+            frameLen = len;
+            return FrameSkip;
+        }
+
+        _level = p[3];
+        _combinedCRC = 0;
+        _state = Blocks;
+        _bitOffset = 0;
+        frameLen = 4;
+        return FrameSkip;
+    }
+
+    size_t start = _bitOffset;
+    size_t availBits = len*8;
+
+    if (start+BZIP2_EOS_BITS > availBits)
+        return FrameIncomplete;
+
+    quint64 magic = readBits(p, len, start, 48);
+
+    if (magic == BZIP2_EOS_MAGIC)
+    {
+        quint32 storedCRC = readBits(p, len, start+48, 32);
+        if (storedCRC != _combinedCRC)
+        {
+            _error = "bzip2 stream CRC mismatch";
+            return FrameError;
+        }
+
+        /* Next stream starts at a byte boundary */
+        frameLen = (start+BZIP2_EOS_BITS+7)/8;
+        _state = StreamHeader;
+        return FrameSkip;
+    }
+    if (magic != BZIP2_BLOCK_MAGIC)
+    {
+        _error = "bzip2 data is corrupt";
+        return FrameError;
+    }
+
+    /* Find where the block ends: the next block, or the end of stream marker */
+    quint32 blockCRC = readBits(p, len, start+48, 32);
+    quint32 combinedCRC = ((_combinedCRC << 1) | (_combinedCRC >> 31)) ^ blockCRC;
+    size_t maxBlockBytes = (_level-'0')*100000*5/4 + 1024;
+    size_t from = qMax(start+BZIP2_BLOCK_HEADER_BITS, _scanned*8);
+    size_t end = 0;
+    bool needMore = false;
+
+    for (size_t i = from/8; !end && !needMore && i+1 < len && i*8+BZIP2_EOS_BITS <= availBits; i++)
+    {
+        /* Candidate bit offsets, going by the second byte of the magic */
+        quint16 candidates = magicTable[p[i+1]];
+
+        for (int k = 0; candidates && k < 8; k++)
+        {
+            size_t pos = i*8+k;
+            if (!(candidates & (0x101 << k)) || pos < from || pos+BZIP2_EOS_BITS > availBits)
+                continue;
+
+            magic = readBits(p, len, pos, 48);
+            if (magic == BZIP2_EOS_MAGIC)
+            {
+                /* The real end of stream marker is followed by the CRC of all blocks, this one included.
+                   Anything else is the magic turning up inside compressed data by chance. Keep looking */
+                if (readBits(p, len, pos+48, 32) == combinedCRC)
+                {
+                    end = pos;
+                    break;
+                }
+                continue;
+            }
+            if (magic == BZIP2_BLOCK_MAGIC)
+            {
+                if (pos+BZIP2_BLOCK_HEADER_BITS > availBits)
+                {
+                    needMore = true;
+                    break;
+                }
+
+                /* Skip false positives inside compressed data that cannot be a block header */
+                quint64 randomised = readBits(p, len, pos+80, 1);
+                quint64 origPtr = readBits(p, len, pos+81, 24);
+                if (!randomised && origPtr < (quint64) (_level-'0')*100000)
+                {
+                    end = pos;
+                    break;
+                }
+            }
+        }
+
+        if (!end && !needMore)
+            _scanned = i;
+    }
+
+    if (!end)
+    {
+        if (_scanned > maxBlockBytes)
+        {
+            _error = "bzip2 block is too large, or data is corrupt";
+            return FrameError;
+        }
+        return FrameIncomplete;
+    }
+
+    /* Make the block a stream of its own: header, block, end of stream marker, and CRC (same as block CRC for a single block) */
+    size_t blockBits = end-start;
+
+    frame.reserve(4+blockBits/8+12);
+    frame.append("BZh", 3);
+    frame.append(_level);
+    appendBits(frame, p, start, blockBits);
+    putBits(frame, 32+blockBits, BZIP2_EOS_MAGIC >> 16, 32);
+    putBits(frame, 32+blockBits+32, BZIP2_EOS_MAGIC & 0xFFFF, 16);
+    putBits(frame, 32+blockBits+48, blockCRC, 32);
+
+    _combinedCRC = combinedCRC;
+    _scanned = 0;
+    _bitOffset = end % 8;
+    frameLen = end/8;
+
+    return FrameComplete;
+}
+
+/* Worker thread. Decoded size is not known up front, as run length encoding makes it up to ~45 MB for a 900k block */
+void Bzip2Decoder::_decodeFrame(Frame *f)
+{
+    bz_stream bz;
+    memset(&bz, 0, sizeof(bz));
+    if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+    {
+        f->error = "Error initializing bzip2 decoder";
+        return;
+    }
+
+    bz.next_in = f->compressed.data();
+    bz.avail_in = f->compressed.size();
+    size_t used = 0;
+
+    while (true)
+    {
+        if (used == (size_t) f->output.size())
+        {
+            if (used >= _maxFrameSize)
+            {
+                /* Leave it to the consumer to decode this one as a stream */
+                f->output.clear();
+                f->serial = true;
+                break;
+            }
+            f->output.resize(qMin(_maxFrameSize, qMax(used*2, (size_t) 1024*1024)));
+        }
+
+        bz.next_out = f->output.data()+used;
+        bz.avail_out = f->output.size()-used;
+        int r = BZ2_bzDecompress(&bz);
+        used = f->output.size()-bz.avail_out;
+
+        if (r == BZ_STREAM_END)
+        {
+            f->output.resize(used);
+            break;
+        }
+        if (r != BZ_OK)
+        {
+            f->error = "bzip2 data is corrupt";
+            break;
+        }
+        if (!bz.avail_in && bz.avail_out)
+        {
+            f->error = "Unexpected end of bzip2 block";
+            break;
+        }
+    }
+
+    BZ2_bzDecompressEnd(&bz);
+}
+
+/* Only used for frames that turned out too large for the workers. Those are streams of their own */
+bool Bzip2Decoder::_decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd)
+{
+    if (!_bzInitialized)
+    {
+        if (BZ2_bzDecompressInit(&_bz, 0, 0) != BZ_OK)
+        {
+            _error = "Error initializing bzip2 decoder";
+            return false;
+        }
+        _bzInitialized = true;
+    }
+
+    _bz.next_in = (char *) in;
+    _bz.avail_in = inLen;
+    _bz.next_out = (char *) out;
+    _bz.avail_out = outLen;
+
+    int r = BZ2_bzDecompress(&_bz);
+
+    in += inLen-_bz.avail_in;
+    inLen = _bz.avail_in;
+    out += outLen-_bz.avail_out;
+    outLen = _bz.avail_out;
+
+    if (r == BZ_STREAM_END)
+    {
+        BZ2_bzDecompressEnd(&_bz);
+        _bzInitialized = false;
+        atFrameEnd = true;
+    }
+    else if (r != BZ_OK)
+    {
+        _error = "bzip2 data is corrupt";
+        return false;
+    }
+    else
+    {
+        atFrameEnd = false;
+    }
+
+    return true;
+}
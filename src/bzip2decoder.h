@@ -0,0 +1,53 @@
+#ifndef BZIP2DECODER_H
+#define BZIP2DECODER_H
+
+/*
+ * .bz2 decompression that decodes blocks in parallel, like lbzip2
+ *
+ * bzip2 blocks are compressed independently, but not byte aligned and
+ * their length is not stored. The input is scanned for the 48-bit block
+ * and end of stream magic at every bit offset. Each block found is shifted
+ * into a stream of its own, and decoded by libbz2 on a worker thread.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "parallelframedecoder.h"
+#include <bzlib.h>
+
+class Bzip2Decoder : public ParallelFrameDecoder
+{
+public:
+    Bzip2Decoder(uint32_t threads, size_t maxFrameSize);
+    virtual ~Bzip2Decoder();
+
+    /*
+     * Returns true if data starts with a bzip2 stream header
+     */
+    static bool isBzip2(const void *data, size_t len);
+
+protected:
+    enum State
+    {
+        StreamHeader,
+        Blocks,
+        TrailingGarbage
+    };
+
+    State _state;
+    /* Bit offset of the current block or end of stream marker in the first byte of data */
+    int _bitOffset;
+    /* Bytes of the current block scanned so far without finding its end */
+    size_t _scanned;
+    char _level;
+    quint32 _combinedCRC;
+    bz_stream _bz;
+    bool _bzInitialized;
+
+    virtual FrameStatus _findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame);
+    virtual void _decodeFrame(Frame *f);
+    virtual bool _decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd);
+};
+
+#endif // BZIP2DECODER_H
@@ -0,0 +1,279 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachetranscoder.h"
+#include "zeroblock.h"
+#include <QFileInfo>
+#include <QtEndian>
+#include <QDebug>
+#include <zstd.h>
+
+/* Number of frames that can be pending before addData() blocks */
+#define CACHETRANSCODER_BUFFERS   4
+
+/* Granularity of holes left in raw images. Matches the block size of common file systems */
+#define CACHETRANSCODER_HOLE_SIZE 4096
+
+/* Seekable zstd format: seek table is a skippable frame at the end of the file */
+#define ZSTD_SEEKABLE_MAGIC       0x8F92EAB1
+#define ZSTD_SEEKTABLE_MAGIC      (ZSTD_MAGIC_SKIPPABLE_START | 0xE)
+
+CacheTranscoder::CacheTranscoder(const QString &fileName, Format format, size_t frameSize, int level)
+    : _file(fileName), _format(format), _frameSize(frameSize), _level(level), _offset(0), _current({nullptr, 0}),
+      _stop(false), _failed(false), _finished(false)
+{
+    for (int i = 0; i < CACHETRANSCODER_BUFFERS; i++)
+    {
+        char *buf = (char *) qMallocAligned(_frameSize, 4096);
+        _buffers.push_back(buf);
+        _free.push_back(buf);
+    }
+
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered))
+    {
+        _error = QString("Error creating %1: %2").arg(fileName, _file.errorString());
+        _failed = true;
+    }
+
+    _thread = std::thread(&CacheTranscoder::_run, this);
+}
+
+CacheTranscoder::~CacheTranscoder()
+{
+    if (_thread.joinable())
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+        lock.unlock();
+        _frameAvailable.notify_one();
+        _thread.join();
+    }
+
+    if (!_finished)
+    {
+        _file.close();
+        _file.remove();
+    }
+
+    for (char *buf : _buffers)
+        qFreeAligned(buf);
+}
+
+bool CacheTranscoder::formatFromString(const QString &name, Format &format)
+{
+    if (name == "raw")
+        format = Raw;
+    else if (name == "zstd")
+        format = Zstd;
+    else
+        return false;
+
+    return true;
+}
+
+QString CacheTranscoder::errorString() const
+{
+    return _error;
+}
+
+void CacheTranscoder::addData(const char *buf, size_t len)
+{
+    while (len)
+    {
+        if (!_current.buf)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _bufferAvailable.wait(lock, [this]{
+                return !_free.empty();
+            });
+            if (_failed)
+                return;
+            _current.buf = _free.back();
+            _current.len = 0;
+            _free.pop_back();
+        }
+
+        size_t n = qMin(len, _frameSize-_current.len);
+        memcpy(_current.buf+_current.len, buf, n);
+        _current.len += n;
+        buf += n;
+        len -= n;
+
+        if (_current.len == _frameSize)
+            _queueFrame();
+    }
+}
+
+void CacheTranscoder::_queueFrame()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _queue.push_back(_current);
+    _current = {nullptr, 0};
+    lock.unlock();
+    _frameAvailable.notify_one();
+}
+
+bool CacheTranscoder::finish()
+{
+    if (_current.buf)
+        _queueFrame();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stop = true;
+    lock.unlock();
+    _frameAvailable.notify_one();
+    _thread.join();
+
+    if (!_failed)
+    {
+        if (_format == Raw && !_file.resize(_offset))
+        {
+            /* Extends the file over trailing zeros that were skipped */
+            _error = QString("Error setting size of %1: %2").arg(_file.fileName(), _file.errorString());
+            _failed = true;
+        }
+        else if (_format == Zstd && !_writeSeekTable())
+        {
+            _failed = true;
+        }
+    }
+    _file.close();
+
+    if (_failed)
+    {
+        qDebug() << "Not keeping transcoded cache file:" << _error;
+        _file.remove();
+        return false;
+    }
+
+    qDebug() << "Stored" << _offset << "bytes of image in" << _file.fileName() << "of" << QFileInfo(_file).size() << "bytes";
+    _finished = true;
+
+    return true;
+}
+
+void CacheTranscoder::_run()
+{
+    ZSTD_CCtx *cctx = nullptr;
+    QByteArray out;
+
+    if (_format == Zstd)
+    {
+        cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, _level);
+        out.resize(ZSTD_compressBound(_frameSize));
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _frameAvailable.wait(lock, [this]{
+            return !_queue.empty() || _stop;
+        });
+        if (_queue.empty())
+            break;
+
+        Frame frame = _queue.front();
+        _queue.pop_front();
+        bool failed = _failed;
+        lock.unlock();
+
+        /* Frames that arrive after an error are only recycled */
+        if (!failed)
+            failed = !(_format == Raw ? _storeRaw(frame) : _storeZstd(frame, cctx, out));
+
+        lock.lock();
+        _failed = failed;
+        _free.push_back(frame.buf);
+        _bufferAvailable.notify_one();
+    }
+    lock.unlock();
+
+    ZSTD_freeCCtx(cctx);
+}
+
+/* Write the frame at its position in the image, skipping blocks of zeros */
+bool CacheTranscoder::_storeRaw(const Frame &frame)
+{
+    size_t pos = 0;
+
+    while (pos < frame.len)
+    {
+        /* Find next run of data */
+        while (pos+CACHETRANSCODER_HOLE_SIZE <= frame.len && isZeroBlock(frame.buf+pos, CACHETRANSCODER_HOLE_SIZE))
+            pos += CACHETRANSCODER_HOLE_SIZE;
+        if (pos == frame.len)
+            break;
+
+        size_t end = pos;
+        while (end < frame.len)
+        {
+            size_t blockLen = qMin((size_t) CACHETRANSCODER_HOLE_SIZE, frame.len-end);
+            if (blockLen == CACHETRANSCODER_HOLE_SIZE && isZeroBlock(frame.buf+end, blockLen))
+                break;
+            end += blockLen;
+        }
+
+        if (!_file.seek(_offset+pos) || _file.write(frame.buf+pos, end-pos) != (qint64) (end-pos))
+        {
+            _error = QString("Error writing to %1: %2").arg(_file.fileName(), _file.errorString());
+            return false;
+        }
+        pos = end;
+    }
+    _offset += frame.len;
+
+    return true;
+}
+
+/* Compress the frame as a zstd frame of its own, and note its size for the seek table */
+bool CacheTranscoder::_storeZstd(const Frame &frame, void *cctx, QByteArray &out)
+{
+    size_t len = ZSTD_compress2((ZSTD_CCtx *) cctx, out.data(), out.size(), frame.buf, frame.len);
+
+    if (ZSTD_isError(len))
+    {
+        _error = QString("Error compressing cache file: %1").arg(ZSTD_getErrorName(len));
+        return false;
+    }
+    if (_file.write(out.constData(), len) != (qint64) len)
+    {
+        _error = QString("Error writing to %1: %2").arg(_file.fileName(), _file.errorString());
+        return false;
+    }
+    _seekTable.push_back(len);
+    _seekTable.push_back(frame.len);
+    _offset += frame.len;
+
+    return true;
+}
+
+/* Seek table of the zstd seekable format: compressed and decompressed size of each frame */
+bool CacheTranscoder::_writeSeekTable()
+{
+    QByteArray table;
+    auto append32 = [&table](quint32 value) {
+        char buf[4];
+        qToLittleEndian(value, buf);
+        table.append(buf, sizeof(buf));
+    };
+    quint32 numFrames = _seekTable.size()/2;
+
+    append32(ZSTD_SEEKTABLE_MAGIC);
+    append32(numFrames*8+9);
+    for (uint32_t value : _seekTable)
+        append32(value);
+    append32(numFrames);
+    table.append('\0'); /* Descriptor: no checksums */
+    append32(ZSTD_SEEKABLE_MAGIC);
+
+    if (_file.write(table) != table.size())
+    {
+        _error = QString("Error writing to %1: %2").arg(_file.fileName(), _file.errorString());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef CACHETRANSCODER_H
+#define CACHETRANSCODER_H
+
+/*
+ * Stores the extracted image in a form that is faster to write again than the download
+ *
+ * - Raw: uncompressed image, with ranges of zeros left as holes in a sparse file
+ * - Zstd: seekable zstd file of independently compressed frames, which the zstd
+ *   decoder decompresses in parallel
+ *
+ * Data is collected in frames, that are stored by a worker thread, so that
+ * compressing and writing the cache file does not hold up writing the image.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QString>
+#include <QByteArray>
+#include <QFile>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <stddef.h>
+
+class CacheTranscoder
+{
+public:
+    enum Format {
+        Raw,
+        Zstd
+    };
+
+    /*
+     * Constructor
+     *
+     * - fileName: file to store the image in. Removed again if finish() is not called, or fails
+     * - format: form to store the image in
+     * - frameSize: amount of data compressed as one zstd frame, multiple of 4096
+     * - level: zstd compression level
+     */
+    CacheTranscoder(const QString &fileName, Format format, size_t frameSize, int level);
+    virtual ~CacheTranscoder();
+
+    /*
+     * Parse format name as used in the settings. Returns false for "compressed", or unknown names
+     */
+    static bool formatFromString(const QString &name, Format &format);
+
+    /*
+     * Append extracted image data. Called with all of the image, in order
+     */
+    void addData(const char *buf, size_t len);
+
+    /*
+     * Store what is left, and close the file. Returns false on error
+     */
+    bool finish();
+
+    QString errorString() const;
+
+protected:
+    struct Frame
+    {
+        char *buf;
+        size_t len;
+    };
+
+    QFile _file;
+    Format _format;
+    size_t _frameSize;
+    int _level;
+    quint64 _offset;
+    Frame _current;
+    std::deque<Frame> _queue;
+    std::vector<char *> _free, _buffers;
+    std::vector<uint32_t> _seekTable;
+    bool _stop, _failed, _finished;
+    QString _error;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _frameAvailable, _bufferAvailable;
+
+    void _run();
+    void _queueFrame();
+    bool _storeRaw(const Frame &frame);
+    bool _storeZstd(const Frame &frame, void *cctx, QByteArray &out);
+    bool _writeSeekTable();
+};
+
+#endif // CACHETRANSCODER_H
@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "chunkdigests.h"
+
+#define XXH_INLINE_ALL
+#include <common/xxhash.h>
+
+struct ChunkDigestsState
+{
+    XXH64_state_t xxh;
+};
+
+ChunkDigests::ChunkDigests(size_t chunkSize)
+    : _chunkSize(chunkSize), _chunkUsed(0), _state(new ChunkDigestsState)
+{
+    XXH64_reset(&_state->xxh, 0);
+}
+
+ChunkDigests::~ChunkDigests()
+{
+}
+
+void ChunkDigests::addData(const char *buf, size_t len)
+{
+    while (len)
+    {
+        size_t n = qMin(len, _chunkSize-_chunkUsed);
+        XXH64_update(&_state->xxh, buf, n);
+        _chunkUsed += n;
+        buf += n;
+        len -= n;
+
+        if (_chunkUsed == _chunkSize)
+        {
+            _digests.append(XXH64_digest(&_state->xxh));
+            XXH64_reset(&_state->xxh, 0);
+            _chunkUsed = 0;
+        }
+    }
+}
+
+void ChunkDigests::reset()
+{
+    _digests.clear();
+    _chunkUsed = 0;
+    XXH64_reset(&_state->xxh, 0);
+}
+
+void ChunkDigests::setDigests(const QList<quint64> &digests)
+{
+    reset();
+    _digests = digests;
+}
+
+size_t ChunkDigests::chunkSize() const
+{
+    return _chunkSize;
+}
+
+QList<quint64> ChunkDigests::digests() const
+{
+    QList<quint64> d = _digests;
+    if (_chunkUsed)
+        d.append(XXH64_digest(&_state->xxh));
+
+    return d;
+}
+
+QList<quint64> ChunkDigests::mismatches(const ChunkDigests &other) const
+{
+    QList<quint64> a = digests(), b = other.digests(), offsets;
+
+    for (qsizetype i = 0; i < qMax(a.size(), b.size()); i++)
+    {
+        if (i >= a.size() || i >= b.size() || a[i] != b[i])
+            offsets.append((quint64) i*_chunkSize);
+    }
+
+    return offsets;
+}
+
+quint64 ChunkDigests::digest(const char *buf, size_t len)
+{
+    return XXH64(buf, len, 0);
+}
@@ -0,0 +1,66 @@
+#ifndef CHUNKDIGESTS_H
+#define CHUNKDIGESTS_H
+
+/*
+ * List of digests of fixed size chunks of an image
+ *
+ * Kept next to the SHA-256 of the whole image, so that a verify
+ * failure can be narrowed down to the chunks that differ.
+ * Uses XXH64 from the bundled zstd, which is fast enough to not
+ * slow down the hash stage noticeably.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QList>
+#include <memory>
+
+struct ChunkDigestsState;
+
+class ChunkDigests
+{
+public:
+    ChunkDigests(size_t chunkSize);
+    virtual ~ChunkDigests();
+
+    /*
+     * Add data following what was added before
+     */
+    void addData(const char *buf, size_t len);
+
+    /*
+     * Forget all data added so far
+     */
+    void reset();
+
+    /*
+     * Replace what was added so far with digests calculated elsewhere
+     */
+    void setDigests(const QList<quint64> &digests);
+
+    size_t chunkSize() const;
+
+    /*
+     * Digests of all chunks, including the last incomplete one
+     */
+    QList<quint64> digests() const;
+
+    /*
+     * Offsets of the chunks that differ between this and other.
+     * Chunks only present in one of them are included
+     */
+    QList<quint64> mismatches(const ChunkDigests &other) const;
+
+    /*
+     * Digest of a single chunk of data
+     */
+    static quint64 digest(const char *buf, size_t len);
+
+protected:
+    size_t _chunkSize, _chunkUsed;
+    QList<quint64> _digests;
+    std::unique_ptr<ChunkDigestsState> _state;
+};
+
+#endif // CHUNKDIGESTS_H
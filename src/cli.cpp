@@ -17,7 +17,7 @@ static void devnullMsgHandler(QtMsgType, const QMessageLogContext &, const QStri
 {
 }
 
-Cli::Cli(int &argc, char *argv[]) : QObject(nullptr)
+Cli::Cli(int &argc, char *argv[]) : QObject(nullptr), _rateBytes(0)
 {
 #ifdef Q_OS_WIN
     /* Allocate console on Windows (only needed if compiled as GUI program) */
@@ -38,6 +38,7 @@ Cli::Cli(int &argc, char *argv[]) : QObject(nullptr)
     connect(_imageWriter, &ImageWriter::preparationStatusUpdate, this, &Cli::onPreparationStatusUpdate);
     connect(_imageWriter, &ImageWriter::downloadProgress, this, &Cli::onDownloadProgress);
     connect(_imageWriter, &ImageWriter::verifyProgress, this, &Cli::onVerifyProgress);
+    connect(_imageWriter, &ImageWriter::deviceResult, this, &Cli::onDeviceResult);
 }
 
 Cli::~Cli()
@@ -55,22 +56,40 @@ int Cli::run()
         {"enable-writing-system-drives", "Only use this if you know what you are doing"},
         {"sha256", "Expected hash", "sha256", ""},
         {"cache-file", "Custom cache file (requires setting sha256 as well)", "cache-file", ""},
+        {"cache-quota", "Maximum size in GB of all cached images together (0 for no limit)", "size", QString::number(IMAGEWRITER_CACHE_QUOTA)},
+        {"cache-format", "Format to cache images in: compressed, raw or zstd", "format", IMAGEWRITER_CACHE_FORMAT},
         {"first-run-script", "Add firstrun.sh to image", "first-run-script", ""},
         {"cloudinit-userdata", "Add cloud-init user-data file to image", "cloudinit-userdata", ""},
         {"cloudinit-networkconfig", "Add cloud-init network-config file to image", "cloudinit-networkconfig", ""},
         {"disable-eject", "Disable automatic ejection of storage media after verification"},
+        {"disable-zero-skip", "Always write blocks that only contain zeroes, even if the device can zero ranges by itself"},
+        {"direct-io", "Bypass the page cache when writing and verifying (Linux only)"},
+        {"writeback-window", "Flush written data to the device every <size> MB (Linux only, 0 to disable)", "size", QString::number(IMAGEWRITER_WRITEBACK_WINDOW)},
+        {"delta", "Compare the image with what is on the device, and only write the blocks that differ"},
+        {"disable-resume", "Always start writing from the beginning, instead of continuing an interrupted write of the same image (Linux only)"},
+        {"repair-retries", "Number of times to write chunks that fail verification again, before giving up (0 to disable)", "retries", QString::number(IMAGEWRITER_REPAIR_RETRIES)},
+        {"fast-verify", "Compare what is read back during verification using fast non-cryptographic chunk digests, instead of SHA-256"},
+        {"fanout-stall-timeout", "When writing to several devices, stop writing to a device that did not accept data for <seconds> (0 to wait forever)", "seconds", QString::number(IMAGEWRITER_FANOUT_STALL_TIMEOUT)},
+        {"writes-per-port", "When writing to several devices, maximum number of writes in flight to the devices behind the same USB hub (0 for no limit)", "writes", QString::number(IMAGEWRITER_WRITES_PER_PORT)},
+        {"trailing-verify", "Read back written data while the rest of the image is still being written (Linux only)"},
+        {"download-ahead", "Download the image into the cache file at full network speed, and write it from there (requires setting sha256 as well)"},
+        {"mirror", "Other location the image can be downloaded from. Can be given more than once", "url"},
+        {"download-connections", "Number of connections used to download the image, if the server supports range requests", "connections", QString::number(IMAGEWRITER_DOWNLOAD_CONNECTIONS)},
+        {"io-queue-depth", "Number of writes to keep in flight (Linux io_uring, 0 to disable)", "depth", QString::number(IMAGEWRITER_IOURING_QUEUE_DEPTH)},
+        {"decompress-threads", "Maximum number of threads used to decompress the image (0 for one per CPU core)", "threads", QString::number(IMAGEWRITER_DECOMPRESS_THREADS)},
+        {"xz-memlimit", "Use fewer xz decompression threads if they would need more than <size> MB of memory (0 for a quarter of RAM)", "size", QString::number(IMAGEWRITER_XZ_MEMLIMIT)},
         {"debug", "Output debug messages to console"},
         {"quiet", "Only write to console on error"},
     });
 
     parser.addPositionalArgument("src", "Image file/URL");
-    parser.addPositionalArgument("dst", "Destination device");
+    parser.addPositionalArgument("dst", "Destination device. Several can be given, to write the image to all of them at once", "dst [dst...]");
     parser.process(*_app);
 
     const QStringList args = parser.positionalArguments();
-    if (args.count() != 2)
+    if (args.count() < 2)
     {
-        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--sha256 <expected hash> [--cache-file <cache file>]] [--first-run-script <script>] [--debug] [--quiet] <image file to write> <destination drive device>" << std::endl;
+        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--disable-zero-skip] [--direct-io] [--writeback-window <MB>] [--trailing-verify] [--fast-verify] [--fanout-stall-timeout <seconds>] [--writes-per-port <writes>] [--repair-retries <retries>] [--disable-resume] [--delta] [--download-connections <connections>] [--download-ahead] [--mirror <url>...] [--io-queue-depth <depth>] [--decompress-threads <threads>] [--xz-memlimit <MB>] [--sha256 <expected hash> [--cache-file <cache file>]] [--cache-quota <GB>] [--cache-format <compressed|raw|zstd>] [--first-run-script <script>] [--debug] [--quiet] <image file to write> <destination drive device> [<more destination drive devices>...]" << std::endl;
         return 1;
     }
 
@@ -84,7 +103,7 @@ int Cli::run()
 
     if (args[0].startsWith("http:", Qt::CaseInsensitive) || args[0].startsWith("https:", Qt::CaseInsensitive))
     {
-        _imageWriter->setSrc(args[0], 0, 0, parser.value("sha256").toLatin1(), false, "", "", initFormat);
+        _imageWriter->setSrc(args[0], 0, 0, parser.value("sha256").toLatin1(), false, "", "", initFormat, QUrl(), parser.values("mirror"));
 
         if (!parser.value("cache-file").isEmpty())
         {
@@ -119,15 +138,19 @@ int Cli::run()
     {
         DriveListModel dlm;
         dlm.processDriveList(Drivelist::ListStorageDevices() );
-        bool foundDrive = false;
+        bool foundDrive = true;
         int numDrives = dlm.rowCount( QModelIndex() );
 
-        for (int i = 0; i < numDrives; i++)
+        for (int j = 1; j < args.count() && foundDrive; j++)
         {
-            if (dlm.index(i, 0).data(dlm.deviceRole) == args[1])
+            foundDrive = false;
+            for (int i = 0; i < numDrives; i++)
             {
-                foundDrive = true;
-                break;
+                if (dlm.index(i, 0).data(dlm.deviceRole) == args[j])
+                {
+                    foundDrive = true;
+                    break;
+                }
             }
         }
 
@@ -211,9 +234,35 @@ int Cli::run()
         _imageWriter->setImageCustomization("", "", firstRunScript, "", "");
     }
 
+    QString cacheFormat = parser.value("cache-format");
+    if (cacheFormat != "compressed" && cacheFormat != "raw" && cacheFormat != "zstd")
+    {
+        std::cerr << "Error: cache format must be one of compressed, raw or zstd" << std::endl;
+        return 1;
+    }
+
     _imageWriter->setDst(args[1]);
+    for (int i = 2; i < args.count(); i++)
+        _imageWriter->addDst(args[i]);
     _imageWriter->setVerifyEnabled(!parser.isSet("disable-verify"));
     _imageWriter->setSetting("eject", !parser.isSet("disable-eject"));
+    _imageWriter->setSetting("io_queue_depth", parser.value("io-queue-depth").toUInt());
+    _imageWriter->setSetting("skip_zero_blocks", !parser.isSet("disable-zero-skip"));
+    _imageWriter->setSetting("direct_io", parser.isSet("direct-io"));
+    _imageWriter->setSetting("writeback_window", parser.value("writeback-window").toUInt());
+    _imageWriter->setSetting("trailing_verify", parser.isSet("trailing-verify"));
+    _imageWriter->setSetting("fast_verify", parser.isSet("fast-verify"));
+    _imageWriter->setSetting("fanout_stall_timeout", parser.value("fanout-stall-timeout").toUInt());
+    _imageWriter->setSetting("writes_per_port", parser.value("writes-per-port").toUInt());
+    _imageWriter->setSetting("repair_retries", parser.value("repair-retries").toUInt());
+    _imageWriter->setSetting("resume_writes", !parser.isSet("disable-resume"));
+    _imageWriter->setSetting("delta_write", parser.isSet("delta"));
+    _imageWriter->setSetting("download_connections", parser.value("download-connections").toUInt());
+    _imageWriter->setSetting("download_ahead", parser.isSet("download-ahead"));
+    _imageWriter->setSetting("caching/quota", parser.value("cache-quota").toUInt());
+    _imageWriter->setSetting("caching/format", cacheFormat);
+    _imageWriter->setSetting("decompress_threads", parser.value("decompress-threads").toUInt());
+    _imageWriter->setSetting("xz_memlimit", parser.value("xz-memlimit").toUInt());
 
     /* Run startWrite() in event loop (otherwise calling _app->exit() on error does not work) */
     QTimer::singleShot(1, _imageWriter, &ImageWriter::startWrite);
@@ -225,11 +274,40 @@ void Cli::onSuccess()
     if (!_quiet)
     {
         _clearLine();
+        _printPortThroughput();
         std::cerr << "Write successful." << std::endl;
     }
     _app->exit(0);
 }
 
+void Cli::onDeviceResult(QVariant device, QVariant success, QVariant msg)
+{
+    QByteArray d = device.toByteArray();
+
+    if (!success.toBool())
+    {
+        if (!_quiet)
+            _clearLine();
+        std::cerr << d.constData() << ": Error: " << msg.toByteArray().constData() << std::endl;
+    }
+    else if (!_quiet)
+    {
+        _clearLine();
+        std::cerr << d.constData() << ": Write successful." << std::endl;
+    }
+}
+
+/* Only has something to print when writing to several devices */
+void Cli::_printPortThroughput()
+{
+    const QVariantMap throughput = _imageWriter->portThroughput();
+    for (auto i = throughput.cbegin(); i != throughput.cend(); ++i)
+    {
+        QByteArray line = "Port "+i.key().toLatin1()+": "+QByteArray::number(i.value().toDouble(), 'f', 1)+" MB/s";
+        std::cerr << line.constData() << std::endl;
+    }
+}
+
 void Cli::_clearLine()
 {
     /* Properly clearing line requires platform specific code.
@@ -244,6 +322,7 @@ void Cli::onError(QVariant msg)
     if (!_quiet)
     {
         _clearLine();
+        _printPortThroughput();
     }
     std::cerr << "Error: " << m.constData() << std::endl;
     _app->exit(1);
@@ -251,6 +330,20 @@ void Cli::onError(QVariant msg)
 
 void Cli::onDownloadProgress(QVariant dlnow, QVariant dltotal)
 {
+    /* Calculate the rate at which data reaches the device once per second */
+    quint64 now = dlnow.toULongLong();
+    if (!_rateTimer.isValid() || now < _rateBytes)
+    {
+        _rateTimer.start();
+        _rateBytes = now;
+    }
+    else if (_rateTimer.elapsed() >= 1000)
+    {
+        double mbPerSec = (now-_rateBytes)/1000000.0 / (_rateTimer.restart()/1000.0);
+        _rate = QByteArray::number(mbPerSec, 'f', 1)+" MB/s";
+        _rateBytes = now;
+    }
+
     _printProgress("Writing",  dlnow, dltotal);
 }
 
@@ -280,12 +373,17 @@ void Cli::_printProgress(const QByteArray &msg, QVariant now, QVariant total)
     if (t)
     {
         int percent = n/t*100;
-        if (percent != _lastPercent || msg != _lastMsg)
+        QByteArray rate = (msg == "Writing") ? _rate : QByteArray();
+        if (percent != _lastPercent || msg != _lastMsg || rate != _lastRate)
         {
-            QByteArray txt = QByteArray("  ")+msg+": ["+QByteArray(percent/5, '-')+'>'+QByteArray(20-percent/5, ' ')+"] "+QByteArray::number(percent)+" %\r";
+            QByteArray txt = QByteArray("  ")+msg+": ["+QByteArray(percent/5, '-')+'>'+QByteArray(20-percent/5, ' ')+"] "+QByteArray::number(percent)+" %";
+            if (!rate.isEmpty())
+                txt += "  "+rate+"  ";
+            txt += "\r";
             std::cerr << txt.constData();
             _lastPercent = percent;
             _lastMsg = msg;
+            _lastRate = rate;
         }
     }
     else if (msg != _lastMsg)
@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include <QVariant>
+#include <QElapsedTimer>
 
 class ImageWriter;
 class QCoreApplication;
@@ -19,11 +20,14 @@ protected:
     QCoreApplication *_app;
     ImageWriter *_imageWriter;
     int _lastPercent;
-    QByteArray _lastMsg;
+    QByteArray _lastMsg, _rate, _lastRate;
     bool _quiet;
+    QElapsedTimer _rateTimer;
+    quint64 _rateBytes;
 
     void _printProgress(const QByteArray &msg, QVariant now, QVariant total);
     void _clearLine();
+    void _printPortThroughput();
 
 protected slots:
     void onSuccess();
@@ -31,6 +35,7 @@ protected slots:
     void onDownloadProgress(QVariant dlnow, QVariant dltotal);
     void onVerifyProgress(QVariant now, QVariant total);
     void onPreparationStatusUpdate(QVariant msg);
+    void onDeviceResult(QVariant device, QVariant success, QVariant msg);
 
 signals:
 
@@ -23,18 +23,94 @@
 #define PROGRESS_UPDATE_INTERVAL          100
 
 /* Block size used for writes (currently used when using .zip images only) */
-#define IMAGEWRITER_BLOCKSIZE             1*1024*1024
+#define IMAGEWRITER_BLOCKSIZE             (1*1024*1024)
+
+/* Size in MB of the buffer between download and decompression */
+#define IMAGEWRITER_RINGBUFFER_SIZE       8
+
+/* Maximum number of blocks waiting to be hashed, before writing stalls */
+#define IMAGEWRITER_HASH_QUEUE_DEPTH      4
+
+/* Maximum number of threads used for decompression. 0 uses one per CPU core */
+#define IMAGEWRITER_DECOMPRESS_THREADS    0
+
+/* Memory in MB the multi-threaded xz decoder may use before it falls back to a single thread. 0 uses a quarter of RAM */
+#define IMAGEWRITER_XZ_MEMLIMIT           0
+
+/* Largest zstd frame, gzip member or decoded bzip2 block in MB that is decoded in parallel with others. Larger ones are decoded single-threaded */
+#define IMAGEWRITER_MAX_FRAME_SIZE        32
+
+/* Number of connections used to download an image in ranges, if the server supports it. 1 uses a single connection */
+#define IMAGEWRITER_DOWNLOAD_CONNECTIONS  4
+
+/* Size of each range of a download over several connections */
+#define IMAGEWRITER_DOWNLOAD_SEGMENT_SIZE (8*1024*1024)
+
+/* Ranges that arrive early are kept in memory. Maximum MB between the first range not passed on yet and the last one started */
+#define IMAGEWRITER_DOWNLOAD_WINDOW       64
+
+/* Seconds mirrors of an image are given to answer, before the fastest one is picked to download from */
+#define IMAGEWRITER_MIRROR_PROBE_TIMEOUT  5
+
+/* If an image has mirrors, seconds a connection may stay below 100 bytes/s before continuing from the next mirror */
+#define IMAGEWRITER_MIRROR_STALL_TIME     10
 
 /* Block size used with uncompressed images */
-#define IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE 128*1024
+#define IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE (128*1024)
+
+/* Maximum number of writes in flight when using io_uring (Linux only). 0 disables io_uring */
+#define IMAGEWRITER_IOURING_QUEUE_DEPTH   4
+
+/* Start writeback every this many MB, so dirty data in the page cache stays bounded (Linux only). 0 disables */
+#define IMAGEWRITER_WRITEBACK_WINDOW      32
+
+/* Granularity at which all-zero blocks are detected and not sent to the device (Linux only) */
+#define IMAGEWRITER_ZERO_BLOCK_SIZE       (64*1024)
+
+/* Granularity at which the image is compared with what is on the device in delta mode. Only blocks that differ are written */
+#define IMAGEWRITER_DELTA_BLOCK_SIZE      (64*1024)
+
+/* Maximum size of a .bmap block map file we are willing to download */
+#define IMAGEWRITER_BMAP_MAX_SIZE         (16*1024*1024)
+
+/* Seconds we wait for a .bmap that is not listed in the OS list, but might exist next to the image */
+#define IMAGEWRITER_BMAP_GUESS_TIMEOUT    5
 
 /* Block size used when reading during verify stage */
-#define IMAGEWRITER_VERIFY_BLOCKSIZE      128*1024
+#define IMAGEWRITER_VERIFY_BLOCKSIZE      (128*1024)
+
+/* Size of the chunks that get a digest of their own, so chunks that fail verification can be written again */
+#define IMAGEWRITER_CHUNK_SIZE            (4*1024*1024)
+
+/* Number of times chunks that fail verification are written again, before giving up. 0 disables */
+#define IMAGEWRITER_REPAIR_RETRIES        3
+
+/* Block size used when reading back data while still writing (Linux only). Must be a multiple of the logical block size */
+#define IMAGEWRITER_TRAILING_VERIFY_BLOCKSIZE (1024*1024)
+
+/* When writing to several devices: MB of decompressed data queued for each, and seconds a device may
+   not accept any data before it is dropped, so it does not hold back the others. 0 waits forever */
+#define IMAGEWRITER_FANOUT_BUFFER         128
+#define IMAGEWRITER_FANOUT_STALL_TIMEOUT  60
+
+/* When writing to several devices: maximum number of writes in flight to the devices behind the same USB hub. 0 disables */
+#define IMAGEWRITER_WRITES_PER_PORT       2
 
 /* Enable caching */
 #define IMAGEWRITER_ENABLE_CACHE_DEFAULT        true
 
+/* Maximum size in GB of all cached images together. The least recently used ones are removed to stay under it. 0 for no limit */
+#define IMAGEWRITER_CACHE_QUOTA                 32
+
+/* Form images are cached in: "compressed" as downloaded, "raw" as uncompressed sparse image,
+   or "zstd" as seekable zstd. The last two are produced while writing, and are faster to write again */
+#define IMAGEWRITER_CACHE_FORMAT                "compressed"
+
+/* Size in MB of the frames of images cached in zstd format, and the compression level used */
+#define IMAGEWRITER_CACHE_FRAME_SIZE            4
+#define IMAGEWRITER_CACHE_ZSTD_LEVEL            3
+
 /* Do not cache if it would bring free disk space under 5 GB */
-#define IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING   5*1024*1024*1024ll
+#define IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING   (5*1024*1024*1024ll)
 
 #endif // CONFIG_H
@@ -5,9 +5,16 @@
 
 #include "downloadextractthread.h"
 #include "config.h"
+#include "xzdecoder.h"
+#include "zstddecoder.h"
+#include "gzipdecoder.h"
+#ifdef HAVE_BZIP2
+#include "bzip2decoder.h"
+#endif
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include "dependencies/mountutils/src/mountutils.hpp"
 #include <iostream>
+#include <algorithm>
 #include <archive.h>
 #include <archive_entry.h>
 #include <sys/stat.h>
@@ -19,10 +26,13 @@
 #include <QProcess>
 #include <QTemporaryDir>
 #include <QDebug>
+#include <QSettings>
 
-using namespace std;
+#ifdef Q_OS_LINUX
+#include "linux/iouringwriter.h"
+#endif
 
-const int DownloadExtractThread::MAX_QUEUE_SIZE = 64;
+using namespace std;
 
 class _extractThreadClass : public QThread {
 public:
@@ -44,12 +54,24 @@ protected:
 };
 
 DownloadExtractThread::DownloadExtractThread(const QByteArray &url, const QByteArray &localfilename, const QByteArray &expectedHash, QObject *parent)
-    : DownloadThread(url, localfilename, expectedHash, parent), _abufsize(IMAGEWRITER_BLOCKSIZE), _ethreadStarted(false),
-      _isImage(true), _inputHash(OSLIST_HASH_ALGORITHM), _activeBuf(0), _writeThreadStarted(false)
+    : DownloadThread(url, localfilename, expectedHash, parent), _abufsize(IMAGEWRITER_BLOCKSIZE), _ring(IMAGEWRITER_RINGBUFFER_SIZE*1024*1024), _ethreadStarted(false),
+      _isImage(true), _inputHash(OSLIST_HASH_ALGORITHM), _activeBuf(0), _writeThreadStarted(false), _peekBuf(nullptr), _peekLen(0),
+      _aheadActive(false), _aheadClosed(false), _aheadWritten(0), _aheadRead(0), _aheadUnflushed(0), _aheadBuf(nullptr)
 {
+    QSettings settings;
+    _decompressThreads = settings.value("decompress_threads", IMAGEWRITER_DECOMPRESS_THREADS).toUInt();
+    _xzMemlimit = settings.value("xz_memlimit", IMAGEWRITER_XZ_MEMLIMIT).toULongLong()*1024*1024;
+    _downloadAhead = settings.value("download_ahead", false).toBool();
+
     _extractThread = new _extractThreadClass(this);
-    _abuf[0] = (char *) qMallocAligned(_abufsize, 4096);
-    _abuf[1] = (char *) qMallocAligned(_abufsize, 4096);
+    _asyncHash = true;
+    /* Writes get their own thread, instead of competing for the global pool */
+    _writePool.setMaxThreadCount(1);
+
+    /* One buffer being filled by libarchive, the rest can be in flight */
+    unsigned int numBuffers = qMax(2u, _ioQueueDepth+1);
+    for (unsigned int i = 0; i < numBuffers; i++)
+        _abuf.push_back( (char *) qMallocAligned(_abufsize, 4096) );
 }
 
 DownloadExtractThread::~DownloadExtractThread()
@@ -60,8 +82,12 @@ DownloadExtractThread::~DownloadExtractThread()
     {
         _extractThread->terminate();
     }
-    qFreeAligned(_abuf[0]);
-    qFreeAligned(_abuf[1]);
+    _writePool.waitForDone();
+    _hashStage->waitAll();
+    for (char *buf : _abuf)
+        qFreeAligned(buf);
+    if (_aheadBuf)
+        qFreeAligned(_aheadBuf);
 }
 
 size_t DownloadExtractThread::_writeData(const char *buf, size_t len)
@@ -69,10 +95,13 @@ size_t DownloadExtractThread::_writeData(const char *buf, size_t len)
     if (_cancelled)
         return 0;
 
-    _writeCache(buf, len);
-
     if (!_ethreadStarted)
     {
+        /* Can only download ahead if there is a cache file to download to */
+        _aheadActive = _downloadAhead && _cacheEnabled;
+        if (_aheadActive)
+            qDebug() << "Downloading ahead into cache file" << _cachefile.fileName();
+
         // Extract thread is started when first data comes in
         _ethreadStarted = true;
         _extractThread->start();
@@ -84,14 +113,63 @@ size_t DownloadExtractThread::_writeData(const char *buf, size_t len)
         _inputHash.addData(buf, len);
     }
 
-    _pushQueue(buf, len);
+    if (_aheadActive)
+    {
+        /* Nothing waits for the storage device here, so the download runs at network speed.
+           Data only becomes visible to the reader once flushed. Do that when a block has piled up,
+           or when the reader has read everything before it */
+        _writeCache(buf, len);
+        _aheadUnflushed += len;
+        if (!_cacheEnabled || ((_aheadUnflushed >= IMAGEWRITER_BLOCKSIZE || _aheadCaughtUp()) && !_aheadFlush()))
+        {
+            _onDownloadError(tr("Error writing to cache file"));
+            return 0;
+        }
+        return len;
+    }
+
+    _writeCache(buf, len);
 
-    return len;
+    return _ring.write(buf, len) ? len : 0;
 }
 
 void DownloadExtractThread::_onDownloadSuccess()
 {
-    _pushQueue("", 0);
+    _ring.close();
+    if (_aheadActive && !_aheadFlush())
+    {
+        _onDownloadError(tr("Error writing to cache file"));
+        return;
+    }
+    _aheadUpdate(0, true);
+}
+
+/* Make what was downloaded ahead so far available to the reader */
+bool DownloadExtractThread::_aheadFlush()
+{
+    if (!_cacheEnabled || !_cachefile.flush())
+        return false;
+
+    _aheadUpdate(_aheadUnflushed, false);
+    _aheadUnflushed = 0;
+
+    return true;
+}
+
+bool DownloadExtractThread::_aheadCaughtUp()
+{
+    std::lock_guard<std::mutex> lock(_aheadMutex);
+    return _aheadRead >= _aheadWritten;
+}
+
+/* More data is in the cache file, or the download is complete */
+void DownloadExtractThread::_aheadUpdate(size_t len, bool closed)
+{
+    std::unique_lock<std::mutex> lock(_aheadMutex);
+    _aheadWritten += len;
+    _aheadClosed = _aheadClosed || closed;
+    lock.unlock();
+    _aheadChanged.notify_one();
 }
 
 void DownloadExtractThread::_onDownloadError(const QString &msg)
@@ -102,11 +180,9 @@ void DownloadExtractThread::_onDownloadError(const QString &msg)
 
 void DownloadExtractThread::_cancelExtract()
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
-    _queue.clear();
-    _queue.push_back(QByteArray());
-    lock.unlock();
-    _cv.notify_all();
+    _ring.cancel();
+    /* _cancelled is set already, wake up the extract thread so it notices */
+    _aheadUpdate(0, false);
 }
 
 void DownloadExtractThread::cancelDownload()
@@ -129,6 +205,20 @@ static inline void _checkResult(int r, struct archive *a)
 // libarchive thread
 void DownloadExtractThread::extractImageRun()
 {
+    /* Look at the start of the data, to see if there is a faster decoder than libarchive for it.
+       The data is handed to libarchive again if not. */
+    _peekLen = _on_read(NULL, &_peekBuf);
+    if (_peekLen > 0)
+    {
+        StreamDecoder *decoder = _createDecoder(_peekBuf, _peekLen);
+        if (decoder)
+        {
+            _extractImageWithDecoder(decoder);
+            delete decoder;
+            return;
+        }
+    }
+
     struct archive *a = archive_read_new();
     struct archive_entry *entry;
     int r;
@@ -143,44 +233,153 @@ void DownloadExtractThread::extractImageRun()
     {
         r = archive_read_next_header(a, &entry);
         _checkResult(r, a);
+        _setupIoUring();
 
         while (true)
         {
+            if (!_waitForFreeBuffer())
+            {
+                if (!_cancelled)
+                {
+                    _onWriteError();
+                }
+                archive_read_free(a);
+                return;
+            }
+
             ssize_t size = archive_read_data(a, _abuf[_activeBuf], _abufsize);
             if (size < 0)
                 throw runtime_error(archive_error_string(a));
             if (size == 0)
                 break;
-            if (size % 512 != 0)
+
+            if (!_queueBufferWrite(size))
+            {
+                if (!_cancelled)
+                {
+                    _onWriteError();
+                }
+                archive_read_free(a);
+                return;
+            }
+        }
+
+        if (_writeThreadStarted)
+            _writeFuture.waitForFinished();
+        _writeComplete();
+    }
+    catch (exception &e)
+    {
+        if (!_cancelled)
+        {
+            // Fatal error
+            DownloadThread::cancelDownload();
+            emit error(tr("Error extracting archive: %1").arg(e.what()));
+        }
+    }
+
+    archive_read_free(a);
+}
+
+StreamDecoder *DownloadExtractThread::_createDecoder(const void *data, size_t len)
+{
+    if (XzDecoder::isXz(data, len))
+    {
+        XzDecoder *xz = new XzDecoder(_decompressThreads, _xzMemlimit);
+        if (xz->isValid())
+        {
+            qDebug() << "Decoding xz with up to" << xz->threads() << "threads";
+            return xz;
+        }
+
+        qDebug() << "Error initializing multi-threaded xz decoder:" << xz->errorString() << "Using libarchive instead";
+        delete xz;
+    }
+    else if (ZstdDecoder::isZstd(data, len))
+    {
+        uint32_t threads = _decompressThreads ? _decompressThreads : QThread::idealThreadCount();
+        if (threads > 1)
+        {
+            qDebug() << "Decoding zstd frames with" << threads << "threads";
+            return new ZstdDecoder(threads, IMAGEWRITER_MAX_FRAME_SIZE*1024*1024);
+        }
+    }
+#ifdef HAVE_BZIP2
+    else if (Bzip2Decoder::isBzip2(data, len))
+    {
+        uint32_t threads = _decompressThreads ? _decompressThreads : QThread::idealThreadCount();
+        qDebug() << "Decoding bzip2 blocks with" << threads << "threads";
+        return new Bzip2Decoder(threads, IMAGEWRITER_MAX_FRAME_SIZE*1024*1024);
+    }
+#endif
+    else if (GzipDecoder::isGzip(data, len))
+    {
+        /* Also worth it single-threaded, as it saves going through libarchive's buffers */
+        uint32_t threads = _decompressThreads ? _decompressThreads : QThread::idealThreadCount();
+        qDebug() << "Decoding gzip with zlib, BGZF members with" << threads << "threads";
+        return new GzipDecoder(threads, IMAGEWRITER_MAX_FRAME_SIZE*1024*1024);
+    }
+
+    return nullptr;
+}
+
+/* Same as the libarchive loop above, but with the data decoded by decoder directly */
+void DownloadExtractThread::_extractImageWithDecoder(StreamDecoder *decoder)
+{
+    const uint8_t *in = (const uint8_t *) _peekBuf;
+    size_t inLen = _peekLen;
+    bool eof = false;
+    StreamDecoder::Result r = StreamDecoder::Ok;
+    _peekLen = 0;
+
+    try
+    {
+        _setupIoUring();
+
+        while (r != StreamDecoder::StreamEnd)
+        {
+            if (!_waitForFreeBuffer())
             {
-                size_t paddingBytes = 512-(size % 512);
-                qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
-                qDebug() << "Last write() would be" << size << "bytes, but padding to" << size + paddingBytes << "bytes";
-                memset(_abuf[_activeBuf]+size, 0, paddingBytes);
-                size += paddingBytes;
+                if (!_cancelled)
+                {
+                    _onWriteError();
+                }
+                _on_close(NULL);
+                return;
             }
 
-            if (_writeThreadStarted)
+            uint8_t *out = (uint8_t *) _abuf[_activeBuf];
+            size_t outLen = _abufsize;
+
+            while (outLen && r == StreamDecoder::Ok)
             {
-                //if (_writeFile(_abuf, size) != (size_t) size)
-                if (!_writeFuture.result())
+                if (!inLen && !eof)
                 {
-                    if (!_cancelled)
-                    {
-                        _onWriteError();
-                    }
-                    archive_read_free(a);
-                    return;
+                    const void *buf;
+                    ssize_t len = _on_read(NULL, &buf);
+                    if (len < 0)
+                        throw runtime_error("Error reading compressed data");
+
+                    in = (const uint8_t *) buf;
+                    inLen = len;
+                    eof = (len == 0);
                 }
+
+                r = decoder->decode(in, inLen, out, outLen, eof);
+                if (r == StreamDecoder::Error)
+                    throw runtime_error(decoder->errorString().toStdString());
             }
 
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-            _writeFuture = QtConcurrent::run(&DownloadThread::_writeFile, static_cast<DownloadThread *>(this), _abuf[_activeBuf], size);
-#else
-            _writeFuture = QtConcurrent::run(static_cast<DownloadThread *>(this), &DownloadThread::_writeFile, _abuf[_activeBuf], size);
-#endif
-            _activeBuf = _activeBuf ? 0 : 1;
-            _writeThreadStarted = true;
+            size_t size = _abufsize - outLen;
+            if (size && !_queueBufferWrite(size))
+            {
+                if (!_cancelled)
+                {
+                    _onWriteError();
+                }
+                _on_close(NULL);
+                return;
+            }
         }
 
         if (_writeThreadStarted)
@@ -197,7 +396,82 @@ void DownloadExtractThread::extractImageRun()
         }
     }
 
-    archive_read_free(a);
+    _on_close(NULL);
+}
+
+void DownloadExtractThread::_setupIoUring()
+{
+#ifdef Q_OS_LINUX
+    if (_ioQueueDepth && !_uring && _file.isOpen())
+    {
+        _uring = new IoUringWriter(_file.handle(), _ioQueueDepth, _abuf, _abufsize);
+        if (_uring->isValid())
+        {
+            _uring->setCompletionCallback([this](size_t len) {
+                _bytesWritten += len;
+            });
+        }
+        else
+        {
+            delete _uring;
+            _uring = nullptr;
+        }
+    }
+#endif
+}
+
+/* Wait until the active buffer can be filled again. Returns false if writing it failed */
+bool DownloadExtractThread::_waitForFreeBuffer()
+{
+#ifdef Q_OS_LINUX
+    if (_uring && !_uring->waitForBuffer(_abuf[_activeBuf]))
+        return false;
+#endif
+    /* Buffer may still be waiting to be hashed */
+    _hashStage->waitForBuffer(_abuf[_activeBuf]);
+
+    return true;
+}
+
+/* Write size bytes of the active buffer in the background, and move on to the next buffer */
+bool DownloadExtractThread::_queueBufferWrite(size_t size)
+{
+    if (size % 512 != 0)
+    {
+        size_t paddingBytes = 512-(size % 512);
+        qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
+        qDebug() << "Last write() would be" << size << "bytes, but padding to" << size + paddingBytes << "bytes";
+        memset(_abuf[_activeBuf]+size, 0, paddingBytes);
+        size += paddingBytes;
+    }
+
+#ifdef Q_OS_LINUX
+    if (_uring)
+    {
+        /* Write is queued, and completes in the background while we decompress the next buffers */
+        if (_writeFile(_abuf[_activeBuf], size) != size)
+            return false;
+    }
+    else
+#endif
+    {
+        if (_writeThreadStarted)
+        {
+            //if (_writeFile(_abuf, size) != (size_t) size)
+            if (!_writeFuture.result())
+                return false;
+        }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        _writeFuture = QtConcurrent::run(&_writePool, &DownloadThread::_writeFile, static_cast<DownloadThread *>(this), _abuf[_activeBuf], size);
+#else
+        _writeFuture = QtConcurrent::run(&_writePool, static_cast<DownloadThread *>(this), &DownloadThread::_writeFile, _abuf[_activeBuf], size);
+#endif
+        _writeThreadStarted = true;
+    }
+    _activeBuf = (_activeBuf+1) % _abuf.size();
+
+    return true;
 }
 
 #ifdef Q_OS_LINUX
@@ -404,11 +678,53 @@ void DownloadExtractThread::extractMultiFileRun()
     eject_disk(_filename.constData());
 }
 
+/* Hands out data straight from the ring buffer. libarchive is done with it by the time it asks for more */
 ssize_t DownloadExtractThread::_on_read(struct archive *, const void **buff)
 {
-    _buf = _popQueue();
-    *buff = _buf.data();
-    return _buf.size();
+    if (_aheadActive)
+        return _readAhead(buff);
+
+    return _ring.read(buff);
+}
+
+/* Hands out data from the cache file, following the download as it is written */
+ssize_t DownloadExtractThread::_readAhead(const void **buff)
+{
+    std::unique_lock<std::mutex> lock(_aheadMutex);
+    _aheadChanged.wait(lock, [this]{
+        return _cancelled || _aheadClosed || _aheadWritten > _aheadRead;
+    });
+    if (_cancelled)
+        return -1;
+    size_t len = qMin(_aheadWritten-_aheadRead, (quint64) IMAGEWRITER_BLOCKSIZE);
+    lock.unlock();
+
+    if (!len)
+        return 0;
+
+    if (!_aheadFile.isOpen())
+    {
+        _aheadFile.setFileName(_cachefile.fileName());
+        if (!_aheadFile.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+        {
+            qDebug() << "Error opening cache file for reading:" << _aheadFile.errorString();
+            return -1;
+        }
+        _aheadBuf = (char *) qMallocAligned(IMAGEWRITER_BLOCKSIZE, 4096);
+    }
+
+    qint64 bytesRead = _aheadFile.read(_aheadBuf, len);
+    if (bytesRead <= 0)
+    {
+        qDebug() << "Error reading from cache file:" << _aheadFile.errorString();
+        return -1;
+    }
+    lock.lock();
+    _aheadRead += bytesRead;
+    lock.unlock();
+    *buff = _aheadBuf;
+
+    return bytesRead;
 }
 
 int DownloadExtractThread::_on_close(struct archive *)
@@ -416,10 +732,24 @@ int DownloadExtractThread::_on_close(struct archive *)
     return 0;
 }
 
+/* Hands out data that was already looked at by extractImageRun() first */
+ssize_t DownloadExtractThread::_readInput(struct archive *a, const void **buff)
+{
+    if (_peekLen > 0)
+    {
+        ssize_t len = _peekLen;
+        *buff = _peekBuf;
+        _peekLen = 0;
+        return len;
+    }
+
+    return _on_read(a, buff);
+}
+
 // static callback functions that call object oriented equivalents
 ssize_t DownloadExtractThread::_archive_read(struct archive *a, void *client_data, const void **buff)
 {
-   return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_read(a, buff);
+   return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_readInput(a, buff);
 }
 
 int DownloadExtractThread::_archive_close(struct archive *a, void *client_data)
@@ -427,50 +757,177 @@ int DownloadExtractThread::_archive_close(struct archive *a, void *client_data)
    return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_close(a);
 }
 
-bool DownloadExtractThread::isImage()
+/* File the image can be decoded from a second time, or an empty string if there is none */
+QString DownloadExtractThread::_replaySource()
 {
-    return _isImage;
-}
+    /* By the time we verify, the cache file is closed if it was complete and had the right hash */
+    if (_cacheEnabled && !_cachefile.isOpen() && _cachefile.exists())
+        return _cachefile.fileName();
 
-void DownloadExtractThread::enableMultipleFileExtraction()
-{
-    _isImage = false;
+    return QString();
 }
 
-// Synchronized queue using monitor consumer/producer pattern
-QByteArray DownloadExtractThread::_popQueue()
+/* Decode the image again, and write only the chunks starting at offsets.
+   Stops reading the source as soon as the last of them has been written */
+bool DownloadExtractThread::_rewriteChunks(const QList<quint64> &offsets)
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
+    QString source = _replaySource();
+    if (source.isEmpty())
+        return DownloadThread::_rewriteChunks(offsets);
 
-    _cv.wait(lock, [this]{
-            return _queue.size() != 0;
-    });
+    QFile in(source);
+    if (!in.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Error opening" << source << "to rewrite chunks";
+        return false;
+    }
+
+    size_t chunkSize = _writeChunks.chunkSize();
+    QList<quint64> pending = offsets;
+    std::sort(pending.begin(), pending.end());
+    char *chunkBuf = (char *) qMallocAligned(chunkSize, qMax(_alignment, (size_t) 4096));
+    quint64 outPos = 0;
+
+    /* Collects decoded data of the chunks we are after, and writes them once complete */
+    auto output = [&](const char *buf, size_t len) -> bool {
+        while (len && !pending.isEmpty())
+        {
+            quint64 chunkStart = pending.first();
+            quint64 chunkEnd = qMin(chunkStart+chunkSize, (quint64) _verifyTotal);
 
-    QByteArray result = _queue.front();
-    _queue.pop_front();
+            if (outPos < chunkStart)
+            {
+                size_t skip = qMin((quint64) len, chunkStart-outPos);
+                buf += skip;
+                len -= skip;
+                outPos += skip;
+                continue;
+            }
+
+            size_t n = qMin((quint64) len, chunkEnd-outPos);
+            ::memcpy(chunkBuf+(outPos-chunkStart), buf, n);
+            buf += n;
+            len -= n;
+            outPos += n;
+
+            if (outPos == chunkEnd)
+            {
+                qDebug() << "Rewriting chunk at offset" << chunkStart;
+                if (!_rewriteChunk(chunkBuf, chunkEnd-chunkStart, chunkStart))
+                    return false;
+                pending.removeFirst();
+            }
+        }
+        outPos += len;
+        return true;
+    };
 
-    if (_queue.size() == (MAX_QUEUE_SIZE-1))
+    char *inBuf = (char *) qMallocAligned(IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE, 4096);
+    char *outBuf = (char *) qMallocAligned(_abufsize, 4096);
+    qint64 peekLen = in.read(inBuf, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE);
+    StreamDecoder *decoder = peekLen > 0 ? _createDecoder(inBuf, peekLen) : nullptr;
+    bool ok = true;
+
+    if (decoder)
     {
-        lock.unlock();
-        _cv.notify_one();
+        const uint8_t *inPtr = (const uint8_t *) inBuf;
+        size_t inLen = peekLen;
+        bool eof = false;
+        StreamDecoder::Result r = StreamDecoder::Ok;
+
+        while (ok && r == StreamDecoder::Ok && !pending.isEmpty() && !_cancelled)
+        {
+            uint8_t *out = (uint8_t *) outBuf;
+            size_t outLen = _abufsize;
+
+            while (outLen && r == StreamDecoder::Ok)
+            {
+                if (!inLen && !eof)
+                {
+                    qint64 len = in.read(inBuf, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE);
+                    if (len < 0)
+                    {
+                        ok = false;
+                        break;
+                    }
+                    inPtr = (const uint8_t *) inBuf;
+                    inLen = len;
+                    eof = (len == 0);
+                }
+
+                r = decoder->decode(inPtr, inLen, out, outLen, eof);
+            }
+
+            if (r == StreamDecoder::Error)
+            {
+                qDebug() << "Error decoding image again:" << decoder->errorString();
+                ok = false;
+            }
+            if (ok)
+                ok = output(outBuf, _abufsize-outLen);
+        }
+        delete decoder;
     }
+    else
+    {
+        struct archive *a = archive_read_new();
+        struct archive_entry *entry;
 
-    return result;
-}
+        archive_read_support_filter_all(a);
+        archive_read_support_format_zip(a);
+        archive_read_support_format_7zip(a);
+        archive_read_support_format_raw(a);
+        QByteArray sourceName = QFile::encodeName(source);
 
-void DownloadExtractThread::_pushQueue(const char *data, size_t len)
-{
-    std::unique_lock<std::mutex> lock(_queueMutex);
+        if (archive_read_open_filename(a, sourceName.constData(), IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE) != ARCHIVE_OK
+                || archive_read_next_header(a, &entry) != ARCHIVE_OK)
+        {
+            qDebug() << "Error opening image again:" << archive_error_string(a);
+            ok = false;
+        }
 
-    _cv.wait(lock, [this]{
-            return _queue.size() != MAX_QUEUE_SIZE;
-    });
+        while (ok && !pending.isEmpty() && !_cancelled)
+        {
+            ssize_t size = archive_read_data(a, outBuf, _abufsize);
+            if (size < 0)
+            {
+                qDebug() << "Error decoding image again:" << archive_error_string(a);
+                ok = false;
+            }
+            if (size <= 0)
+                break;
 
-    _queue.emplace_back(data, len);
+            ok = output(outBuf, size);
+        }
+        archive_read_free(a);
+    }
 
-    if (_queue.size() == 1)
+    /* Image that is not a multiple of 512 bytes was padded with zeroes when writing */
+    if (ok && pending.size() == 1 && outPos < _verifyTotal && outPos >= pending.first())
     {
-        lock.unlock();
-        _cv.notify_one();
+        size_t padding = _verifyTotal-outPos;
+        ::memset(outBuf, 0, padding);
+        ok = output(outBuf, padding);
     }
+    if (ok && !pending.isEmpty() && !_cancelled)
+    {
+        qDebug() << "Image ended before chunks at offsets" << pending << "could be rewritten";
+        ok = false;
+    }
+
+    qFreeAligned(inBuf);
+    qFreeAligned(outBuf);
+    qFreeAligned(chunkBuf);
+
+    return ok && !_cancelled;
+}
+
+bool DownloadExtractThread::isImage()
+{
+    return _isImage;
+}
+
+void DownloadExtractThread::enableMultipleFileExtraction()
+{
+    _isImage = false;
 }
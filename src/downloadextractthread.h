@@ -7,7 +7,10 @@
  */
 
 #include "downloadthread.h"
-#include <deque>
+#include "ringbuffer.h"
+#include "streamdecoder.h"
+#include <vector>
+#include <mutex>
 #include <condition_variable>
 #include <QtConcurrent/QtConcurrent>
 
@@ -33,25 +36,46 @@ public:
     virtual void enableMultipleFileExtraction();
 
 protected:
-    char *_abuf[2];
+    std::vector<char *> _abuf;
     size_t _abufsize;
     _extractThreadClass *_extractThread;
-    std::deque<QByteArray> _queue;
-    static const int MAX_QUEUE_SIZE;
-    std::mutex _queueMutex;
-    std::condition_variable _cv;
+    RingBuffer _ring;
     bool _ethreadStarted, _isImage;
     AcceleratedCryptographicHash _inputHash;
     int _activeBuf;
     bool _writeThreadStarted;
     QFuture<size_t> _writeFuture;
+    QThreadPool _writePool;
+    const void *_peekBuf;
+    ssize_t _peekLen;
+    uint32_t _decompressThreads;
+    uint64_t _xzMemlimit;
+    /* Download ahead: the download only goes to the cache file, and is decoded from there */
+    bool _downloadAhead, _aheadActive, _aheadClosed;
+    quint64 _aheadWritten, _aheadRead;
+    /* Downloaded ahead, but not flushed to the cache file yet */
+    quint64 _aheadUnflushed;
+    QFile _aheadFile;
+    char *_aheadBuf;
+    std::mutex _aheadMutex;
+    std::condition_variable _aheadChanged;
 
-    QByteArray _popQueue();
-    void _pushQueue(const char *data, size_t len);
     void _cancelExtract();
     virtual size_t _writeData(const char *buf, size_t len);
     virtual void _onDownloadSuccess();
     virtual void _onDownloadError(const QString &msg);
+    StreamDecoder *_createDecoder(const void *data, size_t len);
+    void _extractImageWithDecoder(StreamDecoder *decoder);
+    void _setupIoUring();
+    bool _waitForFreeBuffer();
+    bool _queueBufferWrite(size_t size);
+    ssize_t _readInput(struct archive *a, const void **buff);
+    ssize_t _readAhead(const void **buff);
+    void _aheadUpdate(size_t len, bool closed);
+    bool _aheadFlush();
+    bool _aheadCaughtUp();
+    virtual QString _replaySource();
+    virtual bool _rewriteChunks(const QList<quint64> &offsets);
 
     virtual ssize_t _on_read(struct archive *a, const void **buff);
     virtual int _on_close(struct archive *a);
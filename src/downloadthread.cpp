@@ -5,8 +5,11 @@
 
 #include "downloadthread.h"
 #include "config.h"
+#include "zeroblock.h"
 #include "devicewrapper.h"
 #include "devicewrapperfatpartition.h"
+#include "fanoutdevicethread.h"
+#include "segmenteddownload.h"
 #include "dependencies/mountutils/src/mountutils.hpp"
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include <fstream>
@@ -18,16 +21,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <regex>
+#include <chrono>
 #include <QDebug>
 #include <QProcess>
 #include <QSettings>
-#include <QtConcurrent/QtConcurrent>
 #include <QtNetwork/QNetworkProxy>
 
 #ifdef Q_OS_LINUX
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include "linux/udisks2api.h"
+#include "linux/iouringwriter.h"
+#include "linux/trailingverifier.h"
 #endif
 
 using namespace std;
@@ -36,9 +41,10 @@ QByteArray DownloadThread::_proxy;
 int DownloadThread::_curlCount = 0;
 
 DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfilename, const QByteArray &expectedHash, QObject *parent) :
-    QThread(parent), _startOffset(0), _lastDlTotal(0), _lastDlNow(0), _verifyTotal(0), _lastVerifyNow(0), _bytesWritten(0), _lastFailureOffset(0), _sectorsStart(-1), _url(url), _filename(localfilename), _expectedHash(expectedHash),
+    QThread(parent), _startOffset(0), _lastDlTotal(0), _lastDlNow(0), _verifyTotal(0), _lastVerifyNow(0), _bytesWritten(0), _bytesSynced(0), _bytesSkipped(0), _lastFailureOffset(0), _sectorsStart(-1), _url(url), _filename(localfilename), _expectedHash(expectedHash),
     _firstBlock(nullptr), _cancelled(false), _successful(false), _verifyEnabled(false), _cacheEnabled(false), _lastModified(0), _serverTime(0),  _lastFailureTime(0),
-    _inputBufferSize(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _verifyhash(OSLIST_HASH_ALGORITHM)
+    _inputBufferSize(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _verifyhash(OSLIST_HASH_ALGORITHM),
+    _writeChunks(IMAGEWRITER_CHUNK_SIZE), _verifyChunks(IMAGEWRITER_CHUNK_SIZE)
 {
     if (!_curlCount)
         curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -46,17 +52,72 @@ DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfil
 
     QSettings settings;
     _ejectEnabled = settings.value("eject", true).toBool();
+    _ioQueueDepth = settings.value("io_queue_depth", IMAGEWRITER_IOURING_QUEUE_DEPTH).toUInt();
+    _repairRetries = settings.value("repair_retries", IMAGEWRITER_REPAIR_RETRIES).toUInt();
+    _directIO = settings.value("direct_io", false).toBool();
+    _skipZeroBlocks = settings.value("skip_zero_blocks", true).toBool();
+    _trailingVerify = settings.value("trailing_verify", false).toBool();
+    _resumeEnabled = settings.value("resume_writes", true).toBool();
+    _deltaWrite = settings.value("delta_write", false).toBool();
+    _downloadConnections = settings.value("download_connections", IMAGEWRITER_DOWNLOAD_CONNECTIONS).toUInt();
+    _fastVerify = settings.value("fast_verify", false).toBool();
+    _zeroBlocks = ZeroBlocksWrite;
+    _alignment = 512;
+#ifdef Q_OS_LINUX
+    _writebackWindow = settings.value("writeback_window", IMAGEWRITER_WRITEBACK_WINDOW).toULongLong()*1024*1024;
+#else
+    _writebackWindow = 0;
+#endif
+    _writebackSubmitted = _writebackWaited = 0;
+    _bmapRange = 0;
+    _bmapGenerator = nullptr;
+    _cacheTranscoder = nullptr;
+    _journal = nullptr;
+    _resumeFrom = _resumeTo = 0;
+    _deltaBuf = nullptr;
+    _deltaBufSize = 0;
+    _deltaSame = 0;
+    _scheduler = nullptr;
+    _acceptRanges = false;
+    _mirrorIndex = 0;
+    _hashStage = new HashStage([this](const char *buf, size_t len) {
+        _hashData(buf, len);
+    }, IMAGEWRITER_HASH_QUEUE_DEPTH);
+    _asyncHash = false;
+    _hashWrites = true;
+    _fanOutChanges = 0;
+    _writeBusyTime = 0;
+#ifdef Q_OS_LINUX
+    _uring = nullptr;
+    _trailingVerifier = nullptr;
+#endif
 }
 
 DownloadThread::~DownloadThread()
 {
     _cancelled = true;
+    for (auto device : std::as_const(_fanOut))
+        device->cancelDownload();
     wait();
+    /* Devices use the scheduler until they are gone */
+    qDeleteAll(_fanOut);
+    _fanOut.clear();
+    delete _scheduler;
+#ifdef Q_OS_LINUX
+    delete _uring;
+    delete _trailingVerifier;
+#endif
     if (_file.isOpen())
         _file.close();
 
+    delete _hashStage;
     if (_firstBlock)
         qFreeAligned(_firstBlock);
+    delete _bmapGenerator;
+    delete _cacheTranscoder;
+    delete _journal;
+    if (_deltaBuf)
+        qFreeAligned(_deltaBuf);
 
     if (!--_curlCount)
         curl_global_cleanup();
@@ -88,6 +149,12 @@ int DownloadThread::_curl_xferinfo_callback(void *userdata, curl_off_t dltotal,
     return (static_cast<DownloadThread *>(userdata)->_progress(dltotal, dlnow, ultotal, ulnow) == false);
 }
 
+size_t DownloadThread::_curl_memory_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    static_cast<QByteArray *>(userdata)->append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
 size_t DownloadThread::_curl_header_callback( void *ptr, size_t size, size_t nmemb, void *userdata)
 {
     int len = size*nmemb;
@@ -113,6 +180,14 @@ QByteArray DownloadThread::_fileGetContentsTrimmed(const QString &filename)
 
 bool DownloadThread::_openAndPrepareDevice()
 {
+    if (!_fanOut.isEmpty())
+    {
+        /* Each device is opened and prepared by its own thread */
+        for (auto device : std::as_const(_fanOut))
+            device->start();
+        return true;
+    }
+
     if (_filename.startsWith("/dev/"))
     {
         emit preparationStatusUpdate(tr("unmounting drive"));
@@ -243,6 +318,8 @@ bool DownloadThread::_openAndPrepareDevice()
     }
 #endif
 
+    _checkJournal();
+
 #ifdef Q_OS_LINUX
     /* Optional optimizations for Linux */
 
@@ -260,7 +337,11 @@ bool DownloadThread::_openAndPrepareDevice()
 
         QByteArray discardmax = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/discard_max_bytes");
 
-        if (discardmax.isEmpty() || discardmax == "0")
+        if (_resumeTo || _deltaWrite)
+        {
+            qDebug() << "Not discarding, as we want to keep the data already on the device";
+        }
+        else if (discardmax.isEmpty() || discardmax == "0")
         {
             qDebug() << "BLKDISCARD not supported";
         }
@@ -290,55 +371,128 @@ bool DownloadThread::_openAndPrepareDevice()
                 }
             }
         }
+
+        if (_skipZeroBlocks)
+        {
+            /* Blocks of the image that only contain zeroes do not have to be transferred
+               if the device can zero ranges itself without us sending the data.
+               What discarded blocks read back as is not reliable, so they are not just skipped */
+            QByteArray writeZeroesMax = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/write_zeroes_max_bytes");
+
+            if (!writeZeroesMax.isEmpty() && writeZeroesMax != "0")
+            {
+                qDebug() << "Using BLKZEROOUT for zero blocks";
+                _zeroBlocks = ZeroBlocksZeroOut;
+            }
+        }
     }
 #endif
 
 #ifndef Q_OS_WIN
-    // Zero out MBR
-    qint64 knownsize = _file.size();
-    QByteArray emptyMB(1024*1024, 0);
-
-    emit preparationStatusUpdate(tr("zeroing out first and last MB of drive"));
-    qDebug() << "Zeroing out first and last MB of drive";
-    _timer.start();
-
-    if (!_file.write(emptyMB.data(), emptyMB.size()) || !_file.flush())
+    if (_deltaWrite)
     {
-        emit error(tr("Write error while zero'ing out MBR"));
-        return false;
+        qDebug() << "Delta mode. Leaving the start and end of the drive alone";
     }
-
-    // Zero out last part of card (may have GPT backup table)
-    if (knownsize > emptyMB.size())
+    else
     {
-        if (!_file.seek(knownsize-emptyMB.size())
-                || !_file.write(emptyMB.data(), emptyMB.size())
-                || !_file.flush()
-                || ::fsync(_file.handle()))
+        // Zero out MBR
+        qint64 knownsize = _file.size();
+        QByteArray emptyMB(1024*1024, 0);
+
+        emit preparationStatusUpdate(tr("zeroing out first and last MB of drive"));
+        qDebug() << "Zeroing out first and last MB of drive";
+        _timer.start();
+
+        if (!_file.write(emptyMB.data(), emptyMB.size()) || !_file.flush())
         {
-            emit error(tr("Write error while trying to zero out last part of card.<br>"
-                          "Card could be advertising wrong capacity (possible counterfeit)."));
+            emit error(tr("Write error while zero'ing out MBR"));
             return false;
         }
+
+        // Zero out last part of card (may have GPT backup table). Unless that is where a previous write got to
+        if (knownsize > emptyMB.size() && (quint64) knownsize-emptyMB.size() >= _resumeTo)
+        {
+            if (!_file.seek(knownsize-emptyMB.size())
+                    || !_file.write(emptyMB.data(), emptyMB.size())
+                    || !_file.flush()
+                    || ::fsync(_file.handle()))
+            {
+                emit error(tr("Write error while trying to zero out last part of card.<br>"
+                              "Card could be advertising wrong capacity (possible counterfeit)."));
+                return false;
+            }
+        }
+        emptyMB.clear();
+        _file.seek(0);
+        qDebug() << "Done zeroing out start and end of drive. Took" << _timer.elapsed() / 1000 << "seconds";
     }
-    emptyMB.clear();
-    _file.seek(0);
-    qDebug() << "Done zeroing out start and end of drive. Took" << _timer.elapsed() / 1000 << "seconds";
 #endif
 
 #ifdef Q_OS_LINUX
     _sectorsStart = _sectorsWritten();
+
+    if (_directIO)
+    {
+        /* Bypass the page cache. Requires buffers, lengths and offsets
+           to be a multiple of the logical block size of the device */
+        int blksz = 0;
+        auto l = Drivelist::ListStorageDevices();
+        for (const auto &i : l)
+        {
+            if (QByteArray::fromStdString(i.device) == _filename)
+            {
+                _alignment = i.logicalBlockSize;
+                break;
+            }
+        }
+        if (::ioctl(_file.handle(), BLKSSZGET, &blksz) == 0 && blksz > 0)
+            _alignment = qMax(_alignment, (size_t) blksz);
+
+        if (_setDirectIO(true))
+        {
+            qDebug() << "Using O_DIRECT. Logical block size:" << _alignment;
+            /* Writes are not cached, so no need to manage writeback ourselves */
+            _writebackWindow = 0;
+        }
+        else
+        {
+            _directIO = false;
+        }
+    }
 #endif
 
     return true;
 }
 
+bool DownloadThread::_setDirectIO(bool enable)
+{
+#ifdef Q_OS_LINUX
+    int fd = _file.handle();
+    int flags = ::fcntl(fd, F_GETFL);
+
+    if (flags == -1 || ::fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) == -1)
+    {
+        qDebug() << "Error changing O_DIRECT flag:" << strerror(errno);
+        return false;
+    }
+
+    return true;
+#else
+    Q_UNUSED(enable)
+    return false;
+#endif
+}
+
 void DownloadThread::run()
 {
     if (isImage() && !_openAndPrepareDevice())
     {
         return;
     }
+    if (isImage())
+    {
+        _loadBmap();
+    }
 
     qDebug() << "Image URL:" << _url;
     if (_url.startsWith("file://") && _url.at(7) != '/')
@@ -364,7 +518,8 @@ void DownloadThread::run()
     curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &DownloadThread::_curl_header_callback);
     curl_easy_setopt(_c, CURLOPT_HEADERDATA, this);
     curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
-    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 60);
+    /* Rather than waiting for a stalled connection to recover, move on to a mirror early */
+    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, _mirrors.size() > 1 ? IMAGEWRITER_MIRROR_STALL_TIME : 60);
     curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 100);
     if (_inputBufferSize)
         curl_easy_setopt(_c, CURLOPT_BUFFERSIZE, _inputBufferSize);
@@ -372,56 +527,59 @@ void DownloadThread::run()
     if (!_useragent.isEmpty())
         curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
 
-    if (_proxy.isEmpty())
-    {
-#ifndef QT_NO_NETWORKPROXY
-        /* Ask OS for proxy information. */
-        QNetworkProxyQuery npq{QUrl{_url}};
-        QList<QNetworkProxy> proxyList = QNetworkProxyFactory::systemProxyForQuery(npq);
-        if (!proxyList.isEmpty())
-        {
-            QNetworkProxy proxy = proxyList.first();
-            if (proxy.type() != proxy.NoProxy)
-            {
-                QUrl proxyUrl;
-
-                proxyUrl.setScheme(proxy.type() == proxy.Socks5Proxy ? "socks5h" : "http");
-                proxyUrl.setHost(proxy.hostName());
-                proxyUrl.setPort(proxy.port());
-                qDebug() << "Using proxy server:" << proxyUrl;
-
-                if (!proxy.user().isEmpty())
-                {
-                    proxyUrl.setUserName(proxy.user());
-                    proxyUrl.setPassword(proxy.password());
-                }
-
-                _proxy = proxyUrl.toEncoded();
-            }
-        }
-#endif
-    }
-
+    _detectSystemProxy(_url);
     if (!_proxy.isEmpty())
         curl_easy_setopt(_c, CURLOPT_PROXY, _proxy.constData());
 
     emit preparationStatusUpdate(tr("starting download"));
     _timer.start();
-    CURLcode ret = curl_easy_perform(_c);
+
+    if (_mirrors.size() > 1)
+    {
+        _selectMirror();
+        curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+    }
+
+    /* Use several connections if the server lets us download ranges of the file */
+    curl_off_t rangeSize = 0;
+    QByteArray rangeUrl = _downloadConnections > 1 ? _probeRanges(rangeSize) : QByteArray();
+    bool segmented = !rangeUrl.isEmpty();
+    CURLcode ret = CURLE_OK;
+
+    if (segmented)
+        ret = _performSegmented(rangeUrl, rangeSize, errorBuf, segmented);
+    if (!segmented)
+        ret = curl_easy_perform(_c);
 
     /* Deal with badly configured HTTP servers that terminate the connection quickly
        if connections stalls for some seconds while kernel commits buffers to slow SD card.
-       And also reconnect if we detect from our end that transfer stalled for more than one minute */
-    while (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
-           || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
-           || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset) )
+       And also reconnect if we detect from our end that transfer stalled for more than one minute.
+       If the image has mirrors, continue from the next one, also if a server cannot be reached at all.
+       Segmented downloads retry each range by themselves */
+    int mirrorsFailed = 0;
+    while (!segmented
+           && (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
+               || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
+               || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset)
+               || (mirrorsFailed+1 < _mirrors.size()
+                   && (ret == CURLE_HTTP2_STREAM || ret == CURLE_RECV_ERROR || ret == CURLE_SEND_ERROR
+                       || ret == CURLE_COULDNT_CONNECT || ret == CURLE_COULDNT_RESOLVE_HOST
+                       || ret == CURLE_SSL_CONNECT_ERROR || ret == CURLE_HTTP_RETURNED_ERROR))) )
     {
         time_t t = time(NULL);
         qDebug() << "HTTP connection lost. Time:" << t;
 
+        if (_lastDlNow != _lastFailureOffset)
+            mirrorsFailed = 0;
+        mirrorsFailed++;
+
         /* If last failure happened less than 5 seconds ago, something else may
-           be wrong. Sleep some time to prevent hammering server */
-        if (t - _lastFailureTime < 5)
+           be wrong. Sleep some time to prevent hammering server.
+           No need to wait if there is another mirror we did not try at this position yet */
+        bool otherMirror = _nextMirror();
+        if (otherMirror)
+            curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+        if ((!otherMirror || mirrorsFailed >= _mirrors.size()) && t - _lastFailureTime < 5)
         {
             qDebug() << "Sleeping 5 seconds";
             ::sleep(5);
@@ -469,195 +627,1094 @@ void DownloadThread::run()
     }
 }
 
-size_t DownloadThread::_writeData(const char *buf, size_t len)
+/* Ask OS for proxy information, if no proxy was set explicitly */
+void DownloadThread::_detectSystemProxy(const QByteArray &url)
 {
-    _writeCache(buf, len);
+    if (!_proxy.isEmpty())
+        return;
 
-    if (!_filename.isEmpty())
-    {
-        return _writeFile(buf, len);
-    }
-    else
+#ifndef QT_NO_NETWORKPROXY
+    QNetworkProxyQuery npq{QUrl{url}};
+    QList<QNetworkProxy> proxyList = QNetworkProxyFactory::systemProxyForQuery(npq);
+    if (!proxyList.isEmpty())
     {
-        _buf.append(buf, len);
-        return len;
-    }
-}
+        QNetworkProxy proxy = proxyList.first();
+        if (proxy.type() != proxy.NoProxy)
+        {
+            QUrl proxyUrl;
 
-void DownloadThread::_writeCache(const char *buf, size_t len)
-{
-    if (!_cacheEnabled || _cancelled)
-        return;
+            proxyUrl.setScheme(proxy.type() == proxy.Socks5Proxy ? "socks5h" : "http");
+            proxyUrl.setHost(proxy.hostName());
+            proxyUrl.setPort(proxy.port());
+            qDebug() << "Using proxy server:" << proxyUrl;
 
-    if (_cachefile.write(buf, len) != len)
-    {
-        qDebug() << "Error writing to cache file. Disabling caching.";
-        _cacheEnabled = false;
-        _cachefile.remove();
-    }
-}
+            if (!proxy.user().isEmpty())
+            {
+                proxyUrl.setUserName(proxy.user());
+                proxyUrl.setPassword(proxy.password());
+            }
 
-void DownloadThread::setCacheFile(const QString &filename, qint64 filesize)
-{
-    _cachefile.setFileName(filename);
-    if (_cachefile.open(QIODevice::WriteOnly))
-    {
-        _cacheEnabled = true;
-        if (filesize)
-        {
-            /* Pre-allocate space */
-            _cachefile.resize(filesize);
+            _proxy = proxyUrl.toEncoded();
         }
     }
-    else
-    {
-        qDebug() << "Error opening cache file for writing. Disabling caching.";
-    }
+#else
+    Q_UNUSED(url)
+#endif
 }
 
-void DownloadThread::_hashData(const char *buf, size_t len)
+/* Options for the connections of a segmented download */
+void DownloadThread::_setupRangeConnection(CURL *c)
 {
-    _writehash.addData(buf, len);
+    curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, _mirrors.size() > 1 ? IMAGEWRITER_MIRROR_STALL_TIME : 60);
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 100);
+    if (_inputBufferSize)
+        curl_easy_setopt(c, CURLOPT_BUFFERSIZE, _inputBufferSize);
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(c, CURLOPT_USERAGENT, _useragent.constData());
+    if (!_proxy.isEmpty())
+        curl_easy_setopt(c, CURLOPT_PROXY, _proxy.constData());
 }
 
-size_t DownloadThread::_writeFile(const char *buf, size_t len)
+/* Ask the server for the size of the file, and if it supports range requests.
+   Returns the URL to download the ranges from after any redirects, or an empty string if a segmented download is not possible */
+QByteArray DownloadThread::_probeRanges(curl_off_t &size)
 {
-    if (_cancelled)
-        return len;
+    QByteArray result;
 
-    if (!_firstBlock)
+    if (!_url.startsWith("http://") && !_url.startsWith("https://"))
+        return result;
+
+    CURL *c = curl_easy_init();
+    _setupRangeConnection(c);
+    curl_easy_setopt(c, CURLOPT_URL, _url.constData());
+    curl_easy_setopt(c, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, &DownloadThread::_curl_header_callback);
+    curl_easy_setopt(c, CURLOPT_HEADERDATA, this);
+    _acceptRanges = false;
+
+    CURLcode ret = curl_easy_perform(c);
+    char *effectiveUrl = nullptr;
+    size = -1;
+    if (ret == CURLE_OK)
     {
-        _writehash.addData(buf, len);
-        _firstBlock = (char *) qMallocAligned(len, 4096);
-        _firstBlockSize = len;
-        ::memcpy(_firstBlock, buf, len);
-
-        return _file.seek(len) ? len : 0;
+        curl_easy_getinfo(c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+        curl_easy_getinfo(c, CURLINFO_EFFECTIVE_URL, &effectiveUrl);
     }
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-    QFuture<void> wh = QtConcurrent::run(&DownloadThread::_hashData, this, buf, len);
-#else
-    QFuture<void> wh = QtConcurrent::run(this, &DownloadThread::_hashData, buf, len);
-#endif
 
-    qint64 written = _file.write(buf, len);
-    _bytesWritten += written;
+    if (ret != CURLE_OK)
+        qDebug() << "Error asking server about range support:" << curl_easy_strerror(ret) << "Using a single connection";
+    else if (!_acceptRanges)
+        qDebug() << "Server does not support range requests. Using a single connection";
+    else if (size < 2*IMAGEWRITER_DOWNLOAD_SEGMENT_SIZE)
+        qDebug() << "File size" << size << "unknown or too small to download in ranges. Using a single connection";
+    else if (effectiveUrl)
+        result = effectiveUrl;
 
-    if ((size_t) written != len)
-    {
-        qDebug() << "Write error:" << _file.errorString() << "while writing len:" << len;
-    }
-
-    wh.waitForFinished();
-    return (written < 0) ? 0 : written;
+    curl_easy_cleanup(c);
+    return result;
 }
 
-bool DownloadThread::_progress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+/* Download over several connections. Clears segmented if the server turned out not to honor range requests,
+   before anything was written, so that the caller can download the file over a single connection instead */
+CURLcode DownloadThread::_performSegmented(const QByteArray &url, curl_off_t size, char *errorBuf, bool &segmented)
 {
-    if (dltotal)
-        _lastDlTotal = _startOffset + dltotal;
-    _lastDlNow   = _startOffset + dlnow;
+    qDebug() << "Downloading" << size << "bytes over" << _downloadConnections << "connections from" << url;
 
-    return !_cancelled;
-}
-
-void DownloadThread::_header(const string &header)
-{
-    if (header.compare(0, 6, "Date: ") == 0)
+    SegmentedDownload download(url, size, _downloadConnections, IMAGEWRITER_DOWNLOAD_SEGMENT_SIZE, IMAGEWRITER_DOWNLOAD_WINDOW*1024*1024);
+    download.setConfigureFunction([this](CURL *c) {
+        _setupRangeConnection(c);
+    });
+    if (_mirrors.size() > 1)
     {
-        _serverTime = curl_getdate(header.data()+6, NULL);
+        /* Ranges that fail continue from the other mirrors, in order of how fast they answered */
+        QList<QByteArray> others;
+        for (int i = 1; i < _mirrors.size(); i++)
+            others.append(_mirrors.at((_mirrorIndex+i) % _mirrors.size()));
+        download.setMirrors(others);
     }
-    else if (header.compare(0, 15, "Last-Modified: ") == 0)
+
+    CURLcode ret = download.perform([this](const char *buf, size_t len) {
+        /* Passes data on in order, just like the write callback of a single connection */
+        return _writeData(buf, len) == len;
+    }, [this, size](curl_off_t received) {
+        return _progress(size, received, 0, 0);
+    });
+
+    if (ret == CURLE_RANGE_ERROR && !download.passedOn())
     {
-        _lastModified = curl_getdate(header.data()+15, NULL);
+        qDebug() << download.errorString() << "Using a single connection";
+        segmented = false;
+        return ret;
     }
-    qDebug() << "Received header:" << QByteArray(header.c_str()).trimmed();
-}
 
-void DownloadThread::cancelDownload()
-{
-    _cancelled = true;
-    //deleteDownloadedFile();
-}
+    if (ret != CURLE_OK && !download.errorString().isEmpty())
+        qstrncpy(errorBuf, download.errorString().toUtf8().constData(), CURL_ERROR_SIZE);
 
-QByteArray DownloadThread::data()
-{
-    return _buf;
+    return ret;
 }
 
-bool DownloadThread::successfull()
+/* Download a small file (like a block map) to memory, taking no longer than timeout seconds.
+ * Returns an empty array if it does not exist, or is larger than maxSize */
+QByteArray DownloadThread::_downloadToMemory(const QByteArray &url, size_t maxSize, long timeout)
 {
-    return _successful;
+    QByteArray result;
+    CURL *c = curl_easy_init();
+
+    curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, &DownloadThread::_curl_memory_write_callback);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, &result);
+    curl_easy_setopt(c, CURLOPT_URL, url.constData());
+    curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, qMin(timeout, 30L));
+    curl_easy_setopt(c, CURLOPT_TIMEOUT, timeout);
+    curl_easy_setopt(c, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) maxSize);
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(c, CURLOPT_USERAGENT, _useragent.constData());
+    _detectSystemProxy(url);
+    if (!_proxy.isEmpty())
+        curl_easy_setopt(c, CURLOPT_PROXY, _proxy.constData());
+
+    CURLcode ret = curl_easy_perform(c);
+    curl_easy_cleanup(c);
+
+    if (ret != CURLE_OK || result.size() > (qsizetype) maxSize)
+    {
+        qDebug() << "Not using" << url << ":" << curl_easy_strerror(ret);
+        result.clear();
+    }
+
+    return result;
 }
 
-time_t DownloadThread::lastModified()
+void DownloadThread::setBmapUrls(const QList<QByteArray> &urls, const QList<QByteArray> &guessedUrls)
 {
-    return _lastModified;
+    _bmapUrls = urls;
+    _guessedBmapUrls = guessedUrls;
 }
 
-time_t DownloadThread::serverTime()
+void DownloadThread::setMirrorUrls(const QList<QByteArray> &urls)
 {
-    return _serverTime;
+    _mirrors = QList<QByteArray>() << _url;
+    for (const QByteArray &url : urls)
+    {
+        if (!_mirrors.contains(url))
+            _mirrors.append(url);
+    }
+    _mirrorIndex = 0;
 }
 
-void DownloadThread::deleteDownloadedFile()
+/* Ask all mirrors for the image at the same time, and download from the one that answers first.
+   As they are all asked at once, there is no need to wait for the others once one has answered.
+   The others are kept in their original order, and the ones that failed are tried last */
+void DownloadThread::_selectMirror()
 {
-    if (!_filename.isEmpty())
+    struct Probe
     {
-        _file.close();
-        if (_cachefile.isOpen())
-            _cachefile.remove();
-#ifdef Q_OS_WIN
-        _volumeFile.close();
-#endif
+        QByteArray url;
+        CURL *handle;
+        bool done;
+        CURLcode result;
+    };
+    std::vector<Probe> probes;
+    CURLM *multi = curl_multi_init();
+    int fastest = -1;
+
+    for (const QByteArray &url : std::as_const(_mirrors))
+    {
+        CURL *c = curl_easy_init();
+        _setupRangeConnection(c);
+        curl_easy_setopt(c, CURLOPT_URL, url.constData());
+        curl_easy_setopt(c, CURLOPT_NOBODY, 1);
+        curl_easy_setopt(c, CURLOPT_TIMEOUT, IMAGEWRITER_MIRROR_PROBE_TIMEOUT);
+        curl_multi_add_handle(multi, c);
+        probes.push_back({url, c, false, CURLE_OK});
+    }
 
-        if (!_filename.startsWith("/dev/") && !_filename.startsWith("\\\\.\\"))
+    int running = 1;
+    while (running && fastest == -1 && !_cancelled)
+    {
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)))
         {
-            //_file.remove();
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (size_t i = 0; i < probes.size(); i++)
+            {
+                Probe &p = probes[i];
+                if (p.handle != msg->easy_handle)
+                    continue;
+
+                p.done = true;
+                p.result = msg->data.result;
+                if (p.result == CURLE_OK)
+                {
+                    /* Time to first byte includes name lookup, connecting and the TLS handshake */
+                    double seconds = 0;
+                    curl_easy_getinfo(p.handle, CURLINFO_STARTTRANSFER_TIME, &seconds);
+                    qDebug() << "Mirror" << p.url << "answered in" << int(seconds*1000) << "ms";
+                    if (fastest == -1)
+                        fastest = i;
+                }
+                else
+                {
+                    qDebug() << "Mirror" << p.url << "failed:" << curl_easy_strerror(p.result);
+                }
+            }
         }
+        if (running && fastest == -1)
+            curl_multi_poll(multi, NULL, 0, 100, NULL);
     }
-}
 
-uint64_t DownloadThread::dlNow()
-{
-    return _lastDlNow;
-}
+    QList<QByteArray> ordered, failed;
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+        const Probe &p = probes.at(i);
+        if ((int) i == fastest)
+            ordered.prepend(p.url);
+        else if (!p.done || p.result == CURLE_OK)
+            ordered.append(p.url);
+        else
+            failed.append(p.url);
 
-uint64_t DownloadThread::dlTotal()
-{
-    return _lastDlTotal;
-}
+        curl_multi_remove_handle(multi, p.handle);
+        curl_easy_cleanup(p.handle);
+    }
+    curl_multi_cleanup(multi);
 
-uint64_t DownloadThread::verifyNow()
-{
-    return _lastVerifyNow;
+    if (fastest == -1)
+        qDebug() << "No mirror answered within" << IMAGEWRITER_MIRROR_PROBE_TIMEOUT << "seconds";
+
+    _mirrors = ordered+failed;
+    _mirrorIndex = 0;
+    _url = _mirrors.first();
+    qDebug() << "Downloading from mirror:" << _url;
 }
 
-uint64_t DownloadThread::verifyTotal()
+/* Continue from the next mirror. Returns false if there is no other one */
+bool DownloadThread::_nextMirror()
 {
-    return _verifyTotal;
+    if (_mirrors.size() < 2)
+        return false;
+
+    _mirrorIndex = (_mirrorIndex+1) % _mirrors.size();
+    _url = _mirrors.at(_mirrorIndex);
+    qDebug() << "Continuing download from mirror:" << _url;
+    return true;
 }
 
-uint64_t DownloadThread::bytesWritten()
+void DownloadThread::setCacheBmapFile(const QString &filename)
 {
-    if (_sectorsStart != -1)
-        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512, (uint64_t) _bytesWritten);
-    else
-        return _bytesWritten;
+    _cacheBmapFileName = filename;
 }
 
-void DownloadThread::_onDownloadSuccess()
+void DownloadThread::setCacheTranscodeFile(const QString &filename, CacheTranscoder::Format format)
 {
-    _writeComplete();
+    if (!_cacheEnabled || _expectedHash.isEmpty())
+        return;
+
+    _cacheTranscodeFileName = filename;
+    _cacheTranscoder = new CacheTranscoder(filename, format, IMAGEWRITER_CACHE_FRAME_SIZE*1024*1024, IMAGEWRITER_CACHE_ZSTD_LEVEL);
 }
 
-void DownloadThread::_onDownloadError(const QString &msg)
+void DownloadThread::setJournalFile(const QString &filename)
 {
-    _cancelled = true;
-    emit error(msg);
+#ifdef Q_OS_LINUX
+    /* Chunks are only recorded once writeback has waited for them to reach the device.
+       Without the hash of the image, a journal cannot tell whether the image changed since */
+    if (_resumeEnabled && _writebackWindow && !_expectedHash.isEmpty())
+    {
+        delete _journal;
+        _journal = new WriteJournal(filename);
+    }
+#else
+    Q_UNUSED(filename)
+#endif
 }
 
-void DownloadThread::_onWriteError()
+/* See if a previous write of the same image to this device was interrupted, and how much of it can be kept */
+void DownloadThread::_checkJournal()
+{
+    if (!_journal)
+        return;
+
+    QByteArray imageKey = _expectedHash;
+    quint64 deviceSize = _file.size();
+    size_t chunkSize = _writeChunks.chunkSize();
+    QList<quint64> digests = _journal->load(imageKey, _filename, deviceSize, chunkSize);
+    qsizetype good = 0;
+
+    if (digests.size() > 1)
+    {
+        /* The journal tells what should be there, make sure it still is. The first chunk
+           holds the first block, which is only written at the end, so it is always written again */
+        emit preparationStatusUpdate(tr("checking data written previously"));
+        qDebug() << "Write journal has" << digests.size() << "chunks from a previous write. Reading them back";
+        QElapsedTimer t;
+        t.start();
+        char *buf = (char *) qMallocAligned(chunkSize, 4096);
+        good = 1;
+
+#ifdef Q_OS_LINUX
+        posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        _file.seek(chunkSize);
+        while (good < digests.size() && !_cancelled)
+        {
+            if (_file.read(buf, chunkSize) != (qint64) chunkSize || ChunkDigests::digest(buf, chunkSize) != digests[good])
+                break;
+            good++;
+        }
+        qFreeAligned(buf);
+        _file.seek(0);
+        qDebug() << good << "chunks read back correctly in" << t.elapsed() / 1000.0 << "seconds";
+    }
+
+    if (good > 1)
+    {
+        _resumeFrom = chunkSize;
+        _resumeTo = good*chunkSize;
+        qDebug() << "Resuming previous write. Not writing" << _resumeFrom << "-" << _resumeTo << "again";
+    }
+    else
+    {
+        good = 0;
+    }
+
+    if (!_journal->start(imageKey, _filename, deviceSize, chunkSize, digests.mid(0, good)))
+    {
+        delete _journal;
+        _journal = nullptr;
+    }
+}
+
+/* Record the chunks that have reached the device since last time. Called after writeback waited for them */
+void DownloadThread::_updateJournal()
+{
+    if (!_journal)
+        return;
+
+    /* Digests are calculated on the hash stage, which may not have caught up with the writes yet */
+    _hashStage->waitAll();
+    QList<quint64> digests = _writeChunks.digests();
+    qsizetype synced = qMin<qsizetype>(_writebackWaited / _writeChunks.chunkSize(), digests.size());
+
+    if (synced > _journal->count() && !_journal->append(digests.mid(_journal->count(), synced-_journal->count())))
+    {
+        qDebug() << "Error updating write journal. Disabling it";
+        _journal->remove();
+        delete _journal;
+        _journal = nullptr;
+    }
+}
+
+void DownloadThread::_loadBmap()
+{
+    _bmap.clear();
+    _bmapRange = 0;
+
+    if (_deltaWrite && (!_bmapUrls.isEmpty() || !_guessedBmapUrls.isEmpty()))
+    {
+        /* Unmapped ranges would be left with whatever was on the device, and not be verified */
+        qDebug() << "Delta mode compares, writes and verifies the whole image. Not using a block map";
+        return;
+    }
+
+    /* Block maps that are only guessed to exist next to the image should not hold up the write for long */
+    const QList<QByteArray> urls = _bmapUrls+_guessedBmapUrls;
+    for (qsizetype i = 0; i < urls.size(); i++)
+    {
+        if (_cancelled)
+            return;
+
+        const QByteArray &url = urls.at(i);
+        QByteArray xml = _downloadToMemory(url, IMAGEWRITER_BMAP_MAX_SIZE,
+                                           i < _bmapUrls.size() ? 60 : IMAGEWRITER_BMAP_GUESS_TIMEOUT);
+        if (xml.isEmpty())
+            continue;
+
+        if (_bmap.parse(xml))
+        {
+            qDebug() << "Using block map" << url << "Image size:" << _bmap.imageSize() << "mapped:" << _bmap.mappedSize();
+            return;
+        }
+        else
+        {
+            qDebug() << "Ignoring block map" << url << ":" << _bmap.errorString();
+        }
+    }
+}
+
+size_t DownloadThread::_writeData(const char *buf, size_t len)
+{
+    _writeCache(buf, len);
+
+    if (!_filename.isEmpty())
+    {
+        return _writeFile(buf, len);
+    }
+    else
+    {
+        _buf.append(buf, len);
+        return len;
+    }
+}
+
+void DownloadThread::_writeCache(const char *buf, size_t len)
+{
+    if (!_cacheEnabled || _cancelled)
+        return;
+
+    if (_cachefile.write(buf, len) != len)
+    {
+        qDebug() << "Error writing to cache file. Disabling caching.";
+        _cacheEnabled = false;
+        _cachefile.remove();
+    }
+}
+
+void DownloadThread::setCacheFile(const QString &filename, qint64 filesize)
+{
+    _cachefile.setFileName(filename);
+    if (_cachefile.open(QIODevice::WriteOnly))
+    {
+        _cacheEnabled = true;
+        if (filesize)
+        {
+            /* Pre-allocate space */
+            _cachefile.resize(filesize);
+        }
+    }
+    else
+    {
+        qDebug() << "Error opening cache file for writing. Disabling caching.";
+    }
+}
+
+/* Runs on the hash stage thread */
+void DownloadThread::_hashData(const char *buf, size_t len)
+{
+    _writehash.addData(buf, len);
+    _writeChunks.addData(buf, len);
+    if (_bmapGenerator)
+        _bmapGenerator->addData(buf, len);
+    if (_cacheTranscoder)
+        _cacheTranscoder->addData(buf, len);
+}
+
+size_t DownloadThread::_writeFile(const char *buf, size_t len)
+{
+    if (_cancelled)
+        return len;
+
+    if (!_fanOut.isEmpty())
+        return _writeFanOut(buf, len);
+
+    if (!_firstBlock)
+    {
+        if (_cacheEnabled && !_cacheBmapFileName.isEmpty() && !_expectedHash.isEmpty())
+        {
+            _bmapGenerator = new BmapGenerator(IMAGEWRITER_ZERO_BLOCK_SIZE);
+        }
+        if (_hashWrites)
+            _hashData(buf, len);
+        _firstBlock = (char *) qMallocAligned(len, 4096);
+        _firstBlockSize = len;
+        ::memcpy(_firstBlock, buf, len);
+
+        return _file.seek(len) ? len : 0;
+    }
+    uint64_t hashSeq = _hashWrites ? _hashStage->submit(buf, len) : 0;
+    QElapsedTimer writeTimer;
+    writeTimer.start();
+
+    qint64 pos = _file.pos();
+    bool ok = true;
+
+#ifdef Q_OS_LINUX
+    if (_directIO && pos % _alignment)
+    {
+        qDebug() << "Write offset" << pos << "not aligned to logical block size. Disabling O_DIRECT";
+        _directIO = !_setDirectIO(false);
+    }
+#endif
+
+    if (pos >= (qint64) _resumeFrom && pos+len <= _resumeTo)
+    {
+        /* Already on the device from a previous write that was interrupted */
+        _bytesWritten += len;
+        _bytesSkipped += len;
+    }
+    else if (_deltaWrite)
+    {
+        ok = _writeDelta(buf, len, pos);
+    }
+    else if (_bmap.isValid() && !_bmap.unmappedIsZero())
+    {
+        /* Only write the parts of the buffer the block map lists as containing data.
+           Block maps we generated ourselves are only used for verification, as their
+           unmapped ranges must be zeroed, which _writeBlocks() already takes care of */
+        const QList<BmapFile::Range> &ranges = _bmap.ranges();
+        quint64 end = pos+len, mapped = 0;
+
+        while (ok && _bmapRange < ranges.size() && ranges.at(_bmapRange).offset < end)
+        {
+            const BmapFile::Range &r = ranges.at(_bmapRange);
+            quint64 rangeStart = qMax(r.offset, (quint64) pos);
+            quint64 rangeEnd = qMin(r.offset+r.length, end);
+
+            if (rangeStart < rangeEnd)
+            {
+                ok = _writeBlocks(buf+(rangeStart-pos), rangeEnd-rangeStart, rangeStart);
+                mapped += rangeEnd-rangeStart;
+            }
+            if (r.offset+r.length > end)
+                break;
+            _bmapRange++;
+        }
+
+        _bytesWritten += len-mapped;
+        _bytesSkipped += len-mapped;
+    }
+    else
+    {
+        ok = _writeBlocks(buf, len, pos);
+    }
+
+    if (ok && !_file.seek(pos+len))
+    {
+        ok = false;
+    }
+    if (ok && _writebackWindow)
+    {
+        _writeback(pos+len);
+    }
+
+    _writeBusyTime += writeTimer.nsecsElapsed();
+    if (_hashWrites && !_asyncHash)
+    {
+        /* Caller may reuse buffer as soon as we return */
+        _hashStage->waitFor(hashSeq);
+    }
+    return ok ? len : 0;
+}
+
+/* Hand a copy of the buffer to every device that is still being written to.
+   Devices that have room get it first, so a slow device does not hold up the others.
+   A device that stays full for too long is dropped by push() */
+size_t DownloadThread::_writeFanOut(const char *buf, size_t len)
+{
+    uint64_t hashSeq = _hashStage->submit(buf, len);
+    QByteArray data(buf, len);
+    QList<FanOutDeviceThread *> pending = _fanOut;
+    int active = 0;
+
+    while (!pending.isEmpty() && !_cancelled)
+    {
+        std::unique_lock<std::mutex> lock(_fanOutMutex);
+        quint64 changes = _fanOutChanges;
+        lock.unlock();
+
+        for (auto i = pending.begin(); i != pending.end(); )
+        {
+            FanOutDeviceThread::PushResult result = (*i)->push(data);
+            if (result == FanOutDeviceThread::Full)
+            {
+                ++i;
+                continue;
+            }
+            if (result == FanOutDeviceThread::Queued)
+                active++;
+            i = pending.erase(i);
+        }
+
+        if (!pending.isEmpty())
+        {
+            /* Also wake up regularly, to drop devices that stay full, and to notice cancellation */
+            lock.lock();
+            _fanOutChanged.wait_for(lock, std::chrono::milliseconds(100), [this, changes]{
+                return _fanOutChanges != changes;
+            });
+        }
+    }
+    _bytesWritten += len;
+
+    if (!_asyncHash)
+    {
+        _hashStage->waitFor(hashSeq);
+    }
+    if (!active)
+    {
+        qDebug() << "Writing failed on all devices";
+        return 0;
+    }
+
+    return len;
+}
+
+/* Called from the device threads */
+void DownloadThread::_onFanOutChanged()
+{
+    std::unique_lock<std::mutex> lock(_fanOutMutex);
+    _fanOutChanges++;
+    lock.unlock();
+    _fanOutChanged.notify_all();
+}
+
+/* Let the devices complete their writes, and wait until they are done verifying */
+void DownloadThread::_finishFanOut()
+{
+    int failed = 0;
+    /* Devices check what they wrote against the digests calculated here, instead of calculating them again */
+    QList<quint64> chunkDigests = _writeChunks.digests();
+
+    for (auto device : std::as_const(_fanOut))
+        device->finish(_writeDigest, chunkDigests);
+
+    for (auto device : std::as_const(_fanOut))
+    {
+        device->wait();
+        if (!device->succeeded())
+            failed++;
+    }
+    _closeFiles();
+
+    if (_cancelled)
+        return;
+
+    qDebug() << "Image written to" << _fanOut.size()-failed << "of" << _fanOut.size() << "devices";
+    const QMap<QString, double> throughput = portThroughput();
+    for (auto i = throughput.cbegin(); i != throughput.cend(); ++i)
+        qDebug() << "Port" << i.key() << "throughput:" << i.value() << "MB/s";
+    if (failed)
+    {
+        DownloadThread::_onDownloadError(tr("Writing failed on %1 of %2 storage devices").arg(failed).arg(_fanOut.size()));
+        return;
+    }
+
+    emit success();
+}
+
+/* Write buffer, sending runs of zero blocks through _writeZeroes() */
+bool DownloadThread::_writeBlocks(const char *buf, size_t len, qint64 pos)
+{
+    if (_zeroBlocks == ZeroBlocksWrite || len < IMAGEWRITER_ZERO_BLOCK_SIZE
+            || (quintptr) buf % 16 || pos % _alignment)
+    {
+        return _writeRange(buf, len, pos);
+    }
+
+    /* Split buffer in runs of data and runs of zero blocks.
+       Any odd-sized tail is always written as data */
+    size_t blocks = len / IMAGEWRITER_ZERO_BLOCK_SIZE;
+    size_t runStart = 0;
+    bool runIsZero = isZeroBlock(buf, IMAGEWRITER_ZERO_BLOCK_SIZE);
+    bool ok = true;
+
+    for (size_t i = 1; i <= blocks && ok; i++)
+    {
+        size_t offset = i*IMAGEWRITER_ZERO_BLOCK_SIZE;
+        bool isZero = (i < blocks) ? isZeroBlock(buf+offset, IMAGEWRITER_ZERO_BLOCK_SIZE) : !runIsZero;
+
+        if (isZero != runIsZero)
+        {
+            if (runIsZero)
+                ok = _writeZeroes(offset-runStart, pos+runStart);
+            else
+                ok = _writeRange(buf+runStart, offset-runStart, pos+runStart);
+            runStart = offset;
+            runIsZero = isZero;
+        }
+    }
+    if (ok && runStart < len)
+    {
+        ok = _writeRange(buf+runStart, len-runStart, pos+runStart);
+    }
+
+    return ok;
+}
+
+bool DownloadThread::_writeRange(const char *buf, size_t len, qint64 pos)
+{
+    qint64 written;
+    const char *wbuf = buf;
+    size_t wlen = len;
+    char *bounceBuf = nullptr;
+
+#ifdef Q_OS_LINUX
+    if (_directIO && ((quintptr) buf % _alignment || len % _alignment))
+    {
+        /* Only the last block of an image is expected to be odd-sized.
+           Pad it with zeroes to a whole logical block */
+        wlen = ((len + _alignment - 1) / _alignment) * _alignment;
+        bounceBuf = (char *) qMallocAligned(wlen, qMax(_alignment, (size_t) 4096));
+        ::memcpy(bounceBuf, buf, len);
+        ::memset(bounceBuf+len, 0, wlen-len);
+        wbuf = bounceBuf;
+    }
+
+    if (_uring)
+    {
+        /* Asynchronous write. _bytesWritten is updated on completion */
+        written = _uring->write(wbuf, wlen, pos) ? len : -1;
+
+        if (written == -1)
+        {
+            qDebug() << "Write error:" << strerror(_uring->error()) << "while writing len:" << len;
+        }
+    }
+    else
+#endif
+    {
+        if (_file.pos() != pos && !_file.seek(pos))
+        {
+            written = -1;
+        }
+        else
+        {
+            written = _file.write(wbuf, wlen);
+        }
+
+        if ((size_t) written != wlen)
+        {
+            qDebug() << "Write error:" << _file.errorString() << "while writing len:" << len;
+            written = -1;
+        }
+        else
+        {
+            written = len;
+            _bytesWritten += len;
+        }
+    }
+
+    if (bounceBuf)
+    {
+        qFreeAligned(bounceBuf);
+    }
+
+    return written == (qint64) len;
+}
+
+/* Handle a run of all-zero blocks without transferring the data to the device */
+bool DownloadThread::_writeZeroes(size_t len, qint64 pos)
+{
+#ifdef Q_OS_LINUX
+    if (_zeroBlocks == ZeroBlocksZeroOut)
+    {
+        uint64_t range[2] = { (uint64_t) pos, len };
+
+        if (::ioctl(_file.handle(), BLKZEROOUT, &range) == -1)
+        {
+            qDebug() << "BLKZEROOUT failed:" << strerror(errno) << "Writing zero blocks normally";
+            _zeroBlocks = ZeroBlocksWrite;
+            QByteArray zeroes(IMAGEWRITER_ZERO_BLOCK_SIZE, 0);
+            for (size_t i = 0; i < len; i += zeroes.size())
+            {
+                if (!_writeRange(zeroes.constData(), qMin(len-i, (size_t) zeroes.size()), pos+i))
+                    return false;
+            }
+            return true;
+        }
+    }
+#endif
+
+    _bytesWritten += len;
+    _bytesSkipped += len;
+    return true;
+}
+
+/* Read what is on the device at pos, and only write the blocks that differ from buf */
+bool DownloadThread::_writeDelta(const char *buf, size_t len, qint64 pos)
+{
+    size_t readLen = ((len + _alignment - 1) / _alignment) * _alignment;
+    if (readLen > _deltaBufSize)
+    {
+        if (_deltaBuf)
+            qFreeAligned(_deltaBuf);
+        _deltaBuf = (char *) qMallocAligned(readLen, qMax(_alignment, (size_t) 4096));
+        _deltaBufSize = readLen;
+    }
+
+    if (!_file.seek(pos) || _file.read(_deltaBuf, readLen) < (qint64) len)
+    {
+        qDebug() << "Error reading from device at offset" << pos << "in delta mode. Writing block as-is";
+        return _writeBlocks(buf, len, pos);
+    }
+
+#ifdef Q_OS_LINUX
+    if (!_directIO)
+    {
+        /* We will not read this again, and get the kernel started on the next part while we compare and write */
+        posix_fadvise(_file.handle(), pos, len, POSIX_FADV_DONTNEED);
+        posix_fadvise(_file.handle(), pos+len, len, POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    /* Write runs of consecutive blocks that differ */
+    size_t runStart = 0;
+    bool runDiffers = false, ok = true;
+
+    for (size_t offset = 0; ok; offset += IMAGEWRITER_DELTA_BLOCK_SIZE)
+    {
+        bool end = offset >= len;
+        if (end)
+            offset = len;
+        bool differs = !end && ::memcmp(buf+offset, _deltaBuf+offset, qMin((size_t) IMAGEWRITER_DELTA_BLOCK_SIZE, len-offset)) != 0;
+
+        if (!end && differs == runDiffers)
+            continue;
+
+        if (runDiffers)
+        {
+            ok = _writeBlocks(buf+runStart, offset-runStart, pos+runStart);
+        }
+        else
+        {
+            _bytesWritten += offset-runStart;
+            _bytesSkipped += offset-runStart;
+            _deltaSame += offset-runStart;
+        }
+
+        if (end)
+            break;
+        runStart = offset;
+        runDiffers = differs;
+    }
+
+    return ok;
+}
+
+/* Keep at most two windows of dirty data in the page cache.
+ * Start writeback of each window as soon as it is complete, and wait for the one before it */
+void DownloadThread::_writeback(quint64 offset)
+{
+#ifdef Q_OS_LINUX
+    if (offset - _writebackSubmitted < _writebackWindow)
+        return;
+
+    /* Queued writes must have landed in the page cache before we can flush them */
+    if (!_drainWrites())
+        return;
+
+    int fd = _file.handle();
+    if (_writebackSubmitted > _writebackWaited)
+    {
+        if (::sync_file_range(fd, _writebackWaited, _writebackSubmitted-_writebackWaited,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+        {
+            qDebug() << "sync_file_range() failed:" << strerror(errno) << "Disabling progressive writeback";
+            _writebackWindow = 0;
+            return;
+        }
+        _writebackWaited = _writebackSubmitted;
+
+        /* The first block is only written at the very end */
+        _bytesSynced = _writebackWaited - (_firstBlock ? _firstBlockSize : 0);
+
+        if (_trailingVerify && !_trailingVerifier)
+            _startTrailingVerify();
+        if (_trailingVerifier)
+            _trailingVerifier->setLimit(_writebackWaited);
+        _updateJournal();
+    }
+
+    ::sync_file_range(fd, _writebackSubmitted, offset-_writebackSubmitted, SYNC_FILE_RANGE_WRITE);
+    _writebackSubmitted = offset;
+#else
+    Q_UNUSED(offset)
+#endif
+}
+
+/* Read back what has reached the device while the rest of the image is still being written */
+void DownloadThread::_startTrailingVerify()
+{
+#ifdef Q_OS_LINUX
+    /* Only try once */
+    _trailingVerify = false;
+
+    /* Block maps are verified range by range instead of through _verifyhash */
+    if (!_verifyEnabled || _bmap.isValid() || !_firstBlock || _firstBlockSize % _alignment)
+        return;
+
+    _trailingVerifier = new TrailingVerifier(_filename.constData(), _firstBlockSize, _alignment, IMAGEWRITER_TRAILING_VERIFY_BLOCKSIZE,
+                                             [this](const char *buf, size_t len) {
+        _verifyData(buf, len);
+    });
+    if (!_trailingVerifier->isValid())
+    {
+        qDebug() << "Cannot open" << _filename << "with O_DIRECT for reading:" << strerror(errno) << "Verifying at the end instead";
+        delete _trailingVerifier;
+        _trailingVerifier = nullptr;
+        return;
+    }
+
+    /* Worker does not read anything before the first setLimit(), so it is safe to add this here */
+    _verifyData(_firstBlock, _firstBlockSize);
+    qDebug() << "Verifying data in the background as it reaches the device";
+#endif
+}
+
+bool DownloadThread::_progress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+{
+    if (dltotal)
+        _lastDlTotal = _startOffset + dltotal;
+    _lastDlNow   = _startOffset + dlnow;
+
+    return !_cancelled;
+}
+
+void DownloadThread::_header(const string &header)
+{
+    if (header.compare(0, 6, "Date: ") == 0)
+    {
+        _serverTime = curl_getdate(header.data()+6, NULL);
+    }
+    else if (header.compare(0, 15, "Last-Modified: ") == 0)
+    {
+        _lastModified = curl_getdate(header.data()+15, NULL);
+    }
+    else if (QByteArray(header.c_str()).trimmed().toLower() == "accept-ranges: bytes")
+    {
+        _acceptRanges = true;
+    }
+    qDebug() << "Received header:" << QByteArray(header.c_str()).trimmed();
+}
+
+void DownloadThread::cancelDownload()
+{
+    _cancelled = true;
+    for (auto device : std::as_const(_fanOut))
+        device->cancelDownload();
+    //deleteDownloadedFile();
+}
+
+QByteArray DownloadThread::data()
+{
+    return _buf;
+}
+
+bool DownloadThread::successfull()
+{
+    return _successful;
+}
+
+time_t DownloadThread::lastModified()
+{
+    return _lastModified;
+}
+
+time_t DownloadThread::serverTime()
+{
+    return _serverTime;
+}
+
+void DownloadThread::deleteDownloadedFile()
+{
+    if (!_filename.isEmpty())
+    {
+        _file.close();
+        if (_cachefile.isOpen())
+            _cachefile.remove();
+#ifdef Q_OS_WIN
+        _volumeFile.close();
+#endif
+
+        if (!_filename.startsWith("/dev/") && !_filename.startsWith("\\\\.\\"))
+        {
+            //_file.remove();
+        }
+    }
+}
+
+uint64_t DownloadThread::dlNow()
+{
+    return _lastDlNow;
+}
+
+uint64_t DownloadThread::dlTotal()
+{
+    return _lastDlTotal;
+}
+
+/* With several devices, progress is that of the slowest device still being written to */
+uint64_t DownloadThread::verifyNow()
+{
+    if (!_fanOut.isEmpty())
+    {
+        uint64_t now = 0;
+        bool first = true;
+        for (auto device : std::as_const(_fanOut))
+        {
+            if (device->isActive() && (first || device->verifyNow() < now))
+            {
+                now = device->verifyNow();
+                first = false;
+            }
+        }
+        return now;
+    }
+
+    return _lastVerifyNow;
+}
+
+uint64_t DownloadThread::verifyTotal()
+{
+    if (!_fanOut.isEmpty())
+    {
+        uint64_t total = 0;
+        for (auto device : std::as_const(_fanOut))
+        {
+            if (device->isActive())
+                total = qMax(total, device->verifyTotal());
+        }
+        return total;
+    }
+
+    return _verifyTotal;
+}
+
+uint64_t DownloadThread::bytesWritten()
+{
+    if (!_fanOut.isEmpty())
+    {
+        uint64_t written = _bytesWritten;
+        for (auto device : std::as_const(_fanOut))
+        {
+            if (device->isActive())
+                written = qMin(written, device->bytesWritten());
+        }
+        return written;
+    }
+    else if (_writebackWindow && isImage())
+        return _bytesSynced;
+    else if (_sectorsStart != -1)
+        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512 + _bytesSkipped, (uint64_t) _bytesWritten);
+    else
+        return _bytesWritten;
+}
+
+void DownloadThread::_onDownloadSuccess()
+{
+    _writeComplete();
+}
+
+void DownloadThread::_onDownloadError(const QString &msg)
+{
+    _cancelled = true;
+    for (auto device : std::as_const(_fanOut))
+        device->cancelDownload();
+    emit error(msg);
+}
+
+void DownloadThread::_onWriteError()
 {
 #ifdef Q_OS_WIN
     if (_file.errorCode() == ERROR_ACCESS_DENIED)
@@ -677,8 +1734,32 @@ void DownloadThread::_onWriteError()
         _onDownloadError(tr("Error writing file to disk"));
 }
 
+bool DownloadThread::_drainWrites()
+{
+#ifdef Q_OS_LINUX
+    if (_uring && !_uring->drain())
+    {
+        qDebug() << "Error completing queued writes:" << strerror(_uring->error());
+        return false;
+    }
+#endif
+    return true;
+}
+
 void DownloadThread::_closeFiles()
 {
+#ifdef Q_OS_LINUX
+    if (_uring)
+    {
+        delete _uring;
+        _uring = nullptr;
+    }
+    if (_trailingVerifier)
+    {
+        delete _trailingVerifier;
+        _trailingVerifier = nullptr;
+    }
+#endif
     _file.close();
 #ifdef Q_OS_WIN
     _volumeFile.close();
@@ -689,7 +1770,34 @@ void DownloadThread::_closeFiles()
 
 void DownloadThread::_writeComplete()
 {
-    QByteArray computedHash = _writehash.result().toHex();
+    if (!_drainWrites())
+    {
+        DownloadThread::_onDownloadError(tr("Error writing to storage"));
+        _closeFiles();
+        return;
+    }
+
+    if (_bmap.isValid() && (quint64) _file.pos() != _bmap.imageSize())
+    {
+        qDebug() << "Image size" << _file.pos() << "does not match block map image size" << _bmap.imageSize();
+        DownloadThread::_onDownloadError(tr("Block map does not match image"));
+        _closeFiles();
+        return;
+    }
+
+    _hashStage->waitAll();
+    if (_deltaWrite)
+    {
+        qDebug() << "Delta mode:" << _deltaSame << "bytes were on the device already and not written";
+    }
+
+    qDebug() << "Hash stage busy:" << _hashStage->busyTime() << "ms idle:" << _hashStage->idleTime()
+             << "ms writer stalled on it:" << _hashStage->stalledTime() << "ms. Write stage busy:" << _writeBusyTime/1000000
+             << "ms idle:" << qMax((qint64) 0, _timer.elapsed()-_writeBusyTime/1000000) << "ms";
+
+    if (_hashWrites)
+        _writeDigest = _writehash.result();
+    QByteArray computedHash = _writeDigest.toHex();
     qDebug() << "Hash of uncompressed image:" << computedHash;
     if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
     {
@@ -703,9 +1811,37 @@ void DownloadThread::_writeComplete()
     if (_cacheEnabled && _expectedHash == computedHash)
     {
         _cachefile.close();
+        if (_cacheTranscoder && _cacheTranscoder->finish())
+        {
+            /* Keep the transcoded image only. Chunks that have to be written again are replayed from it */
+            qDebug() << "Replacing cache file with" << _cacheTranscodeFileName;
+            _cachefile.remove();
+            _cachefile.setFileName(_cacheTranscodeFileName);
+        }
+        if (_bmapGenerator)
+        {
+            QFile bmapFile(_cacheBmapFileName);
+            QByteArray xml = _bmapGenerator->toXml();
+
+            if (!bmapFile.open(QIODevice::WriteOnly) || bmapFile.write(xml) != xml.size())
+            {
+                qDebug() << "Error writing block map of cached image";
+                bmapFile.remove();
+            }
+            else
+            {
+                qDebug() << "Saved block map of cached image as" << _cacheBmapFileName;
+            }
+        }
         emit cacheFileUpdated(computedHash);
     }
 
+    if (!_fanOut.isEmpty())
+    {
+        _finishFanOut();
+        return;
+    }
+
     if (!_file.flush())
     {
         DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
@@ -720,6 +1856,7 @@ void DownloadThread::_writeComplete()
         return;
     }
 #endif
+    _bytesSynced = _bytesWritten.load();
 
     qDebug() << "Write done in" << _timer.elapsed() / 1000 << "seconds";
 
@@ -732,6 +1869,12 @@ void DownloadThread::_writeComplete()
 
     emit finalizing();
 
+    if (_directIO)
+    {
+        /* Image customization and the first block use regular unaligned writes */
+        _directIO = !_setDirectIO(false);
+    }
+
     if (!_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty())
     {
         if (!_customizeImage())
@@ -772,9 +1915,16 @@ void DownloadThread::_writeComplete()
         return;
     }
 #endif
+    _bytesSynced = _bytesWritten.load();
 
     _closeFiles();
 
+    if (_journal)
+    {
+        /* Nothing left to resume */
+        _journal->remove();
+    }
+
 #ifdef Q_OS_DARWIN
     QThread::sleep(1);
     _filename.replace("/dev/rdisk", "/dev/disk");
@@ -805,24 +1955,76 @@ bool DownloadThread::_verify()
 
 #ifdef Q_OS_LINUX
     /* Make sure we are reading from the drive and not from cache */
-    //fcntl(_file.handle(), F_SETFL, O_DIRECT | fcntl(_file.handle(), F_GETFL));
-    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+    if (!_directIO)
+        posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
 #endif
 
+    if (_bmap.isValid())
+    {
+        bool ok = _verifyBmap(verifyBuf);
+        qFreeAligned(verifyBuf);
+        qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
+        return ok;
+    }
+
+#ifdef Q_OS_LINUX
+    if (_trailingVerifier)
+    {
+        /* First block and everything up to the last writeback window were already read back, only the tail is left */
+        quint64 verified = _trailingVerifier->stop();
+        int err = _trailingVerifier->error();
+        delete _trailingVerifier;
+        _trailingVerifier = nullptr;
+
+        if (err)
+        {
+            qDebug() << "Error reading back data during write:" << strerror(err);
+            qFreeAligned(verifyBuf);
+            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                "SD card may be broken."));
+            return false;
+        }
+
+        qDebug() << "Read back" << verified << "of" << _verifyTotal << "bytes while writing";
+        _file.seek(verified);
+        _lastVerifyNow = verified;
+    }
+    else
+#endif
     if (!_firstBlock)
     {
         _file.seek(0);
     }
     else
     {
-        _verifyhash.addData(_firstBlock, _firstBlockSize);
+        _verifyData(_firstBlock, _firstBlockSize);
         _file.seek(_firstBlockSize);
         _lastVerifyNow += _firstBlockSize;
     }
 
+#ifdef Q_OS_LINUX
+    if (_directIO && _lastVerifyNow % _alignment)
+    {
+        qDebug() << "Verify offset not aligned to logical block size. Disabling O_DIRECT";
+        _directIO = !_setDirectIO(false);
+        posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+
     while (_verifyEnabled && _lastVerifyNow < _verifyTotal && !_cancelled)
     {
-        qint64 lenRead = _file.read(verifyBuf, qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-_lastVerifyNow) ));
+        qint64 len = qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-_lastVerifyNow) );
+        qint64 readLen = len;
+        if (_directIO)
+        {
+            /* Read whole logical blocks, and ignore what is past the end of the image */
+            readLen = ((len + _alignment - 1) / _alignment) * _alignment;
+        }
+        qint64 lenRead = _file.read(verifyBuf, readLen);
+        if (lenRead > len)
+        {
+            lenRead = len;
+        }
         if (lenRead == -1)
         {
             DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
@@ -830,29 +2032,246 @@ bool DownloadThread::_verify()
             return false;
         }
 
-        _verifyhash.addData(verifyBuf, lenRead);
+        _verifyData(verifyBuf, lenRead);
         _lastVerifyNow += lenRead;
     }
     qFreeAligned(verifyBuf);
 
-    qDebug() << "Verify hash:" << _verifyhash.result().toHex();
+    QList<quint64> failed = _writeChunks.mismatches(_verifyChunks);
+    bool matches;
+    if (_fastVerify)
+    {
+        matches = failed.isEmpty();
+        qDebug() << "Verify chunk digests match:" << matches;
+    }
+    else
+    {
+        QByteArray verifyDigest = _verifyhash.result();
+        matches = verifyDigest == _writeDigest;
+        qDebug() << "Verify hash:" << verifyDigest.toHex();
+    }
     qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
 
-    if (_verifyhash.result() == _writehash.result() || !_verifyEnabled || _cancelled)
+    if (matches || !_verifyEnabled || _cancelled)
     {
         return true;
     }
-    else
+
+    qDebug() << "Verify hash does not match. Chunks of" << _writeChunks.chunkSize() << "bytes that differ start at offsets:" << failed;
+
+    if (!failed.isEmpty() && _repairChunks(failed))
+    {
+        return true;
+    }
+
+    if (!_cancelled)
     {
+        QStringList offsets;
+        for (quint64 offset : failed)
+            offsets.append(QString::number(offset));
+        qDebug() << "Chunks that still differ start at offsets:" << offsets.join(", ");
+
         DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
     }
 
     return false;
 }
 
+/* Runs on the thread reading back data, which is the trailing verifier until it is stopped */
+void DownloadThread::_verifyData(const char *buf, size_t len)
+{
+    /* The XXH64 chunk digests are enough to tell if what was read back is what
+       was written. SHA-256 is only needed here if we are asked for it */
+    if (!_fastVerify)
+        _verifyhash.addData(buf, len);
+    _verifyChunks.addData(buf, len);
+}
+
+/* Write the chunks starting at offsets again, and read them back, until they match or we run out of retries.
+   Leaves the chunks that still differ in offsets */
+bool DownloadThread::_repairChunks(QList<quint64> &offsets)
+{
+    for (unsigned int attempt = 1; attempt <= _repairRetries && !offsets.isEmpty() && !_cancelled; attempt++)
+    {
+        qDebug() << "Rewriting" << offsets.size() << "chunk(s), attempt" << attempt << "of" << _repairRetries;
+
+        if (!_rewriteChunks(offsets) || !_drainWrites() || !_file.flush())
+            return false;
+#ifndef Q_OS_WIN
+        if (::fsync(_file.handle()) != 0)
+            return false;
+#endif
+        offsets = _recheckChunks(offsets);
+    }
+
+    if (offsets.isEmpty())
+    {
+        qDebug() << "All chunks that differed match after rewriting them";
+        return true;
+    }
+
+    return false;
+}
+
+/* Read back the chunks starting at offsets, and return the ones that do not match what was written */
+QList<quint64> DownloadThread::_recheckChunks(const QList<quint64> &offsets)
+{
+    size_t chunkSize = _writeChunks.chunkSize();
+    QList<quint64> writeDigests = _writeChunks.digests(), failed;
+    char *buf = (char *) qMallocAligned(chunkSize, qMax(_alignment, (size_t) 4096));
+
+    for (quint64 offset : offsets)
+    {
+        qint64 len = qMin((quint64) chunkSize, _verifyTotal-offset);
+        qint64 readLen = len;
+        if (_directIO)
+            readLen = ((len + _alignment - 1) / _alignment) * _alignment;
+
+#ifdef Q_OS_LINUX
+        if (!_directIO)
+            posix_fadvise(_file.handle(), offset, len, POSIX_FADV_DONTNEED);
+#endif
+        if (!_file.seek(offset) || _file.read(buf, readLen) < len)
+        {
+            qDebug() << "Error reading back chunk at offset" << offset;
+            failed.append(offset);
+            continue;
+        }
+
+        /* The first block is only written at the very end, compare what is in memory instead */
+        if (_firstBlock && offset < _firstBlockSize)
+            ::memcpy(buf, _firstBlock+offset, qMin((quint64) len, _firstBlockSize-offset));
+
+        if (ChunkDigests::digest(buf, len) != writeDigests.value(offset/chunkSize))
+            failed.append(offset);
+    }
+    qFreeAligned(buf);
+
+    return failed;
+}
+
+/* Write a chunk that failed verification again. Leaves the first block alone, it is written at the end */
+bool DownloadThread::_rewriteChunk(const char *buf, size_t len, quint64 offset)
+{
+    if (_firstBlock && offset < _firstBlockSize)
+    {
+        size_t skip = qMin((quint64) len, _firstBlockSize-offset);
+        buf += skip;
+        len -= skip;
+        offset += skip;
+    }
+
+    return !len || _writeRange(buf, len, offset);
+}
+
+/* Needs a source that can be read a second time. Reimplemented by subclasses that have one */
+bool DownloadThread::_rewriteChunks(const QList<quint64> &)
+{
+    qDebug() << "Image data cannot be read again. Not able to rewrite chunks";
+    return false;
+}
+
+/* Read back only the ranges listed in the block map, and compare them with its checksums */
+bool DownloadThread::_verifyBmap(char *verifyBuf)
+{
+    _verifyTotal = _bmap.mappedSize();
+
+    for (const auto &r : _bmap.ranges())
+    {
+        AcceleratedCryptographicHash hash(QCryptographicHash::Sha256);
+        quint64 offset = r.offset, end = r.offset+r.length;
+
+        if (_firstBlock && offset < _firstBlockSize)
+        {
+            /* First block has not been written yet, use the copy in memory */
+            quint64 fromMemory = qMin(end, (quint64) _firstBlockSize) - offset;
+            hash.addData(_firstBlock+offset, fromMemory);
+            offset += fromMemory;
+            _lastVerifyNow += fromMemory;
+        }
+#ifdef Q_OS_LINUX
+        if (_directIO && offset % _alignment)
+        {
+            qDebug() << "Verify offset not aligned to logical block size. Disabling O_DIRECT";
+            _directIO = !_setDirectIO(false);
+            posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+        }
+#endif
+        if (offset < end && !_file.seek(offset))
+        {
+            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                "SD card may be broken."));
+            return false;
+        }
+
+        while (offset < end)
+        {
+            if (!_verifyEnabled || _cancelled)
+                return true;
+
+            qint64 len = qMin((quint64) IMAGEWRITER_VERIFY_BLOCKSIZE, end-offset);
+            qint64 readLen = len;
+            if (_directIO)
+            {
+                readLen = ((len + _alignment - 1) / _alignment) * _alignment;
+            }
+            qint64 lenRead = _file.read(verifyBuf, readLen);
+            if (lenRead > len)
+            {
+                lenRead = len;
+            }
+            if (lenRead <= 0)
+            {
+                DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                    "SD card may be broken."));
+                return false;
+            }
+
+            hash.addData(verifyBuf, lenRead);
+            offset += lenRead;
+            _lastVerifyNow += lenRead;
+        }
+
+        if (hash.result().toHex() != r.sha256)
+        {
+            qDebug() << "Checksum mismatch in block map range starting at offset" << r.offset;
+            DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DownloadThread::addFanOutDevice(FanOutDeviceThread *device)
+{
+    if (!_scheduler)
+    {
+        QSettings settings;
+        unsigned int writesPerPort = settings.value("writes_per_port", IMAGEWRITER_WRITES_PER_PORT).toUInt();
+        if (writesPerPort)
+            _scheduler = new WriteScheduler(writesPerPort);
+    }
+    if (_scheduler)
+        device->setScheduler(_scheduler);
+    device->setChangedCallback([this]{
+        _onFanOutChanged();
+    });
+
+    device->setParent(this);
+    _fanOut.append(device);
+}
+
+QMap<QString, double> DownloadThread::portThroughput()
+{
+    return _scheduler ? _scheduler->throughput() : QMap<QString, double>();
+}
+
 void DownloadThread::setVerifyEnabled(bool verify)
 {
     _verifyEnabled = verify;
+    for (auto device : std::as_const(_fanOut))
+        device->setVerifyEnabled(verify);
 }
 
 bool DownloadThread::isImage()
@@ -16,9 +16,16 @@
 #include <QElapsedTimer>
 #include <fstream>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <time.h>
 #include <curl/curl.h>
 #include "acceleratedcryptographichash.h"
+#include "bmapfile.h"
+#include "hashstage.h"
+#include "chunkdigests.h"
+#include "writejournal.h"
+#include "cachetranscoder.h"
 
 #ifdef Q_OS_WIN
 #include "windows/winfile.h"
@@ -26,6 +33,12 @@
 #ifdef Q_OS_DARWIN
 #include "mac/macfile.h"
 #endif
+#ifdef Q_OS_LINUX
+class IoUringWriter;
+class TrailingVerifier;
+#endif
+class FanOutDeviceThread;
+class WriteScheduler;
 
 
 class DownloadThread : public QThread
@@ -108,6 +121,50 @@ public:
      */
     void setCacheFile(const QString &filename, qint64 filesize = 0);
 
+    /*
+     * Locations to look for a block map of the image, tried in order.
+     * If one is found, only the ranges it lists are written and verified.
+     * guessedUrls are tried after urls, with a short timeout, as they may well not exist.
+     */
+    void setBmapUrls(const QList<QByteArray> &urls, const QList<QByteArray> &guessedUrls = QList<QByteArray>());
+
+    /*
+     * Other locations of the same image, in order of preference.
+     * The fastest one to answer is downloaded from, and if it stalls or fails
+     * the download continues from the next one.
+     */
+    void setMirrorUrls(const QList<QByteArray> &urls);
+
+    /*
+     * Generate a block map of the image while writing it, and save it as filename
+     * when the cache file is complete. Requires setCacheFile() and an expected hash.
+     */
+    void setCacheBmapFile(const QString &filename);
+
+    /*
+     * Also store the extracted image as filename in the given format while writing it.
+     * When complete, it replaces the cache file. Requires setCacheFile() and an expected hash.
+     */
+    void setCacheTranscodeFile(const QString &filename, CacheTranscoder::Format format);
+
+    /*
+     * Keep a journal of the chunks written as filename, so an interrupted
+     * write of the same image to the same device can continue where it stopped
+     */
+    void setJournalFile(const QString &filename);
+
+    /*
+     * Write the image to device as well. Once a device is added, this thread
+     * only downloads and decompresses, and does not write to a device itself.
+     * Takes ownership of device, which is started when the download starts
+     */
+    void addFanOutDevice(FanOutDeviceThread *device);
+
+    /*
+     * MB/s written to the devices behind each USB hub, when writing to several devices
+     */
+    QMap<QString, double> portThroughput();
+
     /*
      * Set input buffer size
      */
@@ -146,11 +203,38 @@ protected:
     void _hashData(const char *buf, size_t len);
     void _writeComplete();
     bool _verify();
+    bool _verifyBmap(char *verifyBuf);
+    void _verifyData(const char *buf, size_t len);
+    bool _repairChunks(QList<quint64> &offsets);
+    QList<quint64> _recheckChunks(const QList<quint64> &offsets);
+    bool _rewriteChunk(const char *buf, size_t len, quint64 offset);
+    virtual bool _rewriteChunks(const QList<quint64> &offsets);
     int _authopen(const QByteArray &filename);
     bool _openAndPrepareDevice();
     void _writeCache(const char *buf, size_t len);
     qint64 _sectorsWritten();
     void _closeFiles();
+    bool _drainWrites();
+    bool _setDirectIO(bool enable);
+    void _writeback(quint64 offset);
+    void _checkJournal();
+    void _updateJournal();
+    void _startTrailingVerify();
+    bool _writeRange(const char *buf, size_t len, qint64 pos);
+    bool _writeZeroes(size_t len, qint64 pos);
+    bool _writeBlocks(const char *buf, size_t len, qint64 pos);
+    bool _writeDelta(const char *buf, size_t len, qint64 pos);
+    size_t _writeFanOut(const char *buf, size_t len);
+    void _finishFanOut();
+    void _onFanOutChanged();
+    void _loadBmap();
+    QByteArray _downloadToMemory(const QByteArray &url, size_t maxSize, long timeout);
+    void _setupRangeConnection(CURL *c);
+    QByteArray _probeRanges(curl_off_t &size);
+    CURLcode _performSegmented(const QByteArray &url, curl_off_t size, char *errorBuf, bool &segmented);
+    void _selectMirror();
+    bool _nextMirror();
+    static void _detectSystemProxy(const QByteArray &url);
     QByteArray _fileGetContentsTrimmed(const QString &filename);
     bool _customizeImage();
 
@@ -164,10 +248,11 @@ protected:
     static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
     static int _curl_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
     static size_t _curl_header_callback( void *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t _curl_memory_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
 
     CURL *_c;
     curl_off_t _startOffset;
-    std::atomic<std::uint64_t> _lastDlTotal, _lastDlNow, _verifyTotal, _lastVerifyNow, _bytesWritten;
+    std::atomic<std::uint64_t> _lastDlTotal, _lastDlNow, _verifyTotal, _lastVerifyNow, _bytesWritten, _bytesSynced, _bytesSkipped;
     std::uint64_t _lastFailureOffset;
     qint64 _sectorsStart;
     QByteArray _url, _useragent, _buf, _filename, _lastError, _expectedHash, _config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _initFormat;
@@ -175,10 +260,44 @@ protected:
     size_t _firstBlockSize;
     static QByteArray _proxy;
     static int _curlCount;
-    bool _cancelled, _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled;
+    bool _cancelled, _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled, _directIO, _skipZeroBlocks, _trailingVerify, _resumeEnabled, _deltaWrite, _fastVerify, _acceptRanges;
     time_t _lastModified, _serverTime, _lastFailureTime;
     QElapsedTimer _timer;
     int _inputBufferSize;
+    unsigned int _ioQueueDepth, _repairRetries, _downloadConnections;
+    size_t _alignment;
+    quint64 _writebackWindow, _writebackSubmitted, _writebackWaited;
+    enum { ZeroBlocksWrite, ZeroBlocksZeroOut } _zeroBlocks;
+    QList<QByteArray> _bmapUrls, _guessedBmapUrls;
+    /* _url and its mirrors. Fastest first once probed */
+    QList<QByteArray> _mirrors;
+    int _mirrorIndex;
+    BmapFile _bmap;
+    int _bmapRange;
+    QString _cacheBmapFileName;
+    BmapGenerator *_bmapGenerator;
+    QString _cacheTranscodeFileName;
+    CacheTranscoder *_cacheTranscoder;
+    WriteJournal *_journal;
+    /* Chunks in this range were found on the device from a previous write, and are not written again */
+    quint64 _resumeFrom, _resumeTo;
+    /* Delta mode: what is on the device already, and how much of it matched the image */
+    char *_deltaBuf;
+    size_t _deltaBufSize;
+    quint64 _deltaSame;
+    HashStage *_hashStage;
+    /* Set if callers of _writeFile() wait for _hashStage to release their buffers themselves */
+    bool _asyncHash;
+    /* Cleared if the digests of what is written are calculated by another thread, and handed to us */
+    bool _hashWrites;
+    std::atomic<qint64> _writeBusyTime;
+    /* Devices the image is written to by threads of their own, if any */
+    QList<FanOutDeviceThread *> _fanOut;
+    /* Counts changes of the fan-out devices that may let a full device take data again */
+    std::mutex _fanOutMutex;
+    std::condition_variable _fanOutChanged;
+    quint64 _fanOutChanges;
+    WriteScheduler *_scheduler;
 
 #ifdef Q_OS_WIN
     WinFile _file, _volumeFile;
@@ -187,10 +306,18 @@ protected:
     MacFile _file;
 #else
     QFile _file;
+#endif
+#ifdef Q_OS_LINUX
+    IoUringWriter *_uring;
+    TrailingVerifier *_trailingVerifier;
 #endif
     QFile _cachefile;
 
     AcceleratedCryptographicHash _writehash, _verifyhash;
+    /* Digest of the image as written, taken once when writing completes */
+    QByteArray _writeDigest;
+    /* Per chunk digests of the same data, to find out where verify failed */
+    ChunkDigests _writeChunks, _verifyChunks;
 };
 
 #endif // DOWNLOADTHREAD_H
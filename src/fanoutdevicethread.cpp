@@ -0,0 +1,185 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "fanoutdevicethread.h"
+#include "config.h"
+#include <QSettings>
+#include <QDebug>
+
+FanOutDeviceThread::FanOutDeviceThread(const QByteArray &device, const QByteArray &expectedHash, QObject *parent)
+    : DownloadThread("", device, expectedHash, parent), _queuedBytes(0), _ready(false), _finished(false), _succeeded(false),
+      _scheduler(nullptr)
+{
+    /* The thread pushing the data calculates its digests once for all devices */
+    _hashWrites = false;
+
+    QSettings settings;
+    _maxQueuedBytes = settings.value("fanout_buffer", IMAGEWRITER_FANOUT_BUFFER).toULongLong()*1024*1024;
+    _stallTimeout = settings.value("fanout_stall_timeout", IMAGEWRITER_FANOUT_STALL_TIMEOUT).toUInt();
+}
+
+FanOutDeviceThread::~FanOutDeviceThread()
+{
+    cancelDownload();
+    wait();
+}
+
+void FanOutDeviceThread::cancelDownload()
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    DownloadThread::cancelDownload();
+    lock.unlock();
+    _queueChanged.notify_all();
+
+    if (_scheduler)
+        _scheduler->wake();
+    _notifyChanged();
+}
+
+FanOutDeviceThread::PushResult FanOutDeviceThread::push(const QByteArray &data)
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+
+    if (_cancelled)
+        return Dropped;
+
+    /* The time it takes to unmount and discard the device does not count as stalling */
+    if (!_ready)
+        return Full;
+
+    if (_queuedBytes >= _maxQueuedBytes)
+    {
+        if (!_fullTimer.isValid())
+            _fullTimer.start();
+        if (!_stallTimeout || _fullTimer.elapsed() < _stallTimeout*1000LL)
+            return Full;
+
+        lock.unlock();
+        qDebug() << "Device" << _filename << "did not accept data for" << _stallTimeout << "seconds. Dropping it";
+        DownloadThread::_onDownloadError(tr("Storage device is too slow to keep up with the others. Stopped writing to it."));
+        cancelDownload();
+        return Dropped;
+    }
+
+    _fullTimer.invalidate();
+    _queue.push_back(data);
+    _queuedBytes += data.size();
+    lock.unlock();
+    _queueChanged.notify_all();
+
+    return Queued;
+}
+
+void FanOutDeviceThread::finish(const QByteArray &digest, const QList<quint64> &chunkDigests)
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _writeDigest = digest;
+    _writeChunks.setDigests(chunkDigests);
+    _finished = true;
+    lock.unlock();
+    _queueChanged.notify_all();
+}
+
+bool FanOutDeviceThread::isActive()
+{
+    std::lock_guard<std::mutex> lock(_queueMutex);
+    return !_cancelled;
+}
+
+bool FanOutDeviceThread::succeeded()
+{
+    std::lock_guard<std::mutex> lock(_queueMutex);
+    return _succeeded;
+}
+
+QByteArray FanOutDeviceThread::device() const
+{
+    return _filename;
+}
+
+void FanOutDeviceThread::setScheduler(WriteScheduler *scheduler)
+{
+    _scheduler = scheduler;
+    _scheduler->addDevice(_filename);
+}
+
+void FanOutDeviceThread::setChangedCallback(const std::function<void()> &callback)
+{
+    _changed = callback;
+}
+
+void FanOutDeviceThread::_notifyChanged()
+{
+    if (_changed)
+        _changed();
+}
+
+void FanOutDeviceThread::run()
+{
+    if (!_openAndPrepareDevice())
+    {
+        /* Error has been reported already */
+        cancelDownload();
+        return;
+    }
+    _loadBmap();
+
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _ready = true;
+    lock.unlock();
+    _queueChanged.notify_all();
+    _notifyChanged();
+    _timer.start();
+
+    while (true)
+    {
+        lock.lock();
+        _queueChanged.wait(lock, [this]{
+            return _cancelled || _finished || !_queue.empty();
+        });
+        if (_cancelled)
+        {
+            lock.unlock();
+            break;
+        }
+        if (_queue.empty())
+        {
+            /* Finished, and everything is written */
+            lock.unlock();
+            _writeComplete();
+            break;
+        }
+
+        QByteArray data = _queue.front();
+        _queue.pop_front();
+        _queuedBytes -= data.size();
+        lock.unlock();
+        _queueChanged.notify_all();
+        _notifyChanged();
+
+        if (_scheduler && !_scheduler->acquire(_filename, _bytesWritten, _cancelled))
+            break;
+        size_t written = _writeFile(data.constData(), data.size());
+        if (_scheduler)
+            _scheduler->release(_filename, written);
+
+        if (written != (size_t) data.size())
+        {
+            _onWriteError();
+            break;
+        }
+    }
+
+    lock.lock();
+    /* _writeComplete() reports errors through _onDownloadError(), which cancels */
+    _succeeded = !_cancelled && _finished;
+    _queue.clear();
+    lock.unlock();
+    _queueChanged.notify_all();
+    _notifyChanged();
+
+    if (!_succeeded)
+        _closeFiles();
+}
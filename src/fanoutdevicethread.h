@@ -0,0 +1,100 @@
+#ifndef FANOUTDEVICETHREAD_H
+#define FANOUTDEVICETHREAD_H
+
+/*
+ * Writes an image that is decompressed by another thread to one of several devices
+ *
+ * The thread that downloads and decompresses the image hands every buffer to
+ * push() of each device, and calculates the digests of the image once for all of
+ * them. Each device writes, verifies and customizes on its own thread, so a device
+ * that fails does not affect the others. A device that cannot keep up is dropped,
+ * instead of holding everyone back.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include "writescheduler.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class FanOutDeviceThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    /*
+     * Constructor
+     *
+     * - device: device to write to
+     * - expectedHash: SHA-256 of the uncompressed image
+     */
+    explicit FanOutDeviceThread(const QByteArray &device, const QByteArray &expectedHash = "", QObject *parent = nullptr);
+    virtual ~FanOutDeviceThread();
+
+    virtual void cancelDownload();
+
+    enum PushResult {
+        Queued,
+        Full,
+        Dropped
+    };
+
+    /*
+     * Queue the next part of the image. Does not block.
+     * Returns Full while the device is being prepared, or its queue is full. Try again later.
+     * Returns Dropped if this device failed, or was full for longer than the stall timeout,
+     * and no longer takes data
+     */
+    PushResult push(const QByteArray &data);
+
+    /*
+     * No more data follows. Completes the write after the queue is written
+     *
+     * - digest: SHA-256 of all data pushed
+     * - chunkDigests: digests of the chunks of the same data, as calculated by ChunkDigests
+     */
+    void finish(const QByteArray &digest, const QList<quint64> &chunkDigests);
+
+    /*
+     * Returns false once writing to this device failed or was cancelled
+     */
+    bool isActive();
+
+    /*
+     * Returns true if the image was written and verified. Only valid after the thread finished
+     */
+    bool succeeded();
+
+    QByteArray device() const;
+
+    /*
+     * Only write when scheduler allows it. Must be set before the thread is started
+     */
+    void setScheduler(WriteScheduler *scheduler);
+
+    /*
+     * Called from the device thread when push() may accept data again, or the device stopped
+     */
+    void setChangedCallback(const std::function<void()> &callback);
+
+protected:
+    virtual void run();
+
+    std::mutex _queueMutex;
+    std::condition_variable _queueChanged;
+    std::deque<QByteArray> _queue;
+    size_t _queuedBytes, _maxQueuedBytes;
+    unsigned int _stallTimeout;
+    bool _ready, _finished, _succeeded;
+    WriteScheduler *_scheduler;
+    /* Time since the device was first found full, while it stays full */
+    QElapsedTimer _fullTimer;
+    std::function<void()> _changed;
+
+    void _notifyChanged();
+};
+
+#endif // FANOUTDEVICETHREAD_H
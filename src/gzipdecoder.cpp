@@ -0,0 +1,165 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "gzipdecoder.h"
+#include <string.h>
+#include <QtEndian>
+#include <QDebug>
+
+/* Header fields, see RFC 1952 */
+#define GZIP_HEADER_SIZE    10
+#define GZIP_TRAILER_SIZE   8
+#define GZIP_FLAG_EXTRA     0x04
+
+/* zlib: 15 bit window, expect a gzip header */
+#define GZIP_WINDOW_BITS    (MAX_WBITS+16)
+
+#ifdef HAVE_ZLIBNG
+#define gzipInflateInit(zs)        zng_inflateInit2(zs, GZIP_WINDOW_BITS)
+#define gzipInflate(zs, flush)     zng_inflate(zs, flush)
+#define gzipInflateReset(zs)       zng_inflateReset(zs)
+#define gzipInflateEnd(zs)         zng_inflateEnd(zs)
+#else
+#define gzipInflateInit(zs)        inflateInit2(zs, GZIP_WINDOW_BITS)
+#define gzipInflate(zs, flush)     inflate(zs, flush)
+#define gzipInflateReset(zs)       inflateReset(zs)
+#define gzipInflateEnd(zs)         inflateEnd(zs)
+#endif
+
+GzipDecoder::GzipDecoder(uint32_t threads, size_t maxFrameSize)
+    : ParallelFrameDecoder(threads, maxFrameSize), _memberEnd(false), _trailingGarbage(false)
+{
+    memset(&_zs, 0, sizeof(_zs));
+    if (gzipInflateInit(&_zs) != Z_OK)
+        _error = "Error initializing zlib";
+}
+
+GzipDecoder::~GzipDecoder()
+{
+    _waitForWorkers();
+    gzipInflateEnd(&_zs);
+}
+
+bool GzipDecoder::isGzip(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    return len >= GZIP_HEADER_SIZE && p[0] == 0x1f && p[1] == 0x8b && p[2] == Z_DEFLATED;
+}
+
+/* Only BGZF members tell their size. Anything else is decoded as a stream */
+ParallelFrameDecoder::FrameStatus GzipDecoder::_findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    if (len < GZIP_HEADER_SIZE+2)
+        return FrameIncomplete;
+    if (!isGzip(p, len) || !(p[3] & GZIP_FLAG_EXTRA))
+        return FrameStream;
+
+    size_t xlen = qFromLittleEndian<quint16>(p+GZIP_HEADER_SIZE);
+    if (len < GZIP_HEADER_SIZE+2+xlen)
+        return FrameIncomplete;
+
+    /* Look for the BC subfield holding the member size minus 1 */
+    const uint8_t *x = p+GZIP_HEADER_SIZE+2, *xend = x+xlen;
+    while (x+4 <= xend)
+    {
+        size_t slen = qFromLittleEndian<quint16>(x+2);
+        if (x[0] == 'B' && x[1] == 'C' && slen == 2 && x+6 <= xend)
+        {
+            frameLen = (size_t) qFromLittleEndian<quint16>(x+4) + 1;
+            if (frameLen < GZIP_HEADER_SIZE+2+xlen+GZIP_TRAILER_SIZE)
+                return FrameStream;
+            if (len < frameLen)
+                return FrameIncomplete;
+            frame = QByteArray(data, frameLen);
+            return FrameComplete;
+        }
+        x += 4+slen;
+    }
+
+    return FrameStream;
+}
+
+/* Worker thread */
+void GzipDecoder::_decodeFrame(Frame *f)
+{
+    const uint8_t *src = (const uint8_t *) f->compressed.constData();
+    size_t srcLen = f->compressed.size();
+    /* Uncompressed size modulo 2^32 is in the trailer. BGZF members are at most 64 KB */
+    size_t isize = qFromLittleEndian<quint32>(src+srcLen-4);
+
+    if (isize > _maxFrameSize)
+    {
+        f->serial = true;
+        return;
+    }
+
+    gzip_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (gzipInflateInit(&zs) != Z_OK)
+    {
+        f->error = "Error initializing zlib";
+        return;
+    }
+
+    f->output.resize(isize);
+    zs.next_in = (uint8_t *) src;
+    zs.avail_in = srcLen;
+    zs.next_out = (uint8_t *) f->output.data();
+    zs.avail_out = isize;
+
+    /* Member is complete, and zlib checks its CRC */
+    int r = gzipInflate(&zs, Z_FINISH);
+    if (r != Z_STREAM_END || zs.avail_in || zs.avail_out)
+        f->error = zs.msg ? zs.msg : "Corrupt gzip member";
+
+    gzipInflateEnd(&zs);
+}
+
+bool GzipDecoder::_decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd)
+{
+    if (_memberEnd && inLen)
+    {
+        /* Like gzip, ignore anything after the last member that is not another member */
+        if (_trailingGarbage || in[0] != 0x1f)
+        {
+            if (!_trailingGarbage)
+                qDebug() << "Ignoring trailing garbage after gzip data";
+            _trailingGarbage = true;
+            in += inLen;
+            inLen = 0;
+            atFrameEnd = true;
+            return true;
+        }
+
+        gzipInflateReset(&_zs);
+        _memberEnd = false;
+    }
+
+    _zs.next_in = (uint8_t *) in;
+    _zs.avail_in = inLen;
+    _zs.next_out = out;
+    _zs.avail_out = outLen;
+
+    int r = gzipInflate(&_zs, Z_NO_FLUSH);
+
+    in += inLen-_zs.avail_in;
+    inLen = _zs.avail_in;
+    out += outLen-_zs.avail_out;
+    outLen = _zs.avail_out;
+
+    if (r == Z_STREAM_END)
+        _memberEnd = true;
+    else if (r != Z_OK && r != Z_BUF_ERROR)
+    {
+        _error = _zs.msg ? _zs.msg : "Corrupt gzip data";
+        return false;
+    }
+    atFrameEnd = _memberEnd;
+
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef GZIPDECODER_H
+#define GZIPDECODER_H
+
+/*
+ * .gz decompression using zlib directly, instead of through libarchive
+ *
+ * Inflates straight into the write buffers. Images in the BGZF format
+ * (bgzip), which is a series of gzip members that store their compressed
+ * size in the header, are decoded in parallel. Other gzip images are
+ * inflated as a stream, with zlib-ng if it is available, which inflates
+ * considerably faster than zlib.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "parallelframedecoder.h"
+#ifdef HAVE_ZLIBNG
+/* Native API, does not clash with the bundled zlib used by libarchive and curl */
+#include <zlib-ng.h>
+typedef zng_stream gzip_stream;
+#else
+#include <zlib.h>
+typedef z_stream gzip_stream;
+#endif
+
+class GzipDecoder : public ParallelFrameDecoder
+{
+public:
+    GzipDecoder(uint32_t threads, size_t maxFrameSize);
+    virtual ~GzipDecoder();
+
+    /*
+     * Returns true if data starts with a deflate compressed gzip member
+     */
+    static bool isGzip(const void *data, size_t len);
+
+protected:
+    gzip_stream _zs;
+    bool _memberEnd, _trailingGarbage;
+
+    virtual FrameStatus _findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame);
+    virtual void _decodeFrame(Frame *f);
+    virtual bool _decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd);
+};
+
+#endif // GZIPDECODER_H
@@ -0,0 +1,133 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "hashstage.h"
+
+using namespace std::chrono;
+
+HashStage::HashStage(const std::function<void(const char *, size_t)> &handler, size_t maxQueued)
+    : _handler(handler), _maxQueued(maxQueued ? maxQueued : 1), _submitted(0), _processed(0), _stop(false),
+      _busy(0), _idle(0), _stalled(0)
+{
+    _thread = std::thread(&HashStage::_run, this);
+}
+
+HashStage::~HashStage()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stop = true;
+    lock.unlock();
+    _workAvailable.notify_one();
+    _thread.join();
+}
+
+uint64_t HashStage::submit(const char *buf, size_t len)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_queue.size() >= _maxQueued)
+    {
+        auto t = steady_clock::now();
+        _workDone.wait(lock, [this]{
+            return _queue.size() < _maxQueued;
+        });
+        _stalled += steady_clock::now()-t;
+    }
+
+    _queue.push_back({buf, len});
+    uint64_t seq = ++_submitted;
+    lock.unlock();
+    _workAvailable.notify_one();
+
+    return seq;
+}
+
+void HashStage::waitFor(uint64_t seq)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_processed < seq)
+    {
+        auto t = steady_clock::now();
+        _workDone.wait(lock, [this, seq]{
+            return _processed >= seq;
+        });
+        _stalled += steady_clock::now()-t;
+    }
+}
+
+void HashStage::waitForBuffer(const char *buf)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t seq = 0;
+
+    /* Queue is ordered, so waiting for the last occurrence covers all of them */
+    for (size_t i = 0; i < _queue.size(); i++)
+    {
+        if (_queue[i].buf == buf)
+            seq = _processed+i+1;
+    }
+    lock.unlock();
+
+    if (seq)
+        waitFor(seq);
+}
+
+void HashStage::waitAll()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t seq = _submitted;
+    lock.unlock();
+
+    waitFor(seq);
+}
+
+void HashStage::_run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true)
+    {
+        auto t = steady_clock::now();
+        _workAvailable.wait(lock, [this]{
+            return _stop || !_queue.empty();
+        });
+        _idle += steady_clock::now()-t;
+
+        if (_queue.empty())
+            break;
+
+        /* Block stays in the queue while being processed, so it counts towards the limit */
+        Block b = _queue.front();
+        lock.unlock();
+        t = steady_clock::now();
+        _handler(b.buf, b.len);
+        auto busy = steady_clock::now()-t;
+        lock.lock();
+
+        _busy += busy;
+        _queue.pop_front();
+        _processed++;
+        _workDone.notify_all();
+    }
+}
+
+uint64_t HashStage::busyTime()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return duration_cast<milliseconds>(_busy).count();
+}
+
+uint64_t HashStage::idleTime()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return duration_cast<milliseconds>(_idle).count();
+}
+
+uint64_t HashStage::stalledTime()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return duration_cast<milliseconds>(_stalled).count();
+}
@@ -0,0 +1,86 @@
+#ifndef HASHSTAGE_H
+#define HASHSTAGE_H
+
+/*
+ * Persistent worker thread that hashes blocks in the order they are submitted
+ *
+ * Lets hashing of one block overlap with writing the next one,
+ * without dispatching a task to the global thread pool for every block.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdint.h>
+#include <stddef.h>
+
+class HashStage
+{
+public:
+    /*
+     * Constructor
+     *
+     * - handler: function called on the worker thread for every submitted block
+     * - maxQueued: number of blocks that can be pending before submit() blocks
+     */
+    HashStage(const std::function<void(const char *, size_t)> &handler, size_t maxQueued);
+    virtual ~HashStage();
+
+    /*
+     * Queue block for hashing. buf must stay valid until waitFor() the returned
+     * sequence number returns.
+     */
+    uint64_t submit(const char *buf, size_t len);
+
+    /*
+     * Wait until block with sequence number seq (and all before it) is processed
+     */
+    void waitFor(uint64_t seq);
+
+    /*
+     * Wait until no block starting at buf is pending anymore
+     */
+    void waitForBuffer(const char *buf);
+
+    /*
+     * Wait until all submitted blocks are processed
+     */
+    void waitAll();
+
+    /*
+     * Statistics in milliseconds
+     * - busy: worker thread hashing
+     * - idle: worker thread waiting for blocks
+     * - stalled: submitter waiting for the worker (queue full, or in waitFor())
+     */
+    uint64_t busyTime();
+    uint64_t idleTime();
+    uint64_t stalledTime();
+
+protected:
+    struct Block
+    {
+        const char *buf;
+        size_t len;
+    };
+
+    std::function<void(const char *, size_t)> _handler;
+    size_t _maxQueued;
+    std::deque<Block> _queue;
+    uint64_t _submitted, _processed;
+    bool _stop;
+    std::chrono::steady_clock::duration _busy, _idle, _stalled;
+    std::mutex _mutex;
+    std::condition_variable _workAvailable, _workDone;
+    std::thread _thread;
+
+    void _run();
+};
+
+#endif // HASHSTAGE_H
@@ -0,0 +1,283 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "imagecache.h"
+#include "config.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStorageInfo>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QDebug>
+#include <algorithm>
+
+#define IMAGECACHE_INDEX_FILE    "index.json"
+#define IMAGECACHE_INDEX_VERSION 1
+/* Files not in the index are only removed once they were not written to for this long,
+   as another instance of Imager may still be downloading them */
+#define IMAGECACHE_STALE_AGE     (24*3600)
+
+static const char *cacheFormats[] = {"compressed", "raw", "zstd"};
+
+static QString extensionOf(const QString &format)
+{
+    if (format == "raw")
+        return ".img";
+    if (format == "zstd")
+        return ".zst";
+    return ".cache";
+}
+
+ImageCache::ImageCache(const QString &dir)
+    : _dir(dir), _quota(0)
+{
+    _load();
+}
+
+ImageCache::~ImageCache()
+{
+}
+
+void ImageCache::setQuota(quint64 quota)
+{
+    _quota = quota;
+}
+
+bool ImageCache::contains(const QByteArray &sha256) const
+{
+    return !sha256.isEmpty() && _entries.contains(sha256);
+}
+
+QString ImageCache::fileName(const QByteArray &sha256, const QString &format) const
+{
+    QString f = format;
+    if (f.isEmpty())
+        f = _entries.contains(sha256) ? _entries.value(sha256).format : QString("compressed");
+
+    return _dir+QDir::separator()+QString::fromLatin1(sha256)+extensionOf(f);
+}
+
+QString ImageCache::bmapFileName(const QByteArray &sha256) const
+{
+    return _dir+QDir::separator()+QString::fromLatin1(sha256)+".bmap";
+}
+
+void ImageCache::touch(const QByteArray &sha256)
+{
+    if (!_entries.contains(sha256))
+        return;
+
+    _entries[sha256].lastUsed = QDateTime::currentSecsSinceEpoch();
+    _save();
+}
+
+bool ImageCache::reserve(quint64 size)
+{
+    if (!QDir().mkpath(_dir))
+    {
+        qDebug() << "Error creating cache folder" << _dir;
+        return false;
+    }
+
+    QStorageInfo si(_dir);
+    qint64 avail = si.bytesAvailable();
+    quint64 used = _usedSpace();
+    QList<QByteArray> lru = _leastRecentlyUsed();
+    int evict = 0;
+
+    qDebug() << "Available disk space for caching:" << avail/1024/1024/1024 << "GB. Cached images use"
+             << used/1024/1024 << "MB of" << (_quota ? QString::number(_quota/1024/1024)+" MB" : QString("unlimited"));
+
+    /* Work out how many images have to go first, so nothing is removed if it is not going to be enough */
+    auto fits = [&]() {
+        return (!_quota || used+size <= _quota) && avail-(qint64) size >= IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING;
+    };
+    while (!fits() && evict < lru.size())
+    {
+        quint64 entrySize = _entries.value(lru.at(evict)).size;
+        used -= entrySize;
+        avail += entrySize;
+        evict++;
+    }
+
+    if (!fits())
+    {
+        qDebug() << "Not enough room to cache image of" << size << "bytes";
+        return false;
+    }
+
+    for (int i = 0; i < evict; i++)
+    {
+        qDebug() << "Removing least recently used image from cache:" << lru.at(i);
+        remove(lru.at(i));
+    }
+
+    return true;
+}
+
+void ImageCache::add(const QByteArray &sha256, const QString &format)
+{
+    QFileInfo fi(fileName(sha256, format));
+    if (!fi.exists() || !fi.size())
+        return;
+
+    _removeFiles(sha256, format);
+    Entry e;
+    e.format = format;
+    e.size = fi.size();
+    e.lastUsed = QDateTime::currentSecsSinceEpoch();
+    _entries.insert(sha256, e);
+
+    /* Size may not have been known when room was reserved for it */
+    QList<QByteArray> lru = _leastRecentlyUsed();
+    for (int i = 0; _quota && _usedSpace() > _quota && i < lru.size(); i++)
+    {
+        if (lru.at(i) != sha256)
+        {
+            qDebug() << "Cache over quota. Removing least recently used image:" << lru.at(i);
+            _entries.remove(lru.at(i));
+            _removeFiles(lru.at(i));
+        }
+    }
+
+    _save();
+}
+
+bool ImageCache::import(const QByteArray &sha256, const QString &file)
+{
+    if (!QDir().mkpath(_dir))
+        return false;
+
+    QFile::remove(fileName(sha256, "compressed"));
+    if (!QFile::rename(file, fileName(sha256, "compressed")))
+    {
+        qDebug() << "Error moving" << file << "into cache folder";
+        return false;
+    }
+
+    add(sha256);
+    return contains(sha256);
+}
+
+void ImageCache::remove(const QByteArray &sha256)
+{
+    _entries.remove(sha256);
+    _removeFiles(sha256);
+    _save();
+}
+
+/* Remove the files of the image in all formats but keepFormat, and its block map if all go */
+void ImageCache::_removeFiles(const QByteArray &sha256, const QString &keepFormat)
+{
+    for (const char *format : cacheFormats)
+    {
+        if (keepFormat != format)
+            QFile::remove(fileName(sha256, format));
+    }
+    if (keepFormat.isEmpty())
+        QFile::remove(bmapFileName(sha256));
+}
+
+/* Read the index, and drop entries of which the file is gone or changed size.
+   Files that are not in the index were not completed, and are removed once stale */
+void ImageCache::_load()
+{
+    QFile f(_dir+QDir::separator()+IMAGECACHE_INDEX_FILE);
+    bool changed = false;
+
+    if (f.open(QIODevice::ReadOnly))
+    {
+        QJsonObject index = QJsonDocument::fromJson(f.readAll()).object();
+        const QJsonArray entries = index.value("entries").toArray();
+
+        for (const auto &value : entries)
+        {
+            QJsonObject o = value.toObject();
+            QByteArray sha256 = o.value("sha256").toString().toLatin1();
+            Entry e;
+            e.format = o.value("format").toString("compressed");
+            e.size = o.value("size").toVariant().toULongLong();
+            e.lastUsed = o.value("last_used").toVariant().toLongLong();
+
+            QFileInfo fi(fileName(sha256, e.format));
+            if (sha256.isEmpty() || !fi.exists() || (quint64) fi.size() != e.size)
+            {
+                qDebug() << "Dropping cache entry" << sha256 << "as its file is missing or changed";
+                changed = true;
+                continue;
+            }
+            _entries.insert(sha256, e);
+        }
+        f.close();
+    }
+
+    QDir d(_dir);
+    QDateTime staleBefore = QDateTime::currentDateTime().addSecs(-IMAGECACHE_STALE_AGE);
+    const QFileInfoList files = d.entryInfoList(QStringList() << "*.cache" << "*.img" << "*.zst" << "*.bmap", QDir::Files);
+    for (const QFileInfo &fi : files)
+    {
+        QString file = fi.fileName();
+        QByteArray sha256 = fi.completeBaseName().toLatin1();
+        if ((!_entries.contains(sha256) || (!file.endsWith(".bmap") && file != QFileInfo(fileName(sha256)).fileName()))
+                && fi.lastModified() < staleBefore)
+        {
+            qDebug() << "Removing incomplete cache file" << file;
+            d.remove(file);
+        }
+    }
+
+    if (changed)
+        _save();
+}
+
+void ImageCache::_save()
+{
+    QJsonArray entries;
+    for (auto i = _entries.cbegin(); i != _entries.cend(); ++i)
+    {
+        QJsonObject o;
+        o.insert("sha256", QString::fromLatin1(i.key()));
+        o.insert("format", i.value().format);
+        o.insert("size", (qint64) i.value().size);
+        o.insert("last_used", i.value().lastUsed);
+        entries.append(o);
+    }
+
+    QJsonObject index;
+    index.insert("version", IMAGECACHE_INDEX_VERSION);
+    index.insert("entries", entries);
+
+    if (!QDir().mkpath(_dir))
+        return;
+
+    QSaveFile f(_dir+QDir::separator()+IMAGECACHE_INDEX_FILE);
+    if (!f.open(QIODevice::WriteOnly) || f.write(QJsonDocument(index).toJson()) == -1 || !f.commit())
+    {
+        qDebug() << "Error writing cache index" << f.fileName();
+    }
+}
+
+QList<QByteArray> ImageCache::_leastRecentlyUsed() const
+{
+    QList<QByteArray> result = _entries.keys();
+    std::sort(result.begin(), result.end(), [this](const QByteArray &a, const QByteArray &b) {
+        return _entries.value(a).lastUsed < _entries.value(b).lastUsed;
+    });
+
+    return result;
+}
+
+quint64 ImageCache::_usedSpace() const
+{
+    quint64 used = 0;
+    for (auto i = _entries.cbegin(); i != _entries.cend(); ++i)
+        used += i.value().size;
+
+    return used;
+}
@@ -0,0 +1,103 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+/*
+ * Cache of downloaded images, keyed by the SHA-256 of the extracted image
+ *
+ * Each image is stored in the cache folder in one of these formats, with an
+ * optional block map <sha256>.bmap next to it:
+ * - compressed: as downloaded, <sha256>.cache
+ * - raw: extracted sparse image, <sha256>.img
+ * - zstd: recompressed as seekable zstd, <sha256>.zst
+ * An index file lists the complete entries, their format, sizes and when they
+ * were last used, so nothing has to be read to find out what is cached. The least recently used images are removed to stay under
+ * the quota, and to keep enough free disk space.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QMap>
+
+class ImageCache
+{
+public:
+    /*
+     * Constructor
+     *
+     * - dir: folder to store the images in. Created when the first image is added
+     */
+    explicit ImageCache(const QString &dir);
+    virtual ~ImageCache();
+
+    /*
+     * Maximum number of bytes all cached images may take up together. 0 for no limit
+     */
+    void setQuota(quint64 quota);
+
+    /*
+     * Returns true if the image with this hash is cached completely
+     */
+    bool contains(const QByteArray &sha256) const;
+
+    /*
+     * File the image with this hash is, or should be, stored as in format.
+     * Without format, the one of the cached image, or compressed if it is not cached
+     */
+    QString fileName(const QByteArray &sha256, const QString &format = QString()) const;
+
+    /*
+     * File the block map of the image with this hash is, or should be, stored as
+     */
+    QString bmapFileName(const QByteArray &sha256) const;
+
+    /*
+     * Mark the image as used now, so it is removed last
+     */
+    void touch(const QByteArray &sha256);
+
+    /*
+     * Make room for an image of size bytes, by removing the least recently used images.
+     * Returns false without removing anything, if there would not be enough room even
+     * after removing all of them
+     */
+    bool reserve(quint64 size);
+
+    /*
+     * The image with this hash was written to fileName() in format completely, and is added to the index.
+     * Files of the image in other formats are removed
+     */
+    void add(const QByteArray &sha256, const QString &format = "compressed");
+
+    /*
+     * Add an existing file as the image with this hash. The file is moved into the cache folder
+     */
+    bool import(const QByteArray &sha256, const QString &file);
+
+    /*
+     * Remove the image with this hash
+     */
+    void remove(const QByteArray &sha256);
+
+protected:
+    struct Entry
+    {
+        QString format;
+        quint64 size;
+        qint64 lastUsed;
+    };
+
+    QString _dir;
+    quint64 _quota;
+    QMap<QByteArray, Entry> _entries;
+
+    void _load();
+    void _save();
+    void _removeFiles(const QByteArray &sha256, const QString &keepFormat = QString());
+    QList<QByteArray> _leastRecentlyUsed() const;
+    quint64 _usedSpace() const;
+};
+
+#endif // IMAGECACHE_H
@@ -10,6 +10,8 @@
 #include "dependencies/sha256crypt/sha256crypt.h"
 #include "driveformatthread.h"
 #include "localfileextractthread.h"
+#include "fanoutdevicethread.h"
+#include "imagecache.h"
 #include "downloadstatstelemetry.h"
 #include "wlancredentials.h"
 #include <archive.h>
@@ -134,17 +136,27 @@ ImageWriter::ImageWriter(QObject *parent)
 
     _settings.beginGroup("caching");
     _cachingEnabled = !_embeddedMode && _settings.value("enabled", IMAGEWRITER_ENABLE_CACHE_DEFAULT).toBool();
-    _cachedFileHash = _settings.value("lastDownloadSHA256").toByteArray();
-    _cacheFileName = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastdownload.cache";
-    if (!_cachedFileHash.isEmpty())
+    _cache = new ImageCache(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"images");
+
+    /* Older versions only kept the last image downloaded. Move it into the cache */
+    QByteArray lastDownloadHash = _settings.value("lastDownloadSHA256").toByteArray();
+    if (!lastDownloadHash.isEmpty())
     {
-        QFileInfo f(_cacheFileName);
-        if (!f.exists() || !f.isReadable() || !f.size())
+        QString lastDownload = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastdownload.cache";
+        QString lastDownloadBmap = QFileInfo(lastDownload).absolutePath()+QDir::separator()+QString::fromLatin1(lastDownloadHash)+".bmap";
+        QFileInfo f(lastDownload);
+
+        if (f.exists() && f.isReadable() && f.size() && _cache->import(lastDownloadHash, lastDownload))
         {
-            _cachedFileHash.clear();
-            _settings.remove("lastDownloadSHA256");
-            _settings.sync();
+            QFile::rename(lastDownloadBmap, _cache->bmapFileName(lastDownloadHash));
+        }
+        else
+        {
+            QFile::remove(lastDownload);
         }
+        QFile::remove(lastDownloadBmap);
+        _settings.remove("lastDownloadSHA256");
+        _settings.sync();
     }
     _settings.endGroup();
 
@@ -186,6 +198,7 @@ ImageWriter::~ImageWriter()
         QCoreApplication::removeTranslator(_trans);
         delete _trans;
     }
+    delete _cache;
 }
 
 void ImageWriter::setEngine(QQmlApplicationEngine *engine)
@@ -194,9 +207,11 @@ void ImageWriter::setEngine(QQmlApplicationEngine *engine)
 }
 
 /* Set URL to download from */
-void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat)
+void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat, QUrl bmapUrl, QStringList mirrors)
 {
     _src = url;
+    _bmapUrl = bmapUrl;
+    _mirrors = mirrors;
     _downloadLen = downloadLen;
     _extrLen = extrLen;
     _expectedHash = expectedHash;
@@ -221,6 +236,26 @@ void ImageWriter::setDst(const QString &device, quint64 deviceSize)
 {
     _dst = device;
     _devLen = deviceSize;
+    _extraDsts.clear();
+}
+
+QVariantMap ImageWriter::portThroughput()
+{
+    QVariantMap result;
+    if (_thread)
+    {
+        const QMap<QString, double> throughput = _thread->portThroughput();
+        for (auto i = throughput.cbegin(); i != throughput.cend(); ++i)
+            result.insert(i.key(), i.value());
+    }
+    return result;
+}
+
+/* Add another device to write the same image to */
+void ImageWriter::addDst(const QString &device)
+{
+    if (device != _dst && !_extraDsts.contains(device))
+        _extraDsts.append(device);
 }
 
 /* Returns true if src and dst are set */
@@ -235,6 +270,12 @@ void ImageWriter::startWrite()
     if (!readyToWrite())
         return;
 
+    if (!_extraDsts.isEmpty() && (_src.toString() == "internal://format" || _multipleFilesInZip))
+    {
+        emit error(tr("Writing to several storage devices at once is only supported for disk images"));
+        return;
+    }
+
     if (_src.toString() == "internal://format")
     {
         DriveFormatThread *dft = new DriveFormatThread(_dst.toLatin1(), this);
@@ -269,19 +310,32 @@ void ImageWriter::startWrite()
         return;
     }
 
-    if (!_expectedHash.isEmpty() && _cachedFileHash == _expectedHash)
+    QString cachedFile = _cachedFile(_expectedHash);
+    if (!cachedFile.isEmpty())
     {
         // Use cached file
-        urlstr = QUrl::fromLocalFile(_cacheFileName).toString(_src.FullyEncoded).toLatin1();
+        urlstr = QUrl::fromLocalFile(cachedFile).toString(_src.FullyEncoded).toLatin1();
+        if (!_customCacheFile)
+            _cache->touch(_expectedHash);
     }
 
+    /* When writing to several devices, the thread only downloads and decompresses, and has no device of its own */
+    QByteArray threadDst = _extraDsts.isEmpty() ? _dst.toLatin1() : QByteArray();
+
     if (QUrl(urlstr).isLocalFile())
     {
-        _thread = new LocalFileExtractThread(urlstr, _dst.toLatin1(), _expectedHash, this);
+        _thread = new LocalFileExtractThread(urlstr, threadDst, _expectedHash, this);
     }
     else
     {
-        _thread = new DownloadExtractThread(urlstr, _dst.toLatin1(), _expectedHash, this);
+        _thread = new DownloadExtractThread(urlstr, threadDst, _expectedHash, this);
+        if (!_mirrors.isEmpty())
+        {
+            QList<QByteArray> mirrorUrls;
+            for (const QString &mirror : std::as_const(_mirrors))
+                mirrorUrls.append(QUrl(mirror).toString(QUrl::FullyEncoded).toLatin1());
+            _thread->setMirrorUrls(mirrorUrls);
+        }
         if (_repo.toString() == OSLIST_URL)
         {
             DownloadStatsTelemetry *tele = new DownloadStatsTelemetry(urlstr, _parentCategory.toLatin1(), _osName.toLatin1(), _embeddedMode, _currentLangcode, this);
@@ -298,26 +352,67 @@ void ImageWriter::startWrite()
     _thread->setUserAgent(QString("Mozilla/5.0 rpi-imager/%1").arg(constantVersion()).toUtf8());
     _thread->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _initFormat);
 
-    if (!_expectedHash.isEmpty() && _cachedFileHash != _expectedHash && _cachingEnabled)
+    QList<FanOutDeviceThread *> devices;
+    if (!_extraDsts.isEmpty())
     {
-        if (!_cachedFileHash.isEmpty())
+        for (const QString &dst : QStringList(_dst)+_extraDsts)
         {
-            if (_settings.isWritable() && QFile::remove(_cacheFileName))
-            {
-                _settings.remove("caching/lastDownloadSHA256");
-                _settings.sync();
-                _cachedFileHash.clear();
-            }
-            else
-            {
-                qDebug() << "Error removing old cache file. Disabling caching";
-                _cachingEnabled = false;
-            }
+            FanOutDeviceThread *device = new FanOutDeviceThread(dst.toLatin1(), _expectedHash);
+            connect(device, SIGNAL(success()), SLOT(onDeviceSuccess()));
+            connect(device, SIGNAL(error(QString)), SLOT(onDeviceError(QString)));
+            device->setVerifyEnabled(_verifyEnabled);
+            device->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _initFormat);
+            _thread->addFanOutDevice(device);
+            devices.append(device);
+        }
+    }
+
+    if (!_multipleFilesInZip)
+    {
+        /* Use block map if one is specified in the OS list, or if one exists next to the image.
+           By bmaptool convention it may be named after either the compressed or uncompressed image.
+           Those are only guesses, which are given less time */
+        QList<QByteArray> bmapUrls, guessedBmapUrls;
+        QByteArray srcurl = _src.toString(_src.FullyEncoded).toLatin1();
+
+        if (!_bmapUrl.isEmpty())
+        {
+            bmapUrls.append(_bmapUrl.toString(_bmapUrl.FullyEncoded).toLatin1());
+        }
+        else
+        {
+            guessedBmapUrls.append(srcurl+".bmap");
+            int dot = srcurl.lastIndexOf('.');
+            if (compressed && dot > srcurl.lastIndexOf('/'))
+                guessedBmapUrls.append(srcurl.left(dot)+".bmap");
         }
 
-        if (_cachingEnabled)
+        /* Block map we generated ourselves when the image was downloaded to cache */
+        QString cacheBmap = _cacheBmapFileName(_expectedHash);
+        if (!cachedFile.isEmpty() && QFile::exists(cacheBmap))
+            bmapUrls.prepend(QUrl::fromLocalFile(cacheBmap).toString(QUrl::FullyEncoded).toLatin1());
+
+        if (devices.isEmpty())
+        {
+            _thread->setBmapUrls(bmapUrls, guessedBmapUrls);
+
+            QString cacheDir = _customCacheFile ? QFileInfo(_cacheFileName).absolutePath() : QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+            if (QDir().mkpath(cacheDir))
+                _thread->setJournalFile(cacheDir+QDir::separator()+"resume.journal");
+        }
+        else
+        {
+            /* A single journal cannot describe several devices, so interrupted writes are not resumed */
+            for (auto device : std::as_const(devices))
+                device->setBmapUrls(bmapUrls, guessedBmapUrls);
+        }
+    }
+
+    if (!_expectedHash.isEmpty() && cachedFile.isEmpty() && _cachingEnabled)
+    {
+        if (_customCacheFile)
         {
-            QStorageInfo si(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+            QStorageInfo si(QFileInfo(_cacheFileName).absolutePath());
             qint64 avail = si.bytesAvailable();
             qDebug() << "Available disk space for caching:" << avail/1024/1024/1024 << "GB";
 
@@ -328,6 +423,37 @@ void ImageWriter::startWrite()
             else
             {
                 _thread->setCacheFile(_cacheFileName, _downloadLen);
+                _thread->setCacheBmapFile(_cacheBmapFileName(_expectedHash));
+                connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
+            }
+        }
+        else
+        {
+            /* Images can be stored extracted or recompressed as well, so writing them again is not limited by decompression */
+            CacheTranscoder::Format format;
+            _cacheFormat = _settings.value("caching/format", IMAGEWRITER_CACHE_FORMAT).toString();
+            bool transcode = !_multipleFilesInZip && CacheTranscoder::formatFromString(_cacheFormat, format);
+            if (!transcode)
+                _cacheFormat = "compressed";
+
+            /* The download is kept until the transcoded image is complete, so room is needed for both.
+               Raw images take up the extracted size at most, zstd is estimated */
+            quint64 reserveSize = _downloadLen;
+            if (transcode)
+                reserveSize += format == CacheTranscoder::Raw ? _extrLen : _downloadLen*2;
+
+            /* Least recently used images make room for this one */
+            _cache->setQuota(_settings.value("caching/quota", IMAGEWRITER_CACHE_QUOTA).toULongLong()*1024*1024*1024);
+            if (!_cache->reserve(reserveSize))
+            {
+                qDebug() << "Low disk space. Not caching files to disk.";
+            }
+            else
+            {
+                _thread->setCacheFile(_cache->fileName(_expectedHash, "compressed"), _downloadLen);
+                _thread->setCacheBmapFile(_cache->bmapFileName(_expectedHash));
+                if (transcode)
+                    _thread->setCacheTranscodeFile(_cache->fileName(_expectedHash, _cacheFormat), format);
                 connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
             }
         }
@@ -349,14 +475,37 @@ void ImageWriter::startWrite()
     startProgressPolling();
 }
 
-void ImageWriter::onCacheFileUpdated(QByteArray sha256)
+/* Block map of a cached image is stored next to the cache file, named after the hash of the extracted image */
+QString ImageWriter::_cacheBmapFileName(const QByteArray &sha256)
 {
     if (!_customCacheFile)
+        return _cache->bmapFileName(sha256);
+
+    return QFileInfo(_cacheFileName).absolutePath()+QDir::separator()+QString::fromLatin1(sha256)+".bmap";
+}
+
+/* File the image with this hash is cached as, or an empty string if it is not cached */
+QString ImageWriter::_cachedFile(const QByteArray &sha256)
+{
+    if (sha256.isEmpty())
+        return QString();
+    if (_customCacheFile)
+        return _cachedFileHash == sha256 ? _cacheFileName : QString();
+
+    return _cache->contains(sha256) ? _cache->fileName(sha256) : QString();
+}
+
+void ImageWriter::onCacheFileUpdated(QByteArray sha256)
+{
+    if (_customCacheFile)
+        _cachedFileHash = sha256;
+    else
     {
-        _settings.setValue("caching/lastDownloadSHA256", sha256);
-        _settings.sync();
+        /* Transcoded image replaces the download, unless it could not be completed */
+        if (!QFile::exists(_cache->fileName(sha256, _cacheFormat)))
+            _cacheFormat = "compressed";
+        _cache->add(sha256, _cacheFormat);
     }
-    _cachedFileHash = sha256;
     qDebug() << "Done writing cache file";
 }
 
@@ -388,7 +537,7 @@ void ImageWriter::onCancelled()
 /* Return true if url is in our local disk cache */
 bool ImageWriter::isCached(const QUrl &, const QByteArray &sha256)
 {
-    return !sha256.isEmpty() && _cachedFileHash == sha256;
+    return !_cachedFile(sha256).isEmpty();
 }
 
 /* Utility function to return filename part from URL */
@@ -737,6 +886,20 @@ void ImageWriter::onError(QString msg)
 #endif
 }
 
+void ImageWriter::onDeviceSuccess()
+{
+    FanOutDeviceThread *device = qobject_cast<FanOutDeviceThread *>(sender());
+    if (device)
+        emit deviceResult(QString(device->device()), true, QString());
+}
+
+void ImageWriter::onDeviceError(QString msg)
+{
+    FanOutDeviceThread *device = qobject_cast<FanOutDeviceThread *>(sender());
+    if (device)
+        emit deviceResult(QString(device->device()), false, msg);
+}
+
 void ImageWriter::onFinalizing()
 {
     _polltimer.stop();
@@ -24,6 +24,7 @@ class QQmlApplicationEngine;
 class DownloadThread;
 class QNetworkReply;
 class QTranslator;
+class ImageCache;
 
 class ImageWriter : public QObject
 {
@@ -34,11 +35,17 @@ public:
     void setEngine(QQmlApplicationEngine *engine);
 
     /* Set URL to download from, and if known download length and uncompressed length */
-    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "");
+    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "", QUrl bmapUrl = QUrl(), QStringList mirrors = QStringList());
 
     /* Set device to write to */
     Q_INVOKABLE void setDst(const QString &device, quint64 deviceSize = 0);
 
+    /* Also write the image to device. The image is only downloaded and decompressed once */
+    Q_INVOKABLE void addDst(const QString &device);
+
+    /* MB/s written to the devices behind each USB hub, when writing to several devices */
+    Q_INVOKABLE QVariantMap portThroughput();
+
     /* Enable/disable verification */
     Q_INVOKABLE void setVerifyEnabled(bool verify);
 
@@ -159,6 +166,8 @@ signals:
     void preparationStatusUpdate(QVariant msg);
     void osListPrepared();
     void networkInfo(QVariant msg);
+    /* Result of writing to one of several devices */
+    void deviceResult(QVariant device, QVariant success, QVariant msg);
 
 protected slots:
 
@@ -175,6 +184,8 @@ protected slots:
     void onFinalizing();
     void onTimeSyncReply(QNetworkReply *reply);
     void onPreparationStatusUpdate(QString msg);
+    void onDeviceSuccess();
+    void onDeviceError(QString msg);
     void handleNetworkRequestFinished(QNetworkReply *data);
     void onSTPdetected();
 
@@ -188,8 +199,10 @@ private:
     bool _deviceFilterIsInclusive;
 
 protected:
-    QUrl _src, _repo;
-    QString _dst, _cacheFileName, _parentCategory, _osName, _currentLang, _currentLangcode, _currentKeyboard;
+    QUrl _src, _repo, _bmapUrl;
+    QStringList _mirrors;
+    QStringList _extraDsts;
+    QString _dst, _cacheFileName, _cacheFormat, _parentCategory, _osName, _currentLang, _currentLangcode, _currentKeyboard;
     QByteArray _expectedHash, _cachedFileHash, _cmdline, _config, _firstrun, _cloudinit, _cloudinitNetwork, _initFormat;
     quint64 _downloadLen, _extrLen, _devLen, _dlnow, _verifynow;
     DriveListModel _drivelist;
@@ -201,10 +214,13 @@ protected:
     QSettings _settings;
     QMap<QString,QString> _translations;
     bool _customCacheFile;
+    ImageCache *_cache;
     QTranslator *_trans;
 
     void _parseCompressedFile();
     void _parseXZFile();
+    QString _cacheBmapFileName(const QByteArray &sha256);
+    QString _cachedFile(const QByteArray &sha256);
     QString _pubKeyFileName();
     QString _privKeyFileName();
     QString _sshKeyDir();
@@ -1,12 +1,79 @@
 /*
- * Use GnuTLS for SHA256
+ * Use GnuTLS for SHA256, or our built-in implementation if that is faster on this CPU
  *
  * SPDX-License-Identifier: Apache-2.0
  * Copyright (C) 2024 Raspberry Pi Ltd
  */
 
 #include "acceleratedcryptographichash.h"
+#include "sha256.h"
 #include "gnutls/crypto.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <QDebug>
+
+/* Time hashing a buffer with each of the implementations, and return the
+   built-in kernel to use, or nullptr for GnuTLS */
+static Sha256::CompressFunction selectSha256Kernel()
+{
+    const size_t benchSize = 1024*1024;
+    std::vector<char> buf(benchSize, 0x5A);
+    std::vector<Sha256::Kernel> kernels = Sha256::kernels();
+    Sha256::CompressFunction best = nullptr;
+    double bestTime = 0;
+    QStringList results;
+
+    /* Best of a few runs, so a page fault or interrupt does not decide */
+    auto bench = [&](const char *name, const std::function<void()> &hash) -> double {
+        double fastest = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            hash();
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            if (!i || t < fastest)
+                fastest = t;
+        }
+        results.append(QString("%1: %2 MB/s").arg(name).arg(int(benchSize/fastest/1000000)));
+        return fastest;
+    };
+
+    bestTime = bench("GnuTLS", [&]{
+        gnutls_hash_hd_t h;
+        unsigned char digest[32];
+        gnutls_hash_init(&h, GNUTLS_DIG_SHA256);
+        gnutls_hash(h, buf.data(), buf.size());
+        gnutls_hash_deinit(h, digest);
+    });
+
+    for (const auto &k : kernels)
+    {
+        double t = bench(k.name, [&]{
+            Sha256 h(k.compress);
+            h.addData(buf.data(), buf.size());
+            uint8_t digest[32];
+            h.result(digest);
+        });
+        if (t < bestTime)
+        {
+            best = k.compress;
+            bestTime = t;
+        }
+    }
+
+    QString chosen = "GnuTLS";
+    for (const auto &k : kernels)
+    {
+        if (k.compress == best)
+            chosen = k.name;
+    }
+    qDebug() << "SHA-256 implementation:" << chosen << "Benchmark:" << results.join(", ");
+
+    return best;
+}
 
 struct AcceleratedCryptographicHash::impl {
     explicit impl(QCryptographicHash::Algorithm method)
@@ -14,18 +81,27 @@ struct AcceleratedCryptographicHash::impl {
         if (method != QCryptographicHash::Sha256)
             throw std::runtime_error("Only sha256 implemented");
 
-        gnutls_hash_init(&_sha256, GNUTLS_DIG_SHA256);
+        /* Only benchmarked once, the first time a hash is created */
+        static const Sha256::CompressFunction kernel = selectSha256Kernel();
 
+        if (kernel)
+            _builtin.reset(new Sha256(kernel));
+        else
+            gnutls_hash_init(&_sha256, GNUTLS_DIG_SHA256);
     }
 
     ~impl()
     {
-        gnutls_hash_deinit(_sha256, NULL);
+        if (!_builtin)
+            gnutls_hash_deinit(_sha256, NULL);
     }
 
     void addData(const char *data, int length)
     {
-        gnutls_hash(_sha256, data, length);
+        if (_builtin)
+            _builtin->addData(data, length);
+        else
+            gnutls_hash(_sha256, data, length);
     }
 
     void addData(const QByteArray &data)
@@ -35,13 +111,37 @@ struct AcceleratedCryptographicHash::impl {
 
     QByteArray result()
     {
-        unsigned char binhash[gnutls_hash_get_len(GNUTLS_DIG_SHA256)];
-        gnutls_hash_output(_sha256, binhash);
+        unsigned char binhash[32];
+        if (_builtin)
+        {
+            _builtin->result(binhash);
+        }
+        else
+        {
+            /* gnutls_hash_output() resets the state, so finish a copy instead.
+               Copying is not supported by every backend, so keep the digest as fallback */
+            gnutls_hash_hd_t copy = gnutls_hash_copy(_sha256);
+            if (copy)
+            {
+                gnutls_hash_deinit(copy, binhash);
+            }
+            else
+            {
+                if (_result.isEmpty())
+                {
+                    gnutls_hash_output(_sha256, binhash);
+                    _result = QByteArray((char *) binhash, sizeof binhash);
+                }
+                return _result;
+            }
+        }
         return QByteArray((char *) binhash, sizeof binhash);
     }
 
 private:
     gnutls_hash_hd_t _sha256;
+    QByteArray _result;
+    std::unique_ptr<Sha256> _builtin;
 };
 
 AcceleratedCryptographicHash::AcceleratedCryptographicHash(QCryptographicHash::Algorithm method)
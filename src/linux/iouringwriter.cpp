@@ -0,0 +1,348 @@
+/*
+ * Asynchronous block device writer using io_uring
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "iouringwriter.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <QDebug>
+
+static inline int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    return (int) ::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nrArgs)
+{
+    return (int) ::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+IoUringWriter::IoUringWriter(int fd, unsigned int queueDepth, const std::vector<char *> &buffers, size_t bufferSize)
+    : _ringfd(-1), _fd(fd), _error(0), _depth(queueDepth), _inflight(0), _toSubmit(0), _registered(false),
+      _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqRingSize(0), _cqRingSize(0), _sqesSize(0),
+      _sqes((struct io_uring_sqe *) MAP_FAILED), _buffers(buffers), _bufferSize(bufferSize)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    _ringfd = io_uring_setup(_depth, &p);
+    if (_ringfd < 0)
+    {
+        qDebug() << "io_uring not available:" << strerror(errno);
+        return;
+    }
+    _depth = p.sq_entries;
+
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        _sqRingSize = _cqRingSize = qMax(_sqRingSize, _cqRingSize);
+    }
+
+    _sqRing = ::mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED)
+    {
+        qDebug() << "Error mapping io_uring submission queue:" << strerror(errno);
+        ::close(_ringfd);
+        _ringfd = -1;
+        return;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        _cqRing = _sqRing;
+    }
+    else
+    {
+        _cqRing = ::mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_CQ_RING);
+    }
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe *) ::mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd, IORING_OFF_SQES);
+
+    if (_cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+    {
+        qDebug() << "Error mapping io_uring completion queue:" << strerror(errno);
+        if (_sqes != MAP_FAILED)
+            ::munmap(_sqes, _sqesSize);
+        if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+            ::munmap(_cqRing, _cqRingSize);
+        ::munmap(_sqRing, _sqRingSize);
+        _sqRing = _cqRing = MAP_FAILED;
+        _sqes = (struct io_uring_sqe *) MAP_FAILED;
+        ::close(_ringfd);
+        _ringfd = -1;
+        return;
+    }
+
+    char *sq = (char *) _sqRing;
+    char *cq = (char *) _cqRing;
+    _sqHead  = (unsigned int *) (sq + p.sq_off.head);
+    _sqTail  = (unsigned int *) (sq + p.sq_off.tail);
+    _sqMask  = (unsigned int *) (sq + p.sq_off.ring_mask);
+    _sqArray = (unsigned int *) (sq + p.sq_off.array);
+    _cqHead  = (unsigned int *) (cq + p.cq_off.head);
+    _cqTail  = (unsigned int *) (cq + p.cq_off.tail);
+    _cqMask  = (unsigned int *) (cq + p.cq_off.ring_mask);
+    _cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* Number of writes in flight per registered buffer, plus one extra slot for writes from other memory */
+    _busy.resize(_buffers.size()+1, 0);
+    _iovecs.resize(_buffers.size());
+    for (size_t i = 0; i < _buffers.size(); i++)
+    {
+        _iovecs[i].iov_base = _buffers[i];
+        _iovecs[i].iov_len = _bufferSize;
+    }
+
+    if (!_buffers.empty())
+    {
+        if (io_uring_register(_ringfd, IORING_REGISTER_BUFFERS, _iovecs.data(), _buffers.size()) == 0)
+        {
+            _registered = true;
+        }
+        else
+        {
+            /* Older kernels count registered buffers against RLIMIT_MEMLOCK */
+            qDebug() << "Unable to register io_uring buffers:" << strerror(errno) << "Using unregistered buffers";
+        }
+    }
+
+    qDebug() << "Using io_uring for writing. Queue depth:" << _depth << "registered buffers:" << (_registered ? _buffers.size() : 0);
+}
+
+IoUringWriter::~IoUringWriter()
+{
+    if (_ringfd == -1)
+        return;
+
+    drain();
+    if (_registered)
+        io_uring_register(_ringfd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    ::munmap(_sqes, _sqesSize);
+    if (_cqRing != _sqRing)
+        ::munmap(_cqRing, _cqRingSize);
+    ::munmap(_sqRing, _sqRingSize);
+    ::close(_ringfd);
+}
+
+bool IoUringWriter::isValid() const
+{
+    return _ringfd != -1;
+}
+
+int IoUringWriter::error() const
+{
+    return _error;
+}
+
+void IoUringWriter::setCompletionCallback(const std::function<void(size_t)> &cb)
+{
+    _completionCallback = cb;
+}
+
+int IoUringWriter::_bufferIndex(const char *buf) const
+{
+    for (size_t i = 0; i < _buffers.size(); i++)
+    {
+        if (buf >= _buffers[i] && buf < _buffers[i]+_bufferSize)
+            return (int) i;
+    }
+
+    return -1;
+}
+
+/* Hand the queued writes to the kernel. It may accept fewer than asked, or none if it is out of resources */
+bool IoUringWriter::_submit()
+{
+    while (_toSubmit)
+    {
+        int ret = io_uring_enter(_ringfd, _toSubmit, 0, 0);
+        if (ret > 0)
+        {
+            _toSubmit -= qMin((unsigned int) ret, _toSubmit);
+            continue;
+        }
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno != EAGAIN && errno != EBUSY)
+        {
+            if (!_error)
+                _error = errno;
+            qDebug() << "io_uring_enter() failed:" << strerror(errno);
+            return false;
+        }
+
+        /* Kernel is out of resources, or the completion queue is full.
+           Let a write that was accepted complete, and try again */
+        if (_inflight > _toSubmit)
+        {
+            if (!_getEvents())
+                return false;
+        }
+        else
+        {
+            ::usleep(1000);
+        }
+    }
+
+    return true;
+}
+
+/* Wait for at least one completion. Only called with writes the kernel accepted in flight */
+bool IoUringWriter::_getEvents()
+{
+    while (io_uring_enter(_ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            if (!_error)
+                _error = errno;
+            qDebug() << "io_uring_enter() failed:" << strerror(errno);
+            return false;
+        }
+    }
+    _reap();
+
+    return true;
+}
+
+void IoUringWriter::_reap()
+{
+    unsigned int head = *_cqHead;
+    unsigned int tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+        size_t slot = cqe->user_data >> 32;
+        size_t len  = cqe->user_data & 0xFFFFFFFF;
+
+        if (cqe->res < 0 || (size_t) cqe->res != len)
+        {
+            if (!_error)
+                _error = (cqe->res < 0) ? -cqe->res : EIO;
+            qDebug() << "io_uring write failed:" << (cqe->res < 0 ? strerror(-cqe->res) : "short write");
+        }
+        else if (_completionCallback)
+        {
+            _completionCallback(len);
+        }
+
+        _busy[slot]--;
+        _inflight--;
+        head++;
+    }
+
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+}
+
+bool IoUringWriter::_waitForCompletion()
+{
+    /* Writes still waiting to be submitted would never complete */
+    if (!_submit())
+        return false;
+    if (!_inflight)
+        return true;
+
+    return _getEvents();
+}
+
+bool IoUringWriter::write(const char *buf, size_t len, uint64_t offset)
+{
+    if (_error)
+        return false;
+
+    int idx = _bufferIndex(buf);
+    size_t slot = (idx == -1) ? _buffers.size() : idx;
+
+    _reap();
+    while (_inflight >= _depth || (idx == -1 && _busy[slot]))
+    {
+        if (!_waitForCompletion())
+            return false;
+    }
+
+    unsigned int tail = *_sqTail;
+    unsigned int index = tail & *_sqMask;
+    struct io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = _fd;
+    sqe->off = offset;
+    sqe->user_data = ((uint64_t) slot << 32) | len;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+
+    if (idx != -1 && _registered)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = idx;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_WRITE;
+    }
+
+    _sqArray[index] = index;
+    __atomic_store_n(_sqTail, tail+1, __ATOMIC_RELEASE);
+    _busy[slot]++;
+    _inflight++;
+    _toSubmit++;
+
+    if (!_submit())
+        return false;
+
+    if (idx == -1)
+    {
+        /* Caller owns the memory, and may reuse it as soon as we return */
+        while (_busy[slot])
+        {
+            if (!_waitForCompletion())
+                return false;
+        }
+    }
+
+    return !_error;
+}
+
+bool IoUringWriter::waitForBuffer(const char *buf)
+{
+    int idx = _bufferIndex(buf);
+    if (idx == -1)
+        return !_error;
+
+    _reap();
+    while (_busy[idx])
+    {
+        if (!_waitForCompletion())
+            return false;
+    }
+
+    return !_error;
+}
+
+bool IoUringWriter::drain()
+{
+    if (_ringfd == -1)
+        return false;
+
+    _reap();
+    while (_inflight)
+    {
+        if (!_waitForCompletion())
+            return false;
+    }
+
+    return !_error;
+}
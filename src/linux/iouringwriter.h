@@ -0,0 +1,96 @@
+#ifndef IOURINGWRITER_H
+#define IOURINGWRITER_H
+
+/*
+ * Asynchronous block device writer using io_uring
+ *
+ * Talks to the kernel io_uring interface directly, so we do not
+ * need liburing as an additional dependency.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class IoUringWriter
+{
+public:
+    /*
+     * Constructor
+     *
+     * - fd: file descriptor of device to write to
+     * - queueDepth: maximum number of writes in flight
+     * - buffers: buffers to register with the kernel. Writes from one of
+     *   these buffers are asynchronous, writes from other memory wait for completion.
+     * - bufferSize: size of each buffer
+     */
+    IoUringWriter(int fd, unsigned int queueDepth, const std::vector<char *> &buffers, size_t bufferSize);
+    virtual ~IoUringWriter();
+
+    /*
+     * Returns true if io_uring is supported by the running kernel
+     */
+    bool isValid() const;
+
+    /*
+     * Queue write of len bytes at offset
+     * Returns false if this or an earlier write failed
+     */
+    bool write(const char *buf, size_t len, uint64_t offset);
+
+    /*
+     * Wait until buffer is no longer in use by a pending write
+     */
+    bool waitForBuffer(const char *buf);
+
+    /*
+     * Wait until all pending writes are completed
+     */
+    bool drain();
+
+    /*
+     * Set function called with the length of every completed write
+     */
+    void setCompletionCallback(const std::function<void(size_t)> &cb);
+
+    /*
+     * Returns errno of first failed write, or 0
+     */
+    int error() const;
+
+protected:
+    int _ringfd, _fd, _error;
+    unsigned int _depth, _inflight;
+    /* Writes in the submission queue the kernel has not accepted yet. Included in _inflight */
+    unsigned int _toSubmit;
+    bool _registered;
+
+    void *_sqRing, *_cqRing;
+    size_t _sqRingSize, _cqRingSize, _sqesSize;
+    unsigned int *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+    unsigned int *_cqHead, *_cqTail, *_cqMask;
+    struct io_uring_sqe *_sqes;
+    struct io_uring_cqe *_cqes;
+
+    std::vector<char *> _buffers;
+    std::vector<unsigned int> _busy;
+    std::vector<struct iovec> _iovecs;
+    size_t _bufferSize;
+    std::function<void(size_t)> _completionCallback;
+
+    int _bufferIndex(const char *buf) const;
+    bool _submit();
+    bool _getEvents();
+    void _reap();
+    bool _waitForCompletion();
+};
+
+#endif // IOURINGWRITER_H
@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sha256.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+const uint32_t sha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32-n));
+}
+
+static void compressGeneric(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const uint32_t *K = sha256RoundConstants;
+
+    while (blocks--)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t) data[i*4] << 24 | (uint32_t) data[i*4+1] << 16 | (uint32_t) data[i*4+2] << 8 | data[i*4+3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += 64;
+    }
+}
+
+Sha256::Sha256(CompressFunction compress)
+    : _compress(compress), _state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      _bufLen(0), _total(0)
+{
+}
+
+void Sha256::addData(const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    _total += len;
+
+    if (_bufLen)
+    {
+        size_t n = len < 64-_bufLen ? len : 64-_bufLen;
+        memcpy(_buf+_bufLen, p, n);
+        _bufLen += n;
+        p += n;
+        len -= n;
+
+        if (_bufLen < 64)
+            return;
+        _compress(_state, _buf, 1);
+        _bufLen = 0;
+    }
+
+    if (len >= 64)
+    {
+        _compress(_state, p, len/64);
+        p += len & ~(size_t) 63;
+        len &= 63;
+    }
+
+    memcpy(_buf, p, len);
+    _bufLen = len;
+}
+
+void Sha256::result(uint8_t *digest) const
+{
+    /* Pad a copy, so asking again, or adding more data afterwards, works as expected */
+    Sha256 h = *this;
+    uint64_t bits = _total*8;
+    uint8_t padding[72] = {0x80};
+    size_t padLen = (_bufLen < 56 ? 56 : 120) - _bufLen;
+
+    for (int i = 0; i < 8; i++)
+        padding[padLen+i] = bits >> (56-i*8);
+    h.addData((const char *) padding, padLen+8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i*4]   = h._state[i] >> 24;
+        digest[i*4+1] = h._state[i] >> 16;
+        digest[i*4+2] = h._state[i] >> 8;
+        digest[i*4+3] = h._state[i];
+    }
+}
+
+std::vector<Sha256::Kernel> Sha256::kernels()
+{
+    std::vector<Kernel> k = {{"built-in C", compressGeneric}};
+
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    bool sse41 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1);
+    bool sha = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+
+    if (sse41 && sha && sha256ShaNiKernel())
+        k.push_back({"built-in SHA-NI", sha256ShaNiKernel()});
+#elif defined(__aarch64__)
+    if ((getauxval(AT_HWCAP) & HWCAP_SHA2) && sha256ArmCeKernel())
+        k.push_back({"built-in ARMv8 crypto extensions", sha256ArmCeKernel()});
+#endif
+
+    return k;
+}
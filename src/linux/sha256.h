@@ -0,0 +1,62 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/*
+ * Built-in SHA-256 with hardware accelerated kernels
+ *
+ * Uses the SHA extensions of x86 CPUs (SHA-NI) or the cryptography
+ * extensions of ARMv8 CPUs if available, and portable C otherwise.
+ * The kernels for those live in their own source files, as they need
+ * compiler flags the rest of the code cannot be built with.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+class Sha256
+{
+public:
+    /* Processes blocks of 64 bytes of data */
+    typedef void (*CompressFunction)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+    struct Kernel
+    {
+        const char *name;
+        CompressFunction compress;
+    };
+
+    explicit Sha256(CompressFunction compress);
+
+    void addData(const char *data, size_t len);
+
+    /*
+     * Store the 32 byte digest of the data added so far in digest.
+     * Does not change the state, so more data can be added after it
+     */
+    void result(uint8_t *digest) const;
+
+    /*
+     * Kernels usable on this CPU. The portable one comes first
+     */
+    static std::vector<Kernel> kernels();
+
+protected:
+    CompressFunction _compress;
+    uint32_t _state[8];
+    uint8_t _buf[64];
+    size_t _bufLen;
+    uint64_t _total;
+};
+
+/* Return nullptr if not built for or supported by this CPU */
+Sha256::CompressFunction sha256ShaNiKernel();
+Sha256::CompressFunction sha256ArmCeKernel();
+
+/* Round constants, shared with the kernels */
+extern const uint32_t sha256RoundConstants[64];
+
+#endif // SHA256_H
@@ -0,0 +1,85 @@
+/*
+ * SHA-256 kernel using the ARMv8 cryptography extensions
+ *
+ * Built with -march=armv8-a+crypto. Only called after checking the CPU supports those.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sha256.h"
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+
+/* Four rounds with message words plus round constants in cur, while adding
+   the round constants to the next message words. Also computes the message schedule */
+#define ROUNDS(i, m0, m1, m2, m3, cur, next, withSchedule) \
+    if (withSchedule) \
+        m0 = vsha256su0q_u32(m0, m1); \
+    tmp2 = state0; \
+    if ((i) < 15) \
+        next = vaddq_u32(m1, vld1q_u32(&sha256RoundConstants[4*((i)+1)])); \
+    state0 = vsha256hq_u32(state0, state1, cur); \
+    state1 = vsha256h2q_u32(state1, tmp2, cur); \
+    if (withSchedule) \
+        m0 = vsha256su1q_u32(m0, m2, m3);
+
+static void compressArmCe(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t state0, state1, abcdSave, efghSave;
+    uint32x4_t msg0, msg1, msg2, msg3, tmp0, tmp1, tmp2;
+
+    state0 = vld1q_u32(&state[0]);
+    state1 = vld1q_u32(&state[4]);
+
+    while (blocks--)
+    {
+        abcdSave = state0;
+        efghSave = state1;
+
+        msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+0)));
+        msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+16)));
+        msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+32)));
+        msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+48)));
+        tmp0 = vaddq_u32(msg0, vld1q_u32(&sha256RoundConstants[0]));
+
+        ROUNDS(0,  msg0, msg1, msg2, msg3, tmp0, tmp1, true)
+        ROUNDS(1,  msg1, msg2, msg3, msg0, tmp1, tmp0, true)
+        ROUNDS(2,  msg2, msg3, msg0, msg1, tmp0, tmp1, true)
+        ROUNDS(3,  msg3, msg0, msg1, msg2, tmp1, tmp0, true)
+        ROUNDS(4,  msg0, msg1, msg2, msg3, tmp0, tmp1, true)
+        ROUNDS(5,  msg1, msg2, msg3, msg0, tmp1, tmp0, true)
+        ROUNDS(6,  msg2, msg3, msg0, msg1, tmp0, tmp1, true)
+        ROUNDS(7,  msg3, msg0, msg1, msg2, tmp1, tmp0, true)
+        ROUNDS(8,  msg0, msg1, msg2, msg3, tmp0, tmp1, true)
+        ROUNDS(9,  msg1, msg2, msg3, msg0, tmp1, tmp0, true)
+        ROUNDS(10, msg2, msg3, msg0, msg1, tmp0, tmp1, true)
+        ROUNDS(11, msg3, msg0, msg1, msg2, tmp1, tmp0, true)
+        ROUNDS(12, msg0, msg1, msg2, msg3, tmp0, tmp1, false)
+        ROUNDS(13, msg1, msg2, msg3, msg0, tmp1, tmp0, false)
+        ROUNDS(14, msg2, msg3, msg0, msg1, tmp0, tmp1, false)
+        ROUNDS(15, msg3, msg0, msg1, msg2, tmp1, tmp0, false)
+
+        state0 = vaddq_u32(state0, abcdSave);
+        state1 = vaddq_u32(state1, efghSave);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+Sha256::CompressFunction sha256ArmCeKernel()
+{
+    return compressArmCe;
+}
+
+#else
+
+Sha256::CompressFunction sha256ArmCeKernel()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * SHA-256 kernel using the x86 SHA extensions
+ *
+ * Built with -msse4.1 -msha. Only called after checking the CPU supports those.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sha256.h"
+
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+
+/* Four rounds with message words cur. Also computes the message schedule:
+   next gets its second step, prev its first one */
+#define ROUNDS(i, cur, prev, next, withMsg2, withMsg1) \
+    msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i *) &sha256RoundConstants[4*(i)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    if (withMsg2) { \
+        tmp = _mm_alignr_epi8(cur, prev, 4); \
+        next = _mm_add_epi32(next, tmp); \
+        next = _mm_sha256msg2_epu32(next, cur); \
+    } \
+    msg = _mm_shuffle_epi32(msg, 0x0E); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+    if (withMsg1) \
+        prev = _mm_sha256msg1_epu32(prev, cur);
+
+static void compressShaNi(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, msg0, msg1, msg2, msg3, abefSave, cdghSave;
+
+    /* The instructions want the state as ABEF and CDGH */
+    tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--)
+    {
+        abefSave = state0;
+        cdghSave = state1;
+
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data+0)), byteSwap);
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data+16)), byteSwap);
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data+32)), byteSwap);
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data+48)), byteSwap);
+
+        ROUNDS(0,  msg0, msg3, msg1, false, false)
+        ROUNDS(1,  msg1, msg0, msg2, false, true)
+        ROUNDS(2,  msg2, msg1, msg3, false, true)
+        ROUNDS(3,  msg3, msg2, msg0, true,  true)
+        ROUNDS(4,  msg0, msg3, msg1, true,  true)
+        ROUNDS(5,  msg1, msg0, msg2, true,  true)
+        ROUNDS(6,  msg2, msg1, msg3, true,  true)
+        ROUNDS(7,  msg3, msg2, msg0, true,  true)
+        ROUNDS(8,  msg0, msg3, msg1, true,  true)
+        ROUNDS(9,  msg1, msg0, msg2, true,  true)
+        ROUNDS(10, msg2, msg1, msg3, true,  true)
+        ROUNDS(11, msg3, msg2, msg0, true,  true)
+        ROUNDS(12, msg0, msg3, msg1, true,  true)
+        ROUNDS(13, msg1, msg0, msg2, true,  false)
+        ROUNDS(14, msg2, msg1, msg3, true,  false)
+        ROUNDS(15, msg3, msg2, msg0, false, false)
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+        data += 64;
+    }
+
+    /* Back to ABCD and EFGH */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+Sha256::CompressFunction sha256ShaNiKernel()
+{
+    return compressShaNi;
+}
+
+#else
+
+Sha256::CompressFunction sha256ShaNiKernel()
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "trailingverifier.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+TrailingVerifier::TrailingVerifier(const char *device, uint64_t start, size_t alignment, size_t blockSize,
+                                   const std::function<void(const char *, size_t)> &handler)
+    : _buf(nullptr), _alignment(alignment), _blockSize(blockSize), _pos(start), _limit(start), _error(0), _stop(false),
+      _handler(handler)
+{
+    _fd = ::open(device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (_fd == -1)
+        return;
+
+    if (::posix_memalign((void **) &_buf, _alignment < 4096 ? 4096 : _alignment, _blockSize) != 0)
+    {
+        _buf = nullptr;
+        ::close(_fd);
+        _fd = -1;
+        return;
+    }
+
+    _thread = std::thread(&TrailingVerifier::_run, this);
+}
+
+TrailingVerifier::~TrailingVerifier()
+{
+    stop();
+    if (_fd != -1)
+        ::close(_fd);
+    free(_buf);
+}
+
+bool TrailingVerifier::isValid() const
+{
+    return _fd != -1;
+}
+
+void TrailingVerifier::setLimit(uint64_t offset)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    /* Only read whole logical blocks */
+    offset -= offset % _alignment;
+    if (offset <= _limit)
+        return;
+    _limit = offset;
+    lock.unlock();
+    _limitChanged.notify_one();
+}
+
+uint64_t TrailingVerifier::stop()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stop = true;
+    lock.unlock();
+    _limitChanged.notify_one();
+
+    if (_thread.joinable())
+        _thread.join();
+
+    return _pos;
+}
+
+int TrailingVerifier::error()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _error;
+}
+
+void TrailingVerifier::_run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true)
+    {
+        _limitChanged.wait(lock, [this]{
+            return _stop || _pos < _limit;
+        });
+        if (_stop)
+            break;
+
+        size_t len = _limit-_pos < _blockSize ? _limit-_pos : _blockSize;
+        uint64_t pos = _pos;
+        lock.unlock();
+
+        ssize_t n;
+        do {
+            n = ::pread(_fd, _buf, len, pos);
+        } while (n == -1 && errno == EINTR);
+
+        /* Reading nothing means the device is smaller than what we were told was written */
+        int err = n == -1 ? errno : EIO;
+        if (n > 0)
+            _handler(_buf, n);
+        lock.lock();
+
+        if (n <= 0)
+        {
+            _error = err;
+            break;
+        }
+        _pos += n;
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef TRAILINGVERIFIER_H
+#define TRAILINGVERIFIER_H
+
+/*
+ * Reads back data behind the write head while the image is still being written
+ *
+ * Uses a separate file descriptor opened with O_DIRECT, so reads come from
+ * the device and not from the page cache. Only data that the writer reports
+ * as having reached the device is read.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <stddef.h>
+
+class TrailingVerifier
+{
+public:
+    /*
+     * Constructor
+     *
+     * - device: device to read back from
+     * - start: offset to start reading at. Must be a multiple of alignment
+     * - alignment: logical block size of the device
+     * - blockSize: size of each read. Must be a multiple of alignment
+     * - handler: function called on the worker thread with the data read, in order
+     */
+    TrailingVerifier(const char *device, uint64_t start, size_t alignment, size_t blockSize,
+                     const std::function<void(const char *, size_t)> &handler);
+    virtual ~TrailingVerifier();
+
+    /*
+     * Returns true if the device could be opened for reading with O_DIRECT
+     */
+    bool isValid() const;
+
+    /*
+     * Allow reading up to offset. Everything before it must have reached the device.
+     */
+    void setLimit(uint64_t offset);
+
+    /*
+     * Finish the read in progress, stop the worker thread, and return the offset
+     * up to which data was read back and passed to the handler
+     */
+    uint64_t stop();
+
+    /*
+     * errno of the read that failed, or 0
+     */
+    int error();
+
+protected:
+    int _fd;
+    char *_buf;
+    size_t _alignment, _blockSize;
+    uint64_t _pos, _limit;
+    int _error;
+    bool _stop;
+    std::function<void(const char *, size_t)> _handler;
+    std::mutex _mutex;
+    std::condition_variable _limitChanged;
+    std::thread _thread;
+
+    void _run();
+};
+
+#endif // TRAILINGVERIFIER_H
@@ -30,6 +30,8 @@ void LocalFileExtractThread::run()
 {
     if (isImage() && !_openAndPrepareDevice())
         return;
+    if (isImage())
+        _loadBmap();
 
     emit preparationStatusUpdate(tr("opening image file"));
     _timer.start();
@@ -76,3 +78,8 @@ int LocalFileExtractThread::_on_close(struct archive *)
     _inputfile.close();
     return 0;
 }
+
+QString LocalFileExtractThread::_replaySource()
+{
+    return _inputfile.fileName();
+}
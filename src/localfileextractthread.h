@@ -21,6 +21,7 @@ protected:
     virtual void run();
     virtual ssize_t _on_read(struct archive *a, const void **buff);
     virtual int _on_close(struct archive *a);
+    virtual QString _replaySource();
     QFile _inputfile;
     char *_inputBuf;
 };
@@ -652,6 +652,8 @@ ApplicationWindow {
                     tooltip: ""
                     website: ""
                     init_format: ""
+                    image_bmap_url: ""
+                    mirrors_json: ""
                 }
             }
 
@@ -1489,6 +1491,10 @@ ApplicationWindow {
                 entry["subitems_json"] = JSON.stringify(entry["subitems"])
                 delete entry["subitems"]
             }
+            if ("mirrors" in entry) {
+                entry["mirrors_json"] = JSON.stringify(entry["mirrors"])
+                delete entry["mirrors"]
+            }
         }
 
         return oslist_parsed
@@ -1690,6 +1696,10 @@ ApplicationWindow {
                     entry["subitems_json"] = JSON.stringify(entry["subitems"])
                     delete entry["subitems"]
                 }
+                if ("mirrors" in entry) {
+                    entry["mirrors_json"] = JSON.stringify(entry["mirrors"])
+                    delete entry["mirrors"]
+                }
                 m.append(entry)
             }
 
@@ -1730,7 +1740,7 @@ ApplicationWindow {
                 }
             }
         } else {
-            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "")
+            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "", typeof(d.image_bmap_url) != "undefined" ? d.image_bmap_url : "", typeof(d.mirrors_json) == "string" && d.mirrors_json !== "" ? JSON.parse(d.mirrors_json) : [])
             osbutton.text = d.name
             ospopup.close()
             osswipeview.decrementCurrentIndex()
@@ -0,0 +1,223 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "parallelframedecoder.h"
+#include <string.h>
+#include <QtConcurrent/QtConcurrent>
+#include <QDebug>
+
+ParallelFrameDecoder::ParallelFrameDecoder(uint32_t threads, size_t maxFrameSize)
+    : _maxQueued(qMax(threads, 1u)*2), _maxFrameSize(maxFrameSize), _pendingPos(0), _streaming(false), _atFrameEnd(false)
+{
+    _pool.setMaxThreadCount(qMax(threads, 1u));
+}
+
+ParallelFrameDecoder::~ParallelFrameDecoder()
+{
+}
+
+/* Workers reference the frames in the queue, and call back into the subclass */
+void ParallelFrameDecoder::_waitForWorkers()
+{
+    _pool.waitForDone();
+}
+
+StreamDecoder::Result ParallelFrameDecoder::decode(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish)
+{
+    if (!_error.isEmpty())
+        return Error;
+
+    while (outLen)
+    {
+        if (inLen && !_streaming && _queue.size() < _maxQueued)
+        {
+            _pending.append((const char *) in, inLen);
+            in += inLen;
+            inLen = 0;
+            if (!_splitFrames())
+                return Error;
+        }
+
+        if (!_queue.empty())
+        {
+            Frame *f = _queue.front().get();
+
+            if (!f->future.isFinished())
+            {
+                /* Rather read more input to keep the workers busy, than wait for them */
+                if (!inLen && !finish && !_streaming && _queue.size() < _maxQueued)
+                    return Ok;
+                f->future.waitForFinished();
+            }
+            if (!f->error.isEmpty())
+            {
+                _error = f->error;
+                return Error;
+            }
+            if (!_outputFrame(f, out, outLen))
+                return Error;
+            if (f->finished)
+                _queue.pop_front();
+            continue;
+        }
+
+        /* Frames before the stream part are all output now */
+        if (_streaming)
+            return _decodeStream(in, inLen, out, outLen, finish);
+
+        if (!finish)
+            return Ok;
+        if (_pendingPos != (size_t) _pending.size())
+        {
+            _error = "Unexpected end of compressed data";
+            return Error;
+        }
+        return StreamEnd;
+    }
+
+    return Ok;
+}
+
+QString ParallelFrameDecoder::errorString() const
+{
+    return _error;
+}
+
+/* Move all complete frames from _pending to the queue, and start decoding them */
+bool ParallelFrameDecoder::_splitFrames()
+{
+    while (!_streaming && _pendingPos < (size_t) _pending.size())
+    {
+        const char *p = _pending.constData()+_pendingPos;
+        size_t len = _pending.size()-_pendingPos;
+        size_t frameLen = 0;
+        QByteArray frame;
+        FrameStatus status = _findFrame(p, len, frameLen, frame);
+
+        if (status == FrameError)
+            return false;
+        if (status == FrameIncomplete && len > _maxFrameSize)
+            status = FrameStream;
+        if (status == FrameStream)
+        {
+            qDebug() << "Frame too large to decode in parallel, or of unknown size. Continuing single-threaded";
+            _streaming = true;
+        }
+        if (status == FrameIncomplete || status == FrameStream)
+            break;
+
+        if (status == FrameComplete)
+        {
+            Frame *f = new Frame;
+            f->compressed = frame;
+            f->inPos = f->outPos = 0;
+            f->serial = f->finished = false;
+            f->future = QtConcurrent::run(&_pool, [this, f]() {
+                _decodeFrame(f);
+            });
+            _queue.emplace_back(f);
+        }
+
+        _pendingPos += frameLen;
+    }
+
+    if (_pendingPos)
+    {
+        _pending.remove(0, _pendingPos);
+        _pendingPos = 0;
+    }
+
+    return true;
+}
+
+/* Copy decoded data of the frame at the front of the queue to the output, or decode it there directly */
+bool ParallelFrameDecoder::_outputFrame(Frame *f, uint8_t *&out, size_t &outLen)
+{
+    if (!f->serial)
+    {
+        size_t len = qMin(outLen, (size_t) f->output.size()-f->outPos);
+        memcpy(out, f->output.constData()+f->outPos, len);
+        out += len;
+        outLen -= len;
+        f->outPos += len;
+        f->finished = (f->outPos == (size_t) f->output.size());
+        return true;
+    }
+
+    while (outLen)
+    {
+        const uint8_t *in = (const uint8_t *) f->compressed.constData()+f->inPos;
+        size_t inLen = f->compressed.size()-f->inPos;
+        uint8_t *startOut = out;
+        bool atFrameEnd = false;
+
+        if (!_decodeSerial(in, inLen, out, outLen, atFrameEnd))
+            return false;
+        if (out == startOut && in == (const uint8_t *) f->compressed.constData()+f->inPos)
+        {
+            _error = "Unexpected end of compressed frame";
+            return false;
+        }
+        f->inPos = f->compressed.size()-inLen;
+        if (atFrameEnd && !inLen)
+        {
+            f->finished = true;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* Single-threaded decoding of the rest of the data, starting with what is still in _pending */
+StreamDecoder::Result ParallelFrameDecoder::_decodeStream(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish)
+{
+    while (outLen)
+    {
+        bool fromPending = _pendingPos < (size_t) _pending.size();
+        const uint8_t *p = fromPending ? (const uint8_t *) _pending.constData()+_pendingPos : in;
+        size_t len = fromPending ? _pending.size()-_pendingPos : inLen;
+        const uint8_t *startIn = p;
+        uint8_t *startOut = out;
+        bool atFrameEnd = false;
+
+        if (!_decodeSerial(p, len, out, outLen, atFrameEnd))
+            return Error;
+
+        if (fromPending)
+        {
+            _pendingPos += p-startIn;
+            if (_pendingPos == (size_t) _pending.size())
+            {
+                _pending.clear();
+                _pendingPos = 0;
+            }
+        }
+        else
+        {
+            in = p;
+            inLen = len;
+        }
+
+        if (out != startOut || p != startIn)
+        {
+            _atFrameEnd = atFrameEnd;
+        }
+        else
+        {
+            /* Needs more input */
+            if (!finish)
+                return Ok;
+            if (!_atFrameEnd)
+            {
+                _error = "Unexpected end of compressed data";
+                return Error;
+            }
+            return StreamEnd;
+        }
+    }
+
+    return Ok;
+}
@@ -0,0 +1,95 @@
+#ifndef PARALLELFRAMEDECODER_H
+#define PARALLELFRAMEDECODER_H
+
+/*
+ * Base class for decoders of formats that can consist of independently
+ * compressed frames (zstd frames, BGZF gzip members, bzip2 streams)
+ *
+ * Complete frames are cut from the input and decoded by a pool of worker
+ * threads. Their output is returned in order. Once a frame is found that
+ * cannot be cut out (too large, or the format does not tell its size)
+ * the rest of the input is decoded as a stream on the calling thread.
+ *
+ * Subclasses must call _waitForWorkers() in their destructor.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "streamdecoder.h"
+#include <QByteArray>
+#include <QFuture>
+#include <QThreadPool>
+#include <deque>
+#include <memory>
+
+class ParallelFrameDecoder : public StreamDecoder
+{
+public:
+    /*
+     * Constructor
+     *
+     * - threads: number of worker threads
+     * - maxFrameSize: largest frame (compressed or decompressed) decoded by the workers
+     */
+    ParallelFrameDecoder(uint32_t threads, size_t maxFrameSize);
+    virtual ~ParallelFrameDecoder();
+
+    virtual Result decode(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish);
+    virtual QString errorString() const;
+
+protected:
+    enum FrameStatus
+    {
+        FrameComplete,      /* frameLen and frame set */
+        FrameSkip,          /* frameLen set, data holds no image data */
+        FrameIncomplete,    /* need more data to tell */
+        FrameStream,        /* decode everything from here on as a stream */
+        FrameError          /* _error set */
+    };
+
+    struct Frame
+    {
+        QByteArray compressed, output;
+        size_t inPos, outPos;
+        bool serial, finished;
+        QString error;
+        QFuture<void> future;
+    };
+
+    QThreadPool _pool;
+    std::deque<std::unique_ptr<Frame>> _queue;
+    size_t _maxQueued, _maxFrameSize;
+    QByteArray _pending;
+    size_t _pendingPos;
+    bool _streaming, _atFrameEnd;
+    QString _error;
+
+    /*
+     * Look at the data at the start of the next frame
+     *
+     * frameLen: number of bytes of data that can be dropped
+     * frame: what to hand to _decodeFrame(). Usually the first frameLen bytes of data
+     */
+    virtual FrameStatus _findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame) = 0;
+
+    /*
+     * Worker thread: decode f->compressed into f->output, or set f->error.
+     * Set f->serial instead if the output would be larger than _maxFrameSize.
+     */
+    virtual void _decodeFrame(Frame *f) = 0;
+
+    /*
+     * Decode on the calling thread, continuing where the previous call left off.
+     * Set atFrameEnd if the input so far ends exactly at the end of a frame.
+     * Returns false and sets _error on error.
+     */
+    virtual bool _decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd) = 0;
+
+    void _waitForWorkers();
+    bool _splitFrames();
+    bool _outputFrame(Frame *f, uint8_t *&out, size_t &outLen);
+    Result _decodeStream(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish);
+};
+
+#endif // PARALLELFRAMEDECODER_H
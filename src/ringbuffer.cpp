@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "ringbuffer.h"
+#include <string.h>
+#include <QtGlobal>
+
+RingBuffer::RingBuffer(size_t size)
+    : _head(0), _cachedTail(0), _tail(0), _cachedHead(0), _pending(0),
+      _closed(false), _cancelled(false), _producerWaiting(false), _consumerWaiting(false),
+      _buf(nullptr), _size(size)
+{
+}
+
+RingBuffer::~RingBuffer()
+{
+    if (_buf)
+        qFreeAligned(_buf);
+}
+
+bool RingBuffer::write(const char *data, size_t len)
+{
+    if (!_buf)
+        _buf = (char *) qMallocAligned(_size, 4096);
+
+    uint64_t head = _head.load(std::memory_order_relaxed);
+
+    while (len && !_cancelled)
+    {
+        if (head - _cachedTail == _size)
+        {
+            _cachedTail = _tail.load(std::memory_order_acquire);
+            if (head - _cachedTail == _size)
+            {
+                _wait(_producerWaiting, &RingBuffer::_hasSpace);
+                continue;
+            }
+        }
+
+        size_t offset = head % _size;
+        size_t chunk = qMin(len, qMin((size_t) (_size - (head - _cachedTail)), _size - offset));
+        ::memcpy(_buf + offset, data, chunk);
+        data += chunk;
+        len -= chunk;
+        head += chunk;
+
+        _head.store(head, std::memory_order_seq_cst);
+        _wake(_consumerWaiting);
+    }
+
+    return !_cancelled;
+}
+
+void RingBuffer::close()
+{
+    _closed = true;
+    _wake(_consumerWaiting);
+}
+
+void RingBuffer::cancel()
+{
+    _cancelled = true;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cv.notify_all();
+}
+
+ssize_t RingBuffer::read(const void **buf)
+{
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+
+    /* libarchive is done with the previous slice now */
+    if (_pending)
+    {
+        tail += _pending;
+        _pending = 0;
+        _tail.store(tail, std::memory_order_seq_cst);
+        _wake(_producerWaiting);
+    }
+
+    while (_cachedHead == tail)
+    {
+        _cachedHead = _head.load(std::memory_order_acquire);
+        if (_cachedHead != tail)
+            break;
+        if (_cancelled)
+            return -1;
+        if (_closed)
+        {
+            /* Producer may have written its last data right before closing */
+            _cachedHead = _head.load(std::memory_order_acquire);
+            if (_cachedHead == tail)
+                return 0;
+            break;
+        }
+        _wait(_consumerWaiting, &RingBuffer::_hasData);
+    }
+    if (_cancelled)
+        return -1;
+
+    size_t offset = tail % _size;
+    _pending = qMin((uint64_t) (_size - offset), _cachedHead - tail);
+    *buf = _buf + offset;
+
+    return _pending;
+}
+
+/* Sleep until ready() is true. The other side only takes the mutex if it sees our flag set */
+void RingBuffer::_wait(std::atomic<bool> &waitingFlag, bool (RingBuffer::*ready)())
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    waitingFlag.store(true, std::memory_order_seq_cst);
+    _cv.wait(lock, [this, ready]{
+        return _cancelled || (this->*ready)();
+    });
+    waitingFlag.store(false, std::memory_order_relaxed);
+}
+
+void RingBuffer::_wake(std::atomic<bool> &waitingFlag)
+{
+    if (waitingFlag.load(std::memory_order_seq_cst))
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cv.notify_all();
+    }
+}
+
+bool RingBuffer::_hasSpace()
+{
+    return _head.load() - _tail.load() < _size;
+}
+
+bool RingBuffer::_hasData()
+{
+    return _head.load() != _tail.load() || _closed;
+}
@@ -0,0 +1,76 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+/*
+ * Single producer, single consumer byte ring buffer
+ *
+ * The producer copies data in, the consumer gets pointers into the
+ * ring itself, so data is not copied a second time.
+ * Read and write positions are only ever advanced by one side each,
+ * and live on separate cache lines. A mutex/condition variable is only
+ * touched when one side actually has to wait for the other.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+class RingBuffer
+{
+public:
+    /*
+     * Constructor
+     *
+     * - size: capacity in bytes. Memory is only allocated on first write()
+     */
+    explicit RingBuffer(size_t size);
+    virtual ~RingBuffer();
+
+    /*
+     * Producer: copy len bytes into the ring, waiting for space if it is full
+     * Returns false if the ring was cancelled
+     */
+    bool write(const char *data, size_t len);
+
+    /*
+     * Producer: signal no more data will follow
+     */
+    void close();
+
+    /*
+     * Either side: abort. Pending and future calls return immediately.
+     */
+    void cancel();
+
+    /*
+     * Consumer: release the slice returned by the previous call,
+     * and wait for the next contiguous slice of data.
+     * Returns its length, 0 at end of data, or -1 if cancelled.
+     */
+    ssize_t read(const void **buf);
+
+protected:
+    /* Positions are byte counts since start, and never wrap */
+    alignas(64) std::atomic<uint64_t> _head;
+    uint64_t _cachedTail;
+    alignas(64) std::atomic<uint64_t> _tail;
+    uint64_t _cachedHead, _pending;
+    alignas(64) std::atomic<bool> _closed, _cancelled, _producerWaiting, _consumerWaiting;
+    char *_buf;
+    size_t _size;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    void _wait(std::atomic<bool> &waitingFlag, bool (RingBuffer::*ready)());
+    void _wake(std::atomic<bool> &waitingFlag);
+    bool _hasSpace();
+    bool _hasData();
+};
+
+#endif // RINGBUFFER_H
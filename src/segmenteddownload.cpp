@@ -0,0 +1,293 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "segmenteddownload.h"
+#include <QDebug>
+
+/* Number of times a range may fail with a network error on each mirror before giving up */
+#define SEGMENT_MAX_RETRIES 5
+
+SegmentedDownload::SegmentedDownload(const QByteArray &url, curl_off_t size, unsigned int connections, size_t segmentSize, size_t windowSize)
+    : _urls({url}), _preferred(0), _size(size), _received(0), _passedOn(0), _connections(qMax(connections, 1u)), _active(0), _segmentSize(segmentSize),
+      _next(0), _nextToStart(0), _multi(nullptr), _sinkFailed(false)
+{
+    size_t count = (size+segmentSize-1)/segmentSize;
+    _window = qMax(windowSize/segmentSize, (size_t) _connections);
+    _segments.resize(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        Segment &s = _segments[i];
+        s.owner = this;
+        s.index = i;
+        s.start = i*segmentSize;
+        s.end = qMin((curl_off_t) ((i+1)*segmentSize), size);
+        s.received = 0;
+        s.handle = nullptr;
+        s.done = false;
+        s.rangeIgnored = false;
+        s.retries = 0;
+        s.mirror = 0;
+        s.errorBuf[0] = 0;
+    }
+}
+
+SegmentedDownload::~SegmentedDownload()
+{
+    for (auto &s : _segments)
+    {
+        if (s.handle)
+        {
+            curl_multi_remove_handle(_multi, s.handle);
+            curl_easy_cleanup(s.handle);
+        }
+    }
+    if (_multi)
+        curl_multi_cleanup(_multi);
+}
+
+void SegmentedDownload::setConfigureFunction(const std::function<void(CURL *)> &configure)
+{
+    _configure = configure;
+}
+
+void SegmentedDownload::setMirrors(const QList<QByteArray> &urls)
+{
+    _urls = _urls.mid(0, 1)+urls;
+}
+
+QString SegmentedDownload::errorString() const
+{
+    return _error;
+}
+
+curl_off_t SegmentedDownload::passedOn() const
+{
+    return _passedOn;
+}
+
+size_t SegmentedDownload::_curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    Segment *s = static_cast<Segment *>(userdata);
+    SegmentedDownload *d = s->owner;
+    size_t len = size*nmemb;
+
+    if (s->received+(curl_off_t) len > s->end-s->start)
+    {
+        /* Server sent more than we asked for, so it did not honor the range */
+        return 0;
+    }
+    s->received += len;
+    d->_received += len;
+
+    if (s->index == d->_next && s->data.isEmpty())
+    {
+        /* First range that is not passed on yet. No need to keep it */
+        if (!d->_sink(ptr, len))
+        {
+            d->_sinkFailed = true;
+            return 0;
+        }
+        d->_passedOn += len;
+    }
+    else
+    {
+        if (s->data.isEmpty())
+            s->data.reserve(s->end-s->start-s->received+len);
+        s->data.append(ptr, len);
+    }
+
+    return len;
+}
+
+size_t SegmentedDownload::_curl_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    Segment *s = static_cast<Segment *>(userdata);
+    size_t len = size*nmemb;
+
+    /* An empty line ends the headers of each response. Only the last one, after any redirects, has data */
+    if ((len == 2 && ptr[0] == '\r' && ptr[1] == '\n') || (len == 1 && ptr[0] == '\n'))
+    {
+        long httpCode = 0;
+        curl_easy_getinfo(s->handle, CURLINFO_RESPONSE_CODE, &httpCode);
+        if (httpCode >= 200 && httpCode < 300 && httpCode != 206)
+        {
+            /* Server ignores the range, and is about to send all of the file. Stop before any of it is passed on */
+            s->rangeIgnored = true;
+            return 0;
+        }
+    }
+
+    return len;
+}
+
+bool SegmentedDownload::_startSegment(Segment &s)
+{
+    QByteArray range = QByteArray::number((qlonglong) (s.start+s.received))+"-"+QByteArray::number((qlonglong) (s.end-1));
+
+    s.handle = curl_easy_init();
+    if (!s.handle)
+        return false;
+    if (_configure)
+        _configure(s.handle);
+    curl_easy_setopt(s.handle, CURLOPT_URL, _urls.at(s.mirror).constData());
+    curl_easy_setopt(s.handle, CURLOPT_RANGE, range.constData());
+    curl_easy_setopt(s.handle, CURLOPT_WRITEFUNCTION, &SegmentedDownload::_curl_write_callback);
+    curl_easy_setopt(s.handle, CURLOPT_WRITEDATA, &s);
+    curl_easy_setopt(s.handle, CURLOPT_HEADERFUNCTION, &SegmentedDownload::_curl_header_callback);
+    curl_easy_setopt(s.handle, CURLOPT_HEADERDATA, &s);
+    curl_easy_setopt(s.handle, CURLOPT_PRIVATE, &s);
+    curl_easy_setopt(s.handle, CURLOPT_ERRORBUFFER, s.errorBuf);
+    s.errorBuf[0] = 0;
+
+    if (curl_multi_add_handle(_multi, s.handle) != CURLM_OK)
+    {
+        curl_easy_cleanup(s.handle);
+        s.handle = nullptr;
+        return false;
+    }
+    _active++;
+
+    return true;
+}
+
+/* Pass on what arrived of the first ranges, and move on past the ones that are complete */
+bool SegmentedDownload::_deliver()
+{
+    while (_next < _segments.size())
+    {
+        Segment &s = _segments[_next];
+
+        if (!s.data.isEmpty())
+        {
+            if (!_sink(s.data.constData(), s.data.size()))
+            {
+                _sinkFailed = true;
+                return false;
+            }
+            _passedOn += s.data.size();
+            s.data = QByteArray();
+        }
+        if (!s.done)
+            break;
+        _next++;
+    }
+
+    return true;
+}
+
+CURLcode SegmentedDownload::perform(const std::function<bool(const char *, size_t)> &sink,
+                                    const std::function<bool(curl_off_t)> &progress)
+{
+    CURLcode result = CURLE_OK;
+
+    _sink = sink;
+    _multi = curl_multi_init();
+    if (!_multi)
+        return CURLE_OUT_OF_MEMORY;
+
+    while (_next < _segments.size())
+    {
+        /* Keep all connections busy, as far as the reorder window allows */
+        while (_active < _connections && _nextToStart < _segments.size() && _nextToStart < _next+_window)
+        {
+            _segments[_nextToStart].mirror = _preferred;
+            if (!_startSegment(_segments[_nextToStart]))
+            {
+                result = CURLE_OUT_OF_MEMORY;
+                break;
+            }
+            _nextToStart++;
+        }
+        if (result != CURLE_OK)
+            break;
+
+        int running;
+        curl_multi_perform(_multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(_multi, &queued)) && result == CURLE_OK)
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            Segment *s;
+            CURL *h = msg->easy_handle;
+            CURLcode ret = msg->data.result;
+            long httpCode = 0;
+            curl_easy_getinfo(h, CURLINFO_PRIVATE, (char **) &s);
+            curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &httpCode);
+            curl_multi_remove_handle(_multi, h);
+            curl_easy_cleanup(h);
+            s->handle = nullptr;
+            _active--;
+
+            if (_sinkFailed)
+            {
+                result = CURLE_WRITE_ERROR;
+                break;
+            }
+            if (s->rangeIgnored)
+            {
+                _error = QString("Server did not honor range request (HTTP status %1)").arg(httpCode);
+                result = CURLE_RANGE_ERROR;
+                break;
+            }
+            if (ret == CURLE_OK && s->received != s->end-s->start)
+            {
+                ret = CURLE_PARTIAL_FILE;
+            }
+
+            if (ret == CURLE_OK)
+            {
+                s->done = true;
+                if (s->index == _next && !_deliver())
+                {
+                    result = CURLE_WRITE_ERROR;
+                    break;
+                }
+            }
+            else if ((ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT || ret == CURLE_RECV_ERROR
+                      || ret == CURLE_SEND_ERROR || ret == CURLE_HTTP2_STREAM || ret == CURLE_COULDNT_CONNECT
+                      || (ret == CURLE_HTTP_RETURNED_ERROR && _urls.size() > 1))
+                     && s->retries < SEGMENT_MAX_RETRIES*_urls.size())
+            {
+                /* Continue the range where it stopped, from the next mirror if there is one.
+                   Stop using the mirror that failed for new ranges as well.
+                   A mirror answering with an HTTP error, like 404 or 503, is left for the next one */
+                s->retries++;
+                if (_urls.size() > 1)
+                {
+                    if (s->mirror == _preferred)
+                        _preferred = (_preferred+1) % _urls.size();
+                    s->mirror = (s->mirror+1) % _urls.size();
+                }
+                qDebug() << "Range" << s->start << "-" << s->end << "failed:" << curl_easy_strerror(ret) << "HTTP status:" << httpCode
+                         << "Retrying from" << s->start+s->received << "using" << _urls.at(s->mirror);
+                if (!_startSegment(*s))
+                    result = CURLE_OUT_OF_MEMORY;
+            }
+            else
+            {
+                _error = s->errorBuf[0] ? QString(s->errorBuf) : QString(curl_easy_strerror(ret));
+                result = ret;
+            }
+        }
+        if (result != CURLE_OK)
+            break;
+
+        if (progress && !progress(_received))
+        {
+            result = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+
+        if (_next < _segments.size())
+            curl_multi_poll(_multi, NULL, 0, 1000, NULL);
+    }
+
+    return result;
+}
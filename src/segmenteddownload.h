@@ -0,0 +1,103 @@
+#ifndef SEGMENTEDDOWNLOAD_H
+#define SEGMENTEDDOWNLOAD_H
+
+/*
+ * Downloads a file over several connections at once, each fetching a range of it
+ *
+ * Connections that are shaped or limited by latency individually add up to more
+ * of the available bandwidth. The ranges are passed on in order. Ranges that
+ * arrive early are kept in memory, and no range is started that is further ahead
+ * than the reorder window, which bounds memory use.
+ * Requires a server that supports range requests.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <functional>
+#include <vector>
+#include <curl/curl.h>
+
+class SegmentedDownload
+{
+public:
+    /*
+     * Constructor
+     *
+     * - url: URL to download
+     * - size: size of the file
+     * - connections: number of ranges downloaded at the same time
+     * - segmentSize: size of each range
+     * - windowSize: maximum distance between the first range not passed on yet, and the last one started
+     */
+    SegmentedDownload(const QByteArray &url, curl_off_t size, unsigned int connections, size_t segmentSize, size_t windowSize);
+    virtual ~SegmentedDownload();
+
+    /*
+     * Function called to set options like proxy and user agent on each connection
+     */
+    void setConfigureFunction(const std::function<void(CURL *)> &configure);
+
+    /*
+     * Other URLs of the same file. A range that fails continues from the next URL,
+     * and ranges that start after that use it as well
+     */
+    void setMirrors(const QList<QByteArray> &urls);
+
+    /*
+     * Download the file, and pass it to sink in order.
+     * sink returns false to stop with CURLE_WRITE_ERROR.
+     * progress is called regularly with the number of bytes received, and returns false to abort.
+     * Ranges that fail with a network error are retried from where they stopped.
+     * Returns CURLE_RANGE_ERROR if the server answers a range request with all of the file.
+     * That is found out before any of the answer is passed to sink.
+     */
+    CURLcode perform(const std::function<bool(const char *, size_t)> &sink,
+                     const std::function<bool(curl_off_t)> &progress);
+
+    /*
+     * Error message of the transfer that failed
+     */
+    QString errorString() const;
+
+    /*
+     * Number of bytes passed to sink
+     */
+    curl_off_t passedOn() const;
+
+protected:
+    struct Segment
+    {
+        SegmentedDownload *owner;
+        size_t index;
+        curl_off_t start, end, received;
+        QByteArray data;
+        CURL *handle;
+        bool done, rangeIgnored;
+        unsigned int retries;
+        int mirror;
+        char errorBuf[CURL_ERROR_SIZE];
+    };
+
+    QList<QByteArray> _urls;
+    int _preferred;
+    curl_off_t _size, _received, _passedOn;
+    unsigned int _connections, _active;
+    size_t _segmentSize, _window, _next, _nextToStart;
+    std::vector<Segment> _segments;
+    std::function<void(CURL *)> _configure;
+    std::function<bool(const char *, size_t)> _sink;
+    CURLM *_multi;
+    bool _sinkFailed;
+    QString _error;
+
+    bool _startSegment(Segment &s);
+    bool _deliver();
+    static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t _curl_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+};
+
+#endif // SEGMENTEDDOWNLOAD_H
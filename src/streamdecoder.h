@@ -0,0 +1,39 @@
+#ifndef STREAMDECODER_H
+#define STREAMDECODER_H
+
+/*
+ * Interface for decompressors that are used instead of libarchive
+ * for single file disk images, where a faster decoder is available
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QString>
+#include <stdint.h>
+#include <stddef.h>
+
+class StreamDecoder
+{
+public:
+    enum Result
+    {
+        Ok,
+        StreamEnd,
+        Error
+    };
+
+    virtual ~StreamDecoder() {}
+
+    /*
+     * Decompress as much of the input into out as fits,
+     * advancing in/out and decreasing inLen/outLen accordingly.
+     * finish must be set once there is no more input after this.
+     * Returns StreamEnd once all data has been output.
+     */
+    virtual Result decode(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish) = 0;
+
+    virtual QString errorString() const = 0;
+};
+
+#endif // STREAMDECODER_H
@@ -0,0 +1,103 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "writejournal.h"
+#include <QDebug>
+
+#define JOURNAL_MAGIC "rpi-imager-journal 1"
+
+WriteJournal::WriteJournal(const QString &filename)
+    : _file(filename), _count(0)
+{
+}
+
+WriteJournal::~WriteJournal()
+{
+    _file.close();
+}
+
+QByteArray WriteJournal::_header(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize)
+{
+    return JOURNAL_MAGIC "\n"
+           "image "+imageKey+"\n"
+           "device "+device+" "+QByteArray::number(deviceSize)+"\n"
+           "chunksize "+QByteArray::number((quint64) chunkSize)+"\n";
+}
+
+QList<quint64> WriteJournal::load(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize)
+{
+    QList<quint64> digests;
+    QFile f(_file.fileName());
+
+    if (!f.open(QIODevice::ReadOnly))
+        return digests;
+
+    QByteArray header = _header(imageKey, device, deviceSize, chunkSize);
+    if (f.read(header.size()) != header)
+    {
+        qDebug() << "Write journal" << f.fileName() << "is for a different image or device. Ignoring it";
+        return digests;
+    }
+
+    while (!f.atEnd())
+    {
+        QByteArray line = f.readLine();
+        QList<QByteArray> fields = line.trimmed().split(' ');
+        bool ok1, ok2;
+
+        /* Last line may be incomplete if we crashed while writing it */
+        if (!line.endsWith('\n') || fields.size() != 2)
+            break;
+        qsizetype idx = fields[0].toLongLong(&ok1);
+        quint64 digest = fields[1].toULongLong(&ok2, 16);
+        if (!ok1 || !ok2 || idx != digests.size())
+            break;
+
+        digests.append(digest);
+    }
+
+    return digests;
+}
+
+bool WriteJournal::start(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize, const QList<quint64> &digests)
+{
+    _file.close();
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Error creating write journal" << _file.fileName() << _file.errorString();
+        return false;
+    }
+
+    QByteArray header = _header(imageKey, device, deviceSize, chunkSize);
+    _count = 0;
+
+    return _file.write(header) == header.size() && append(digests);
+}
+
+bool WriteJournal::append(const QList<quint64> &digests)
+{
+    if (digests.isEmpty())
+        return true;
+
+    QByteArray lines;
+    for (quint64 digest : digests)
+    {
+        lines += QByteArray::number(_count++)+" "+QByteArray::number(digest, 16)+"\n";
+    }
+
+    return _file.write(lines) == lines.size() && _file.flush();
+}
+
+qsizetype WriteJournal::count() const
+{
+    return _count;
+}
+
+void WriteJournal::remove()
+{
+    _file.close();
+    _file.remove();
+    _count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef WRITEJOURNAL_H
+#define WRITEJOURNAL_H
+
+/*
+ * Journal of the chunks of an image that have reached the device
+ *
+ * Lets a write that was interrupted (cancelled, crashed, device reset)
+ * continue where it stopped, instead of starting over from the first byte.
+ * Text file with a header identifying the image and device, followed by
+ * one line per chunk with its digest. Lines are only appended, so a
+ * journal cut short by a crash is still usable up to its last full line.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+class WriteJournal
+{
+public:
+    WriteJournal(const QString &filename);
+    virtual ~WriteJournal();
+
+    /*
+     * Read the journal left behind by a previous write.
+     * Returns the digests of the chunks it recorded, or an empty list if
+     * there is none, or it was for a different image, device or chunk size
+     */
+    QList<quint64> load(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize);
+
+    /*
+     * Start a new journal, recording digests as the first chunks already written
+     */
+    bool start(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize, const QList<quint64> &digests);
+
+    /*
+     * Record that chunks following the ones recorded before have reached the device
+     */
+    bool append(const QList<quint64> &digests);
+
+    /*
+     * Number of chunks recorded
+     */
+    qsizetype count() const;
+
+    /*
+     * Remove the journal after the write completed
+     */
+    void remove();
+
+protected:
+    QFile _file;
+    qsizetype _count;
+
+    QByteArray _header(const QByteArray &imageKey, const QByteArray &device, quint64 deviceSize, size_t chunkSize);
+};
+
+#endif // WRITEJOURNAL_H
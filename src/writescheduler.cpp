@@ -0,0 +1,142 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "writescheduler.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QDebug>
+
+WriteScheduler::WriteScheduler(unsigned int writesPerPort)
+    : _writesPerPort(writesPerPort)
+{
+}
+
+WriteScheduler::~WriteScheduler()
+{
+}
+
+void WriteScheduler::addDevice(const QByteArray &device)
+{
+    QString p = usbPort(device);
+    qDebug() << "Device" << device << "is connected to port" << p;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _devicePort.insert(device, p);
+    _ports[p];
+}
+
+/* Called with _mutex held */
+bool WriteScheduler::_mayWrite(const QByteArray &device, quint64 position)
+{
+    const QString &p = _devicePort.value(device);
+    if (_ports.value(p).inFlight >= _writesPerPort)
+        return false;
+
+    /* Let the device on the same port that is furthest behind go first */
+    for (auto i = _waiting.cbegin(); i != _waiting.cend(); ++i)
+    {
+        if (i.key() != device && i.value() < position && _devicePort.value(i.key()) == p)
+            return false;
+    }
+
+    return true;
+}
+
+bool WriteScheduler::acquire(const QByteArray &device, quint64 position, const bool &cancelled)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _waiting.insert(device, position);
+    _changed.wait(lock, [&]{
+        return cancelled || _mayWrite(device, position);
+    });
+    _waiting.remove(device);
+
+    if (cancelled)
+    {
+        /* Someone else may be allowed to go now */
+        lock.unlock();
+        _changed.notify_all();
+        return false;
+    }
+
+    Port &p = _ports[_devicePort.value(device)];
+    p.inFlight++;
+    if (!p.started)
+    {
+        p.firstWrite = std::chrono::steady_clock::now();
+        p.started = true;
+    }
+
+    return true;
+}
+
+void WriteScheduler::release(const QByteArray &device, quint64 bytes)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    Port &p = _ports[_devicePort.value(device)];
+    p.inFlight--;
+    p.bytes += bytes;
+    p.lastWrite = std::chrono::steady_clock::now();
+    lock.unlock();
+    _changed.notify_all();
+}
+
+void WriteScheduler::wake()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    lock.unlock();
+    _changed.notify_all();
+}
+
+QString WriteScheduler::port(const QByteArray &device)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _devicePort.value(device);
+}
+
+QMap<QString, double> WriteScheduler::throughput()
+{
+    QMap<QString, double> result;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (auto i = _ports.cbegin(); i != _ports.cend(); ++i)
+    {
+        double secs = std::chrono::duration<double>(i.value().lastWrite-i.value().firstWrite).count();
+        if (i.value().started && secs > 0)
+            result.insert(i.key(), i.value().bytes/secs/1000000);
+    }
+
+    return result;
+}
+
+QString WriteScheduler::usbPort(const QByteArray &device)
+{
+#ifdef Q_OS_LINUX
+    /* Like /sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1.3/2-1.3:1.0/host4/target4:0:0/4:0:0:0/block/sdb
+       The last USB port in the path (2-1.3) is where the device is connected, the part before it the hub (2-1)
+       Devices connected to a root port (2-1) are grouped by root hub (usb2) */
+    QString target = QFile::symLinkTarget("/sys/class/block/"+QFileInfo(QString(device)).fileName());
+    static const QRegularExpression usbPortRx("^\\d+-\\d+(\\.\\d+)*$");
+    QString rootHub, lastPort;
+
+    for (const QString &component : target.split('/'))
+    {
+        if (component.startsWith("usb"))
+            rootHub = component;
+        else if (usbPortRx.match(component).hasMatch())
+            lastPort = component;
+    }
+
+    if (!lastPort.isEmpty())
+    {
+        int dot = lastPort.lastIndexOf('.');
+        return dot == -1 ? rootHub : lastPort.left(dot);
+    }
+#endif
+
+    /* Not a USB device, or we cannot tell. Gets a port of its own */
+    return QString(device);
+}
@@ -0,0 +1,91 @@
+#ifndef WRITESCHEDULER_H
+#define WRITESCHEDULER_H
+
+/*
+ * Schedules writes of several devices that are written to at the same time
+ *
+ * Devices are grouped by the USB hub they are connected to, as devices
+ * behind the same hub share its bandwidth. Only a limited number of writes
+ * per hub are in flight at a time, and the device that is furthest behind
+ * goes first, so devices sharing a hub finish at about the same time.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QHash>
+#include <QMap>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+class WriteScheduler
+{
+public:
+    /*
+     * Constructor
+     *
+     * - writesPerPort: maximum number of writes in flight to devices behind the same hub
+     */
+    WriteScheduler(unsigned int writesPerPort);
+    virtual ~WriteScheduler();
+
+    /*
+     * Register device. Must be called before the first write to it
+     */
+    void addDevice(const QByteArray &device);
+
+    /*
+     * Wait until device may write. position is the number of bytes written to it so far.
+     * Returns false if cancelled became true while waiting, after wake() was called
+     */
+    bool acquire(const QByteArray &device, quint64 position, const bool &cancelled);
+
+    /*
+     * The write acquire() allowed is done, and wrote bytes
+     */
+    void release(const QByteArray &device, quint64 bytes);
+
+    /*
+     * Let waiting devices check if they were cancelled
+     */
+    void wake();
+
+    /*
+     * Port device was grouped under
+     */
+    QString port(const QByteArray &device);
+
+    /*
+     * MB/s written to the devices behind each port, from the first write until the last one
+     */
+    QMap<QString, double> throughput();
+
+    /*
+     * USB hub device is connected to, or the device itself if it is not a USB device
+     */
+    static QString usbPort(const QByteArray &device);
+
+protected:
+    struct Port
+    {
+        unsigned int inFlight = 0;
+        quint64 bytes = 0;
+        bool started = false;
+        std::chrono::steady_clock::time_point firstWrite, lastWrite;
+    };
+
+    unsigned int _writesPerPort;
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    QHash<QByteArray, QString> _devicePort;
+    QHash<QString, Port> _ports;
+    /* Devices waiting in acquire(), and their positions */
+    QHash<QByteArray, quint64> _waiting;
+
+    bool _mayWrite(const QByteArray &device, quint64 position);
+};
+
+#endif // WRITESCHEDULER_H
@@ -0,0 +1,102 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "xzdecoder.h"
+#include <string.h>
+#include <QtGlobal>
+
+XzDecoder::XzDecoder(uint32_t threads, uint64_t memlimit)
+    : _strm(LZMA_STREAM_INIT), _threads(threads)
+{
+    if (!_threads)
+        _threads = qMax(lzma_cputhreads(), 1u);
+    if (!memlimit)
+        memlimit = lzma_physmem()/4;
+
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = _threads;
+    /* Exceeding memlimit_threading only makes the decoder fall back to
+       single-threaded mode. Never fail, just like libarchive's decoder. */
+    mt.memlimit_threading = memlimit ? memlimit : UINT64_MAX;
+    mt.memlimit_stop = UINT64_MAX;
+
+    _ret = lzma_stream_decoder_mt(&_strm, &mt);
+}
+
+XzDecoder::~XzDecoder()
+{
+    lzma_end(&_strm);
+}
+
+bool XzDecoder::isXz(const void *data, size_t len)
+{
+    static const uint8_t magic[] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+
+    return len >= sizeof(magic) && memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+bool XzDecoder::isValid() const
+{
+    return _ret == LZMA_OK || _ret == LZMA_STREAM_END;
+}
+
+uint32_t XzDecoder::threads() const
+{
+    return _threads;
+}
+
+StreamDecoder::Result XzDecoder::decode(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish)
+{
+    if (!isValid())
+        return Error;
+
+    _strm.next_in = in;
+    _strm.avail_in = inLen;
+    _strm.next_out = out;
+    _strm.avail_out = outLen;
+
+    _ret = lzma_code(&_strm, finish ? LZMA_FINISH : LZMA_RUN);
+
+    in = _strm.next_in;
+    inLen = _strm.avail_in;
+    out = _strm.next_out;
+    outLen = _strm.avail_out;
+
+    if (_ret == LZMA_STREAM_END)
+        return StreamEnd;
+    /* LZMA_BUF_ERROR is only returned once no progress is possible, e.g. on truncated input */
+    if (_ret != LZMA_OK)
+        return Error;
+
+    return Ok;
+}
+
+QString XzDecoder::errorString() const
+{
+    switch (_ret)
+    {
+    case LZMA_OK:
+    case LZMA_STREAM_END:
+        return QString();
+    case LZMA_MEM_ERROR:
+        return "Out of memory";
+    case LZMA_MEMLIMIT_ERROR:
+        return "Memory usage limit reached";
+    case LZMA_FORMAT_ERROR:
+        return "Not an xz file";
+    case LZMA_OPTIONS_ERROR:
+        return "Unsupported xz compression options";
+    case LZMA_DATA_ERROR:
+        return "xz compressed data is corrupt";
+    case LZMA_BUF_ERROR:
+        return "Unexpected end of xz compressed data";
+    case LZMA_UNSUPPORTED_CHECK:
+        return "Unsupported xz integrity check type";
+    default:
+        return QString("xz decoder error %1").arg((int) _ret);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef XZDECODER_H
+#define XZDECODER_H
+
+/*
+ * .xz decompression using liblzma's multi-threaded decoder
+ *
+ * Blocks are decoded in parallel if the stream was created by a multi-threaded
+ * encoder (xz -T), which stores the block sizes in the block headers.
+ * Streams consisting of a single block are decoded on the calling thread.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "streamdecoder.h"
+#include <lzma.h>
+
+class XzDecoder : public StreamDecoder
+{
+public:
+    /*
+     * Constructor
+     *
+     * - threads: maximum number of decoder threads. 0 to use one per CPU core
+     * - memlimit: decode using fewer threads if more memory than this would be needed. 0 for a quarter of RAM
+     */
+    XzDecoder(uint32_t threads, uint64_t memlimit);
+    virtual ~XzDecoder();
+
+    /*
+     * Returns true if data starts with the .xz magic bytes
+     */
+    static bool isXz(const void *data, size_t len);
+
+    bool isValid() const;
+    uint32_t threads() const;
+    virtual Result decode(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool finish);
+    virtual QString errorString() const;
+
+protected:
+    lzma_stream _strm;
+    lzma_ret _ret;
+    uint32_t _threads;
+};
+
+#endif // XZDECODER_H
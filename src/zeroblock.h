@@ -0,0 +1,67 @@
+#ifndef ZEROBLOCK_H
+#define ZEROBLOCK_H
+
+/*
+ * Fast detection of blocks consisting of only zero bytes
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Returns true if all len bytes of buf are zero
+ * buf must be 16 byte aligned, and len a multiple of 64
+ */
+static inline bool isZeroBlock(const char *buf, size_t len)
+{
+#if defined(__SSE2__)
+    const __m128i *p = (const __m128i *) buf;
+    const __m128i *end = (const __m128i *) (buf+len);
+
+    while (p < end)
+    {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_load_si128(p), _mm_load_si128(p+1)),
+                                 _mm_or_si128(_mm_load_si128(p+2), _mm_load_si128(p+3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+        p += 4;
+    }
+    return true;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8_t *p = (const uint8_t *) buf;
+    const uint8_t *end = p+len;
+
+    while (p < end)
+    {
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p+16)),
+                                vorrq_u8(vld1q_u8(p+32), vld1q_u8(p+48)));
+        if (vmaxvq_u8(v))
+            return false;
+        p += 64;
+    }
+    return true;
+#else
+    const uint64_t *p = (const uint64_t *) buf;
+    const uint64_t *end = (const uint64_t *) (buf+len);
+
+    while (p < end)
+    {
+        if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+            return false;
+        p += 8;
+    }
+    return true;
+#endif
+}
+
+#endif // ZEROBLOCK_H
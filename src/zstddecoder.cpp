@@ -0,0 +1,162 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "zstddecoder.h"
+#include <zstd_errors.h>
+#include <QtEndian>
+
+ZstdDecoder::ZstdDecoder(uint32_t threads, size_t maxFrameSize)
+    : ParallelFrameDecoder(threads, maxFrameSize)
+{
+    _dctx = ZSTD_createDCtx();
+}
+
+ZstdDecoder::~ZstdDecoder()
+{
+    _waitForWorkers();
+    ZSTD_freeDCtx(_dctx);
+}
+
+static inline bool isSkippableFrame(const void *data, size_t len)
+{
+    return len >= 4 && (qFromLittleEndian<quint32>(data) & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+bool ZstdDecoder::isZstd(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    /* Skippable frame header is magic + 32-bit length */
+    if (len >= 8 && isSkippableFrame(p, len))
+    {
+        size_t skip = 8 + (size_t) qFromLittleEndian<quint32>(p+4);
+        if (skip > len)
+            return false;
+        p += skip;
+        len -= skip;
+    }
+
+    return len >= 4 && qFromLittleEndian<quint32>(p) == ZSTD_MAGICNUMBER;
+}
+
+ParallelFrameDecoder::FrameStatus ZstdDecoder::_findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame)
+{
+    frameLen = ZSTD_findFrameCompressedSize(data, len);
+
+    if (ZSTD_isError(frameLen))
+    {
+        if (ZSTD_getErrorCode(frameLen) != ZSTD_error_srcSize_wrong)
+        {
+            _error = ZSTD_getErrorName(frameLen);
+            return FrameError;
+        }
+
+        /* No point in buffering the frame, if the header already says it is too large */
+        unsigned long long contentSize = ZSTD_getFrameContentSize(data, len);
+        if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR && contentSize > _maxFrameSize)
+            return FrameStream;
+
+        return FrameIncomplete;
+    }
+
+    if (isSkippableFrame(data, len))
+        return FrameSkip;
+
+    frame = QByteArray(data, frameLen);
+    return FrameComplete;
+}
+
+/* Worker thread */
+void ZstdDecoder::_decodeFrame(Frame *f)
+{
+    const char *src = f->compressed.constData();
+    size_t srcLen = f->compressed.size();
+    unsigned long long contentSize = ZSTD_getFrameContentSize(src, srcLen);
+
+    if (contentSize == ZSTD_CONTENTSIZE_ERROR)
+    {
+        f->error = "Corrupt zstd frame header";
+        return;
+    }
+    if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        if (contentSize > _maxFrameSize)
+        {
+            f->serial = true;
+            return;
+        }
+
+        f->output.resize(contentSize);
+        size_t r = ZSTD_decompress(f->output.data(), contentSize, src, srcLen);
+        if (ZSTD_isError(r))
+            f->error = ZSTD_getErrorName(r);
+        else if (r != contentSize)
+            f->error = "zstd frame is shorter than its header says";
+        return;
+    }
+
+    /* Size is not in the frame header (e.g. seekable format), so decode into a growing buffer */
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer ib = {src, srcLen, 0};
+    size_t used = 0;
+
+    while (true)
+    {
+        if (used == (size_t) f->output.size())
+        {
+            if (used >= _maxFrameSize)
+            {
+                /* Leave it to the consumer to decode this one as a stream */
+                f->output.clear();
+                f->serial = true;
+                break;
+            }
+            f->output.resize(qMin(_maxFrameSize, qMax(used*2, ZSTD_DStreamOutSize())));
+        }
+
+        ZSTD_outBuffer ob = {f->output.data(), (size_t) f->output.size(), used};
+        size_t r = ZSTD_decompressStream(dctx, &ob, &ib);
+        used = ob.pos;
+        if (ZSTD_isError(r))
+        {
+            f->error = ZSTD_getErrorName(r);
+            break;
+        }
+        if (r == 0)
+        {
+            f->output.resize(used);
+            break;
+        }
+        if (ib.pos == ib.size && ob.pos < ob.size)
+        {
+            f->error = "Unexpected end of zstd frame";
+            break;
+        }
+    }
+
+    ZSTD_freeDCtx(dctx);
+}
+
+bool ZstdDecoder::_decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd)
+{
+    ZSTD_inBuffer ib = {in, inLen, 0};
+    ZSTD_outBuffer ob = {out, outLen, 0};
+    size_t r = ZSTD_decompressStream(_dctx, &ob, &ib);
+
+    if (ZSTD_isError(r))
+    {
+        _error = ZSTD_getErrorName(r);
+        return false;
+    }
+
+    in += ib.pos;
+    inLen -= ib.pos;
+    out += ob.pos;
+    outLen -= ob.pos;
+    /* 0 means the frame is complete and flushed */
+    atFrameEnd = (r == 0);
+
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef ZSTDDECODER_H
+#define ZSTDDECODER_H
+
+/*
+ * .zst decompression that decodes independent frames in parallel
+ *
+ * Images compressed in the zstd seekable format, or by pzstd, consist of
+ * many small frames. Those are decoded by a pool of worker threads, and
+ * output in order. A frame that is too large to hold in memory (e.g. a
+ * whole image compressed with plain zstd as a single frame) is decoded
+ * as a stream on the calling thread instead.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "parallelframedecoder.h"
+#include <zstd.h>
+
+class ZstdDecoder : public ParallelFrameDecoder
+{
+public:
+    ZstdDecoder(uint32_t threads, size_t maxFrameSize);
+    virtual ~ZstdDecoder();
+
+    /*
+     * Returns true if data starts with a zstd frame,
+     * or with a skippable frame followed by one (pzstd)
+     */
+    static bool isZstd(const void *data, size_t len);
+
+protected:
+    ZSTD_DCtx *_dctx;
+
+    virtual FrameStatus _findFrame(const char *data, size_t len, size_t &frameLen, QByteArray &frame);
+    virtual void _decodeFrame(Frame *f);
+    virtual bool _decodeSerial(const uint8_t *&in, size_t &inLen, uint8_t *&out, size_t &outLen, bool &atFrameEnd);
+};
+
+#endif // ZSTDDECODER_H
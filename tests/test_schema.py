@@ -21,6 +21,44 @@ def test_os_list_json_against_schema(oslisttuple, schema):
         pytest.fail(oslisturl+" failed schema validation: "+errorMsg, False)
 
 
+def sample_os_list(**fields):
+    item = {
+        "name": "Raspberry Pi OS (32-bit)",
+        "description": "A port of Debian Bookworm with the Raspberry Pi Desktop",
+        "icon": "https://downloads.raspberrypi.com/raspios_armhf/Raspberry_Pi_OS_(32-bit).png",
+        "url": "https://downloads.raspberrypi.com/raspios_armhf/images/2024-07-04-raspios-bookworm-armhf.img.xz",
+        "extract_size": 5490343936,
+        "extract_sha256": "ceb7d7489847ed811e7746fa779837f78fc06d43663148a696280e6a1cfe00e3",
+        "image_download_size": 1306588543,
+        "release_date": "2024-07-04",
+        "devices": ["pi4-32bit"]
+    }
+    item.update(fields)
+    return {"os_list": [item]}
+
+
+@pytest.mark.parametrize("fields", [
+    {},
+    {"image_bmap_url": "https://downloads.raspberrypi.com/raspios_armhf/images/2024-07-04-raspios-bookworm-armhf.img.bmap"},
+    {"mirrors": []},
+    {"mirrors": ["https://mirror.example.org/2024-07-04-raspios-bookworm-armhf.img.xz", "http://mirror2.example.org/image.img.xz"]}
+])
+def test_optional_fields_accepted(fields, schema):
+    validate(instance=sample_os_list(**fields), schema=schema)
+
+
+@pytest.mark.parametrize("fields", [
+    {"image_bmap_url": 1},
+    {"image_bmap_url": ["https://downloads.raspberrypi.com/image.img.bmap"]},
+    {"mirrors": "https://mirror.example.org/image.img.xz"},
+    {"mirrors": [1]},
+    {"mirrors": ["ftp://mirror.example.org/image.img.xz"]}
+])
+def test_optional_fields_rejected(fields, schema):
+    with pytest.raises(ValidationError):
+        validate(instance=sample_os_list(**fields), schema=schema)
+
+
 @pytest.fixture
 def schema():
     f = open(os.path.dirname(__file__)+"/../doc/json-schema/os-list-schema.json","r")
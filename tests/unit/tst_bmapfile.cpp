@@ -0,0 +1,156 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bmapfile.h"
+#include <QCryptographicHash>
+#include <QtTest>
+
+class TestBmapFile : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parsesRanges();
+    void roundTrip();
+    void partialLastBlock();
+    void rejectsModifiedFile();
+    void rejectsUnsupported();
+};
+
+/* Image of blocks of 4096 bytes: data, data, zero, data, zero, zero */
+static QByteArray sampleImage()
+{
+    QByteArray image(6*4096, 0);
+    for (int i = 0; i < 4096; i++)
+    {
+        image[i] = (char) (i*7);
+        image[4096+i] = (char) (i*13);
+        image[3*4096+i] = (char) (i+1);
+    }
+    return image;
+}
+
+static QByteArray sha256(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+}
+
+/* As written by bmaptool, without a file checksum */
+void TestBmapFile::parsesRanges()
+{
+    QByteArray image = sampleImage();
+    QByteArray xml = "<?xml version=\"1.0\" ?>\n"
+                     "<bmap version=\"2.0\">\n"
+                     "    <ImageSize> 24576 </ImageSize>\n"
+                     "    <BlockSize> 4096 </BlockSize>\n"
+                     "    <BlocksCount> 6 </BlocksCount>\n"
+                     "    <MappedBlocksCount> 3 </MappedBlocksCount>\n"
+                     "    <ChecksumType> sha256 </ChecksumType>\n"
+                     "    <BlockMap>\n"
+                     "        <Range chksum=\""+sha256(image.mid(0, 2*4096))+"\"> 0-1 </Range>\n"
+                     "        <Range chksum=\""+sha256(image.mid(3*4096, 4096)).toUpper()+"\"> 3 </Range>\n"
+                     "    </BlockMap>\n"
+                     "</bmap>\n";
+
+    BmapFile bmap;
+    QVERIFY2(bmap.parse(xml), qPrintable(bmap.errorString()));
+    QVERIFY(bmap.isValid());
+    QCOMPARE(bmap.imageSize(), (quint64) image.size());
+    QCOMPARE(bmap.mappedSize(), (quint64) 3*4096);
+
+    const QList<BmapFile::Range> &ranges = bmap.ranges();
+    QCOMPARE(ranges.size(), 2);
+    QCOMPARE(ranges[0].offset, (quint64) 0);
+    QCOMPARE(ranges[0].length, (quint64) 2*4096);
+    QCOMPARE(ranges[0].sha256, sha256(image.mid(0, 2*4096)));
+    QCOMPARE(ranges[1].offset, (quint64) 3*4096);
+    QCOMPARE(ranges[1].length, (quint64) 4096);
+    QCOMPARE(ranges[1].sha256, sha256(image.mid(3*4096, 4096)));
+
+    /* Blocks must not overlap */
+    QVERIFY(!bmap.parse(QByteArray(xml).replace("> 3 <", "> 1 <")));
+}
+
+void TestBmapFile::roundTrip()
+{
+    QByteArray image = sampleImage();
+    BmapGenerator generator(4096);
+
+    /* Odd sizes, so blocks are split over several calls */
+    for (qsizetype pos = 0; pos < image.size(); pos += 1000)
+        generator.addData(image.constData()+pos, qMin((qsizetype) 1000, image.size()-pos));
+
+    BmapFile bmap;
+    QVERIFY2(bmap.parse(generator.toXml()), qPrintable(bmap.errorString()));
+    QVERIFY(bmap.isValid());
+    QVERIFY(bmap.unmappedIsZero());
+    QCOMPARE(bmap.imageSize(), (quint64) image.size());
+    QCOMPARE(bmap.mappedSize(), (quint64) 3*4096);
+
+    const QList<BmapFile::Range> &ranges = bmap.ranges();
+    QCOMPARE(ranges.size(), 2);
+    QCOMPARE(ranges[0].offset, (quint64) 0);
+    QCOMPARE(ranges[0].length, (quint64) 2*4096);
+    QCOMPARE(ranges[0].sha256, sha256(image.mid(0, 2*4096)));
+    QCOMPARE(ranges[1].offset, (quint64) 3*4096);
+    QCOMPARE(ranges[1].length, (quint64) 4096);
+    QCOMPARE(ranges[1].sha256, sha256(image.mid(3*4096, 4096)));
+}
+
+void TestBmapFile::partialLastBlock()
+{
+    QByteArray image = sampleImage().left(4*4096);
+    image.append(100, 'x');
+    BmapGenerator generator(4096);
+    generator.addData(image.constData(), image.size());
+
+    BmapFile bmap;
+    QVERIFY2(bmap.parse(generator.toXml()), qPrintable(bmap.errorString()));
+    QCOMPARE(bmap.imageSize(), (quint64) image.size());
+
+    /* Blocks 3 and 4 are one range. It must not extend past the end of the image */
+    const BmapFile::Range &last = bmap.ranges().last();
+    QCOMPARE(last.offset, (quint64) 3*4096);
+    QCOMPARE(last.length, (quint64) 4096+100);
+    QCOMPARE(last.sha256, sha256(image.mid(3*4096)));
+}
+
+void TestBmapFile::rejectsModifiedFile()
+{
+    QByteArray image = sampleImage();
+    BmapGenerator generator(4096);
+    generator.addData(image.constData(), image.size());
+    QByteArray xml = generator.toXml();
+
+    /* Covered by the file checksum */
+    xml.replace("<Range chksum=\""+sha256(image.mid(3*4096, 4096)), "<Range chksum=\""+QByteArray(64, 'a'));
+
+    BmapFile bmap;
+    QVERIFY(!bmap.parse(xml));
+    QVERIFY(!bmap.isValid());
+}
+
+void TestBmapFile::rejectsUnsupported()
+{
+    BmapFile bmap;
+    QVERIFY(!bmap.parse("<?xml version=\"1.0\" ?>\n<bmap version=\"1.4\"></bmap>\n"));
+    QVERIFY(!bmap.parse("not xml"));
+
+    QByteArray md5 = "<?xml version=\"1.0\" ?>\n"
+                     "<bmap version=\"2.0\">\n"
+                     "    <ImageSize> 4096 </ImageSize>\n"
+                     "    <BlockSize> 4096 </BlockSize>\n"
+                     "    <BlocksCount> 1 </BlocksCount>\n"
+                     "    <MappedBlocksCount> 1 </MappedBlocksCount>\n"
+                     "    <ChecksumType> md5 </ChecksumType>\n"
+                     "    <BlockMap>\n"
+                     "        <Range chksum=\"d41d8cd98f00b204e9800998ecf8427e\">0</Range>\n"
+                     "    </BlockMap>\n"
+                     "</bmap>\n";
+    QVERIFY(!bmap.parse(md5));
+}
+
+QTEST_APPLESS_MAIN(TestBmapFile)
+#include "tst_bmapfile.moc"
@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bzip2decoder.h"
+#include <QtTest>
+
+class TestBzip2Decoder : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void decodesBlocks_data();
+    void decodesBlocks();
+    void concatenatedStreams();
+    void falseEndOfStreamMagic();
+    void corruptData();
+
+private:
+    QByteArray _data;
+};
+
+/* Gives access to the frame splitting */
+class SplittingBzip2Decoder : public Bzip2Decoder
+{
+public:
+    SplittingBzip2Decoder() : Bzip2Decoder(1, 64*1024*1024) {}
+
+    /* Returns the offset at which the first block ends, or 0 on error */
+    size_t firstBlockEnd(const QByteArray &data)
+    {
+        size_t pos = 0;
+        while (pos < (size_t) data.size())
+        {
+            size_t frameLen = 0;
+            QByteArray frame;
+            FrameStatus status = _findFrame(data.constData()+pos, data.size()-pos, frameLen, frame);
+            if (status == FrameError || status == FrameIncomplete)
+                return 0;
+            pos += frameLen;
+            if (status == FrameComplete)
+                return pos;
+        }
+        return 0;
+    }
+};
+
+static QByteArray compress(const QByteArray &data)
+{
+    QByteArray out(data.size()+data.size()/100+600, 0);
+    unsigned int len = out.size();
+
+    /* Smallest block size, so there are several blocks */
+    if (BZ2_bzBuffToBuffCompress(out.data(), &len, (char *) data.constData(), data.size(), 1, 0, 0) != BZ_OK)
+        return QByteArray();
+    out.resize(len);
+    return out;
+}
+
+static StreamDecoder::Result decode(const QByteArray &in, size_t chunkSize, QByteArray &out, QString &error)
+{
+    Bzip2Decoder decoder(4, 64*1024*1024);
+    StreamDecoder::Result r = StreamDecoder::Ok;
+    QByteArray buf(65536, 0);
+    qsizetype pos = 0;
+
+    out.clear();
+    while (r == StreamDecoder::Ok)
+    {
+        size_t inLen = qMin((qsizetype) chunkSize, in.size()-pos);
+        const uint8_t *inPtr = (const uint8_t *) in.constData()+pos;
+        uint8_t *outPtr = (uint8_t *) buf.data();
+        size_t outLen = buf.size();
+
+        r = decoder.decode(inPtr, inLen, outPtr, outLen, pos+(qsizetype) inLen == in.size());
+        pos = inPtr-(const uint8_t *) in.constData();
+        out.append(buf.constData(), buf.size()-outLen);
+    }
+    error = decoder.errorString();
+
+    return r;
+}
+
+void TestBzip2Decoder::initTestCase()
+{
+    /* Compressible, but not so much that a block covers all of it */
+    QByteArray line;
+    for (int i = 0; i < 40000; i++)
+    {
+        line = QByteArray::number(i*2654435761u % 1000003)+" "+QByteArray::number(i)+"\n";
+        _data.append(line);
+    }
+}
+
+void TestBzip2Decoder::decodesBlocks_data()
+{
+    QTest::addColumn<int>("chunkSize");
+    QTest::newRow("all at once") << 64*1024*1024;
+    QTest::newRow("4 KB chunks") << 4096;
+    QTest::newRow("odd chunks") << 999;
+}
+
+void TestBzip2Decoder::decodesBlocks()
+{
+    QFETCH(int, chunkSize);
+    QByteArray compressed = compress(_data), out;
+    QString error;
+
+    QVERIFY(Bzip2Decoder::isBzip2(compressed.constData(), compressed.size()));
+    QCOMPARE(decode(compressed, chunkSize, out, error), StreamDecoder::StreamEnd);
+    QCOMPARE(out.size(), _data.size());
+    QVERIFY(out == _data);
+}
+
+void TestBzip2Decoder::concatenatedStreams()
+{
+    /* As written by parallel compressors like pbzip2 */
+    QByteArray first = _data.left(150000), second = _data.mid(150000);
+    QByteArray compressed = compress(first)+compress(second), out;
+    QString error;
+
+    QCOMPARE(decode(compressed, 4096, out, error), StreamDecoder::StreamEnd);
+    QVERIFY(out == _data);
+}
+
+void TestBzip2Decoder::falseEndOfStreamMagic()
+{
+    QByteArray compressed = compress(_data);
+    size_t end = SplittingBzip2Decoder().firstBlockEnd(compressed);
+    QVERIFY(end > 0);
+
+    /* End of stream magic inside the block, not followed by the stream CRC.
+       The block has to be split where it really ends */
+    const char eos[] = {0x17, 0x72, 0x45, 0x38, 0x50, (char) 0x90, 1, 2, 3, 4};
+    QByteArray falseMatch = compressed;
+    falseMatch.replace(end/2, sizeof(eos), eos, sizeof(eos));
+    QCOMPARE(SplittingBzip2Decoder().firstBlockEnd(falseMatch), end);
+}
+
+void TestBzip2Decoder::corruptData()
+{
+    QByteArray compressed = compress(_data), out;
+    QString error;
+
+    compressed[compressed.size()/2] = ~compressed[compressed.size()/2];
+    QCOMPARE(decode(compressed, 4096, out, error), StreamDecoder::Error);
+    QVERIFY(!error.isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestBzip2Decoder)
+#include "tst_bzip2decoder.moc"
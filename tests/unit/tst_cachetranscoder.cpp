@@ -0,0 +1,116 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachetranscoder.h"
+#include <QTemporaryDir>
+#include <QtEndian>
+#include <QtTest>
+#include <zstd.h>
+
+class TestCacheTranscoder : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void zstdSeekTable();
+    void rawKeepsHoles();
+    void formatFromString();
+
+private:
+    QTemporaryDir _dir;
+    QByteArray _image;
+};
+
+/* Image with runs of data and zeros, not ending at a frame boundary */
+void TestCacheTranscoder::init()
+{
+    QVERIFY(_dir.isValid());
+    _image = QByteArray(3*65536+12345, 0);
+    for (qsizetype i = 0; i < _image.size(); i++)
+    {
+        if ((i/8192) % 3 != 1)
+            _image[i] = (char) (i*7 + i/1000);
+    }
+}
+
+static quint32 readLE32(const QByteArray &data, qsizetype pos)
+{
+    return qFromLittleEndian<quint32>(data.constData()+pos);
+}
+
+void TestCacheTranscoder::zstdSeekTable()
+{
+    QString fileName = _dir.filePath("image.zst");
+    {
+        CacheTranscoder transcoder(fileName, CacheTranscoder::Zstd, 65536, 3);
+        for (qsizetype pos = 0; pos < _image.size(); pos += 10000)
+            transcoder.addData(_image.constData()+pos, qMin((qsizetype) 10000, _image.size()-pos));
+        QVERIFY2(transcoder.finish(), qPrintable(transcoder.errorString()));
+    }
+
+    QFile f(fileName);
+    QVERIFY(f.open(QIODevice::ReadOnly));
+    QByteArray data = f.readAll();
+
+    /* Seek table footer: number of frames, descriptor, seekable magic */
+    QVERIFY(data.size() > 9);
+    QCOMPARE(readLE32(data, data.size()-4), (quint32) 0x8F92EAB1);
+    QCOMPARE((int) data.at(data.size()-5), 0);
+    quint32 numFrames = readLE32(data, data.size()-9);
+    QCOMPARE(numFrames, (quint32) 4);
+
+    /* Skippable frame holding the table */
+    qsizetype tableSize = numFrames*8+9;
+    qsizetype tableStart = data.size()-tableSize-8;
+    QCOMPARE(readLE32(data, tableStart), (quint32) 0x184D2A5E);
+    QCOMPARE(readLE32(data, tableStart+4), (quint32) tableSize);
+
+    /* Each frame decompresses on its own to the size the table says */
+    QByteArray out;
+    qsizetype pos = 0;
+    for (quint32 i = 0; i < numFrames; i++)
+    {
+        quint32 compressedSize = readLE32(data, tableStart+8+i*8);
+        quint32 decompressedSize = readLE32(data, tableStart+8+i*8+4);
+        QCOMPARE(decompressedSize, (quint32) qMin((qsizetype) 65536, _image.size()-out.size()));
+
+        QByteArray frame(decompressedSize, 0);
+        size_t len = ZSTD_decompress(frame.data(), frame.size(), data.constData()+pos, compressedSize);
+        QVERIFY(!ZSTD_isError(len));
+        QCOMPARE(len, (size_t) decompressedSize);
+        out.append(frame);
+        pos += compressedSize;
+    }
+    QCOMPARE(pos, tableStart);
+    QVERIFY(out == _image);
+}
+
+void TestCacheTranscoder::rawKeepsHoles()
+{
+    QString fileName = _dir.filePath("image.img");
+    {
+        CacheTranscoder transcoder(fileName, CacheTranscoder::Raw, 65536, 0);
+        transcoder.addData(_image.constData(), _image.size());
+        QVERIFY2(transcoder.finish(), qPrintable(transcoder.errorString()));
+    }
+
+    QFile f(fileName);
+    QVERIFY(f.open(QIODevice::ReadOnly));
+    QVERIFY(f.readAll() == _image);
+}
+
+void TestCacheTranscoder::formatFromString()
+{
+    CacheTranscoder::Format format;
+    QVERIFY(CacheTranscoder::formatFromString("raw", format));
+    QCOMPARE(format, CacheTranscoder::Raw);
+    QVERIFY(CacheTranscoder::formatFromString("zstd", format));
+    QCOMPARE(format, CacheTranscoder::Zstd);
+    QVERIFY(!CacheTranscoder::formatFromString("compressed", format));
+}
+
+QTEST_APPLESS_MAIN(TestCacheTranscoder)
+#include "tst_cachetranscoder.moc"
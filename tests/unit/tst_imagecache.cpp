@@ -0,0 +1,173 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "imagecache.h"
+#include <QDateTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QtTest>
+
+class TestImageCache : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+    void loadChecksFiles();
+    void evictsLeastRecentlyUsed();
+    void touchKeepsImage();
+    void addReplacesOtherFormats();
+    void removesStaleFilesOnly();
+
+private:
+    QTemporaryDir *_dir;
+
+    void _createFile(const QString &name, qint64 size, const QDateTime &modified = QDateTime());
+    void _writeIndex(const QList<QPair<QByteArray, qint64>> &lastUsed);
+};
+
+void TestImageCache::init()
+{
+    _dir = new QTemporaryDir;
+    QVERIFY(_dir->isValid());
+}
+
+void TestImageCache::cleanup()
+{
+    delete _dir;
+}
+
+void TestImageCache::_createFile(const QString &name, qint64 size, const QDateTime &modified)
+{
+    QFile f(_dir->filePath(name));
+    QVERIFY(f.open(QIODevice::WriteOnly));
+    QVERIFY(f.write(QByteArray(size, 'x')) == size);
+    if (modified.isValid())
+        QVERIFY(f.setFileTime(modified, QFileDevice::FileModificationTime));
+}
+
+/* Index of compressed images of 1000 bytes, with their last use time */
+void TestImageCache::_writeIndex(const QList<QPair<QByteArray, qint64>> &lastUsed)
+{
+    QJsonArray entries;
+    for (const auto &e : lastUsed)
+    {
+        QJsonObject o;
+        o.insert("sha256", QString::fromLatin1(e.first));
+        o.insert("format", "compressed");
+        o.insert("size", 1000);
+        o.insert("last_used", e.second);
+        entries.append(o);
+    }
+
+    QJsonObject index;
+    index.insert("version", 1);
+    index.insert("entries", entries);
+
+    QFile f(_dir->filePath("index.json"));
+    QVERIFY(f.open(QIODevice::WriteOnly));
+    f.write(QJsonDocument(index).toJson());
+}
+
+void TestImageCache::loadChecksFiles()
+{
+    _createFile("aaaa.cache", 1000);
+    _createFile("bbbb.cache", 999);
+    _writeIndex({{"aaaa", 100}, {"bbbb", 200}, {"cccc", 300}});
+
+    /* bbbb changed size, cccc is gone */
+    ImageCache cache(_dir->path());
+    QVERIFY(cache.contains("aaaa"));
+    QVERIFY(!cache.contains("bbbb"));
+    QVERIFY(!cache.contains("cccc"));
+    QCOMPARE(cache.fileName("aaaa"), _dir->filePath("aaaa.cache"));
+}
+
+void TestImageCache::evictsLeastRecentlyUsed()
+{
+    _createFile("aaaa.cache", 1000);
+    _createFile("aaaa.bmap", 10);
+    _createFile("bbbb.cache", 1000);
+    _writeIndex({{"aaaa", 100}, {"bbbb", 200}});
+
+    ImageCache cache(_dir->path());
+    cache.setQuota(2500);
+    _createFile("cccc.cache", 1000);
+    cache.add("cccc");
+
+    QVERIFY(!cache.contains("aaaa"));
+    QVERIFY(!QFile::exists(_dir->filePath("aaaa.cache")));
+    QVERIFY(!QFile::exists(_dir->filePath("aaaa.bmap")));
+    QVERIFY(cache.contains("bbbb"));
+    QVERIFY(cache.contains("cccc"));
+
+    /* The index is kept up to date */
+    ImageCache reopened(_dir->path());
+    QVERIFY(!reopened.contains("aaaa"));
+    QVERIFY(reopened.contains("bbbb"));
+    QVERIFY(reopened.contains("cccc"));
+}
+
+void TestImageCache::touchKeepsImage()
+{
+    _createFile("aaaa.cache", 1000);
+    _createFile("bbbb.cache", 1000);
+    _writeIndex({{"aaaa", 100}, {"bbbb", 200}});
+
+    ImageCache cache(_dir->path());
+    cache.setQuota(2500);
+    cache.touch("aaaa");
+    _createFile("cccc.cache", 1000);
+    cache.add("cccc");
+
+    QVERIFY(cache.contains("aaaa"));
+    QVERIFY(!cache.contains("bbbb"));
+    QVERIFY(cache.contains("cccc"));
+}
+
+void TestImageCache::addReplacesOtherFormats()
+{
+    _createFile("aaaa.cache", 1000);
+    _writeIndex({{"aaaa", 100}});
+
+    ImageCache cache(_dir->path());
+    QCOMPARE(cache.fileName("aaaa", "zstd"), _dir->filePath("aaaa.zst"));
+    _createFile("aaaa.zst", 500);
+    cache.add("aaaa", "zstd");
+
+    QVERIFY(cache.contains("aaaa"));
+    QCOMPARE(cache.fileName("aaaa"), _dir->filePath("aaaa.zst"));
+    QVERIFY(!QFile::exists(_dir->filePath("aaaa.cache")));
+
+    ImageCache reopened(_dir->path());
+    QCOMPARE(reopened.fileName("aaaa"), _dir->filePath("aaaa.zst"));
+}
+
+void TestImageCache::removesStaleFilesOnly()
+{
+    QDateTime old = QDateTime::currentDateTime().addDays(-2);
+    _createFile("aaaa.cache", 1000);
+    _createFile("aaaa.img", 1000, old);
+    _createFile("dead.cache", 1000, old);
+    _createFile("dead.bmap", 10, old);
+    _createFile("live.cache", 1000);
+    _writeIndex({{"aaaa", 100}});
+
+    /* Files that are not in the index, and were not written to for a while, are left over from writes that did not complete.
+       Recent ones may still be downloaded to by another instance */
+    ImageCache cache(_dir->path());
+    QVERIFY(cache.contains("aaaa"));
+    QVERIFY(QFile::exists(_dir->filePath("aaaa.cache")));
+    QVERIFY(!QFile::exists(_dir->filePath("aaaa.img")));
+    QVERIFY(!QFile::exists(_dir->filePath("dead.cache")));
+    QVERIFY(!QFile::exists(_dir->filePath("dead.bmap")));
+    QVERIFY(QFile::exists(_dir->filePath("live.cache")));
+}
+
+QTEST_GUILESS_MAIN(TestImageCache)
+#include "tst_imagecache.moc"
@@ -0,0 +1,85 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "ringbuffer.h"
+#include <QByteArray>
+#include <QtTest>
+#include <thread>
+
+class TestRingBuffer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void passesDataInOrder();
+    void closeWhenEmpty();
+    void cancelWakesProducer();
+};
+
+void TestRingBuffer::passesDataInOrder()
+{
+    /* Writes larger than the ring, in sizes that do not divide it, so slices wrap around */
+    RingBuffer ring(4096);
+    QByteArray in(1024*1024+17, 0), out;
+    for (qsizetype i = 0; i < in.size(); i++)
+        in[i] = (char) (i*31 + i/4096);
+
+    std::thread producer([&ring, &in] {
+        qsizetype pos = 0, len = 1;
+        while (pos < in.size())
+        {
+            qsizetype n = qMin(len, in.size()-pos);
+            if (!ring.write(in.constData()+pos, n))
+                return;
+            pos += n;
+            len = len*3 % 10007;
+        }
+        ring.close();
+    });
+
+    const void *buf;
+    ssize_t len;
+    while ((len = ring.read(&buf)) > 0)
+    {
+        QVERIFY(len <= 4096);
+        out.append((const char *) buf, len);
+    }
+    producer.join();
+
+    QCOMPARE(len, (ssize_t) 0);
+    QCOMPARE(out.size(), in.size());
+    QVERIFY(out == in);
+}
+
+void TestRingBuffer::closeWhenEmpty()
+{
+    RingBuffer ring(4096);
+    const void *buf;
+
+    ring.close();
+    QCOMPARE(ring.read(&buf), (ssize_t) 0);
+}
+
+void TestRingBuffer::cancelWakesProducer()
+{
+    RingBuffer ring(4096);
+    QByteArray data(8192, 'x');
+    bool result = true;
+
+    /* Blocks, as nobody reads */
+    std::thread producer([&ring, &data, &result] {
+        result = ring.write(data.constData(), data.size());
+    });
+    QTest::qSleep(50);
+    ring.cancel();
+    producer.join();
+
+    const void *buf;
+    QVERIFY(!result);
+    QCOMPARE(ring.read(&buf), (ssize_t) -1);
+}
+
+QTEST_APPLESS_MAIN(TestRingBuffer)
+#include "tst_ringbuffer.moc"
@@ -0,0 +1,261 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "segmenteddownload.h"
+#include <QRegularExpression>
+#include <QSet>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QtTest>
+#include <atomic>
+
+/*
+ * Minimal HTTP server, answering one request per connection.
+ * Runs on a thread of its own, as the download blocks the test thread
+ */
+class RangeServer : public QThread
+{
+public:
+    enum Mode
+    {
+        Ranges,         /* answers range requests with 206 */
+        Truncate,       /* like Ranges, but drops the connection halfway through the first answer for each range end */
+        IgnoreRanges,   /* always sends all of the file with 200 */
+        Unavailable     /* always answers 503 */
+    };
+
+    RangeServer(const QByteArray &data, Mode mode)
+        : _data(data), _mode(mode), _port(0), _requests(0), _stop(false)
+    {
+        start();
+        while (!_port && isRunning())
+            QThread::msleep(10);
+    }
+
+    virtual ~RangeServer()
+    {
+        _stop = true;
+        wait();
+    }
+
+    QByteArray url() const
+    {
+        return "http://127.0.0.1:"+QByteArray::number(_port.load())+"/image.img";
+    }
+
+    int requests() const
+    {
+        return _requests;
+    }
+
+protected:
+    QByteArray _data;
+    Mode _mode;
+    std::atomic<quint16> _port;
+    std::atomic<int> _requests;
+    std::atomic<bool> _stop;
+    QSet<qsizetype> _truncated;
+
+    virtual void run()
+    {
+        QTcpServer server;
+        if (!server.listen(QHostAddress::LocalHost, 0))
+            return;
+        _port = server.serverPort();
+
+        while (!_stop)
+        {
+            if (!server.waitForNewConnection(100))
+                continue;
+            QTcpSocket *socket = server.nextPendingConnection();
+            _answer(socket);
+            delete socket;
+        }
+    }
+
+    void _answer(QTcpSocket *socket)
+    {
+        QByteArray request;
+        while (!request.contains("\r\n\r\n"))
+        {
+            if (!socket->waitForReadyRead(5000))
+                return;
+            request += socket->readAll();
+        }
+        _requests++;
+
+        QByteArray response;
+        qsizetype start = 0, end = _data.size()-1;
+        QRegularExpressionMatch range = QRegularExpression("\r\nRange: bytes=(\\d+)-(\\d+)\r\n", QRegularExpression::CaseInsensitiveOption).match(request);
+
+        if (_mode == Unavailable)
+        {
+            response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+        else if (range.hasMatch() && _mode != IgnoreRanges)
+        {
+            start = range.captured(1).toLongLong();
+            end = qMin(range.captured(2).toLongLong(), _data.size()-1);
+            response = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes "+QByteArray::number(start)+"-"+QByteArray::number(end)
+                    +"/"+QByteArray::number(_data.size())+"\r\n";
+        }
+        else
+        {
+            response = "HTTP/1.1 200 OK\r\n";
+        }
+
+        if (_mode != Unavailable)
+        {
+            qsizetype len = end-start+1;
+            response += "Content-Length: "+QByteArray::number(len)+"\r\nConnection: close\r\n\r\n";
+            if (_mode == Truncate && !_truncated.contains(end))
+            {
+                /* A range continued from where it stopped asks for the same end */
+                _truncated.insert(end);
+                len /= 2;
+            }
+            response += _data.mid(start, len);
+        }
+
+        socket->write(response);
+        while (socket->bytesToWrite() && socket->waitForBytesWritten(5000)) {}
+        socket->disconnectFromHost();
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+            socket->waitForDisconnected(1000);
+    }
+};
+
+class TestSegmentedDownload : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void reassembles_data();
+    void reassembles();
+    void resumesTruncatedRanges();
+    void failsOverToMirror();
+    void rangeIgnored();
+    void sinkStops();
+
+private:
+    QByteArray _data;
+
+    CURLcode _download(SegmentedDownload &download, QByteArray &out);
+};
+
+void TestSegmentedDownload::initTestCase()
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    _data = QByteArray(1000*1000+123, 0);
+    for (qsizetype i = 0; i < _data.size(); i++)
+        _data[i] = (char) (i*13 + i/65536);
+}
+
+void TestSegmentedDownload::cleanupTestCase()
+{
+    curl_global_cleanup();
+}
+
+CURLcode TestSegmentedDownload::_download(SegmentedDownload &download, QByteArray &out)
+{
+    out.clear();
+    download.setConfigureFunction([](CURL *c) {
+        curl_easy_setopt(c, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+    });
+
+    return download.perform([&out](const char *data, size_t len) {
+        out.append(data, len);
+        return true;
+    }, nullptr);
+}
+
+void TestSegmentedDownload::reassembles_data()
+{
+    QTest::addColumn<uint>("connections");
+    QTest::addColumn<int>("segmentSize");
+    QTest::addColumn<int>("windowSize");
+
+    QTest::newRow("one connection") << 1u << 65536 << 1024*1024;
+    QTest::newRow("small segments") << 4u << 10000 << 100000;
+    QTest::newRow("window of one segment per connection") << 8u << 65536 << 0;
+    QTest::newRow("segment larger than file") << 4u << 4*1024*1024 << 4*1024*1024;
+}
+
+void TestSegmentedDownload::reassembles()
+{
+    QFETCH(uint, connections);
+    QFETCH(int, segmentSize);
+    QFETCH(int, windowSize);
+
+    RangeServer server(_data, RangeServer::Ranges);
+    SegmentedDownload download(server.url(), _data.size(), connections, segmentSize, windowSize);
+    QByteArray out;
+
+    QCOMPARE(_download(download, out), CURLE_OK);
+    QCOMPARE(download.passedOn(), (curl_off_t) _data.size());
+    QCOMPARE(out.size(), _data.size());
+    QVERIFY(out == _data);
+}
+
+void TestSegmentedDownload::resumesTruncatedRanges()
+{
+    RangeServer server(_data, RangeServer::Truncate);
+    SegmentedDownload download(server.url(), _data.size(), 4, 100000, 1024*1024);
+    QByteArray out;
+
+    QCOMPARE(_download(download, out), CURLE_OK);
+    QVERIFY(out == _data);
+
+    /* 11 ranges, each continued once from where it stopped */
+    QCOMPARE(server.requests(), 22);
+}
+
+void TestSegmentedDownload::failsOverToMirror()
+{
+    RangeServer broken(_data, RangeServer::Unavailable);
+    RangeServer mirror(_data, RangeServer::Ranges);
+    SegmentedDownload download(broken.url(), _data.size(), 4, 100000, 1024*1024);
+    QByteArray out;
+
+    download.setMirrors({mirror.url()});
+    QCOMPARE(_download(download, out), CURLE_OK);
+    QVERIFY(out == _data);
+
+    /* Ranges started after the first failure go to the mirror straight away */
+    QVERIFY(broken.requests() < 10);
+}
+
+void TestSegmentedDownload::rangeIgnored()
+{
+    RangeServer server(_data, RangeServer::IgnoreRanges);
+    SegmentedDownload download(server.url(), _data.size(), 4, 100000, 1024*1024);
+    QByteArray out;
+
+    /* Found out before any of the file is passed on, so the caller can download it with a single connection */
+    QCOMPARE(_download(download, out), CURLE_RANGE_ERROR);
+    QCOMPARE(download.passedOn(), (curl_off_t) 0);
+    QVERIFY(out.isEmpty());
+    QVERIFY(!download.errorString().isEmpty());
+}
+
+void TestSegmentedDownload::sinkStops()
+{
+    RangeServer server(_data, RangeServer::Ranges);
+    SegmentedDownload download(server.url(), _data.size(), 4, 100000, 1024*1024);
+    qsizetype received = 0;
+
+    CURLcode ret = download.perform([&received](const char *, size_t len) {
+        received += len;
+        return received < 200000;
+    }, nullptr);
+    QCOMPARE(ret, CURLE_WRITE_ERROR);
+}
+
+QTEST_GUILESS_MAIN(TestSegmentedDownload)
+#include "tst_segmenteddownload.moc"
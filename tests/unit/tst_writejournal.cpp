@@ -0,0 +1,92 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "writejournal.h"
+#include <QTemporaryDir>
+#include <QtTest>
+
+class TestWriteJournal : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void roundTrip();
+    void differentWrite();
+    void incompleteLastLine();
+    void remove();
+
+private:
+    QTemporaryDir _dir;
+    QString _file;
+};
+
+void TestWriteJournal::init()
+{
+    QVERIFY(_dir.isValid());
+    _file = _dir.filePath("resume.journal");
+    QFile::remove(_file);
+}
+
+void TestWriteJournal::roundTrip()
+{
+    WriteJournal journal(_file);
+    QVERIFY(journal.load("image", "/dev/sda", 1000000, 4096).isEmpty());
+
+    QVERIFY(journal.start("image", "/dev/sda", 1000000, 4096, {0x1, 0x2}));
+    QVERIFY(journal.append({0xfedcba9876543210ULL}));
+    QVERIFY(journal.append({}));
+    QCOMPARE(journal.count(), (qsizetype) 3);
+
+    WriteJournal reopened(_file);
+    QCOMPARE(reopened.load("image", "/dev/sda", 1000000, 4096), QList<quint64>({0x1, 0x2, 0xfedcba9876543210ULL}));
+}
+
+void TestWriteJournal::differentWrite()
+{
+    WriteJournal journal(_file);
+    QVERIFY(journal.start("image", "/dev/sda", 1000000, 4096, {0x1}));
+
+    WriteJournal reopened(_file);
+    QVERIFY(reopened.load("other image", "/dev/sda", 1000000, 4096).isEmpty());
+    QVERIFY(reopened.load("image", "/dev/sdb", 1000000, 4096).isEmpty());
+    QVERIFY(reopened.load("image", "/dev/sda", 2000000, 4096).isEmpty());
+    QVERIFY(reopened.load("image", "/dev/sda", 1000000, 8192).isEmpty());
+    QCOMPARE(reopened.load("image", "/dev/sda", 1000000, 4096).size(), 1);
+}
+
+void TestWriteJournal::incompleteLastLine()
+{
+    WriteJournal journal(_file);
+    QVERIFY(journal.start("image", "/dev/sda", 1000000, 4096, {0x1, 0x2}));
+
+    /* As left behind by a crash in the middle of writing a line */
+    QFile f(_file);
+    QVERIFY(f.open(QIODevice::Append));
+    f.write("2 abc");
+    f.close();
+
+    WriteJournal reopened(_file);
+    QCOMPARE(reopened.load("image", "/dev/sda", 1000000, 4096), QList<quint64>({0x1, 0x2}));
+
+    /* Once complete, the line counts. Lines out of order do not */
+    QVERIFY(f.open(QIODevice::Append));
+    f.write("\n5 abc\n");
+    f.close();
+    QCOMPARE(reopened.load("image", "/dev/sda", 1000000, 4096), QList<quint64>({0x1, 0x2, 0xabc}));
+}
+
+void TestWriteJournal::remove()
+{
+    WriteJournal journal(_file);
+    QVERIFY(journal.start("image", "/dev/sda", 1000000, 4096, {0x1}));
+    journal.remove();
+
+    QVERIFY(!QFile::exists(_file));
+    QCOMPARE(journal.count(), (qsizetype) 0);
+}
+
+QTEST_APPLESS_MAIN(TestWriteJournal)
+#include "tst_writejournal.moc"